@@ -0,0 +1,245 @@
+#!/usr/bin/env python
+#
+# Benchmarks fatfsimage against reproducible synthetic source trees.
+#
+# Each scenario's tree is generated from a fixed seed, so the same files are
+# produced on every host and every run.  The tool is run with --timings and
+# the per-phase wall time, CPU time and syscall counts are collected into a
+# single JSON document along with throughput figures, ready to be compared
+# with earlier runs.
+#
+# Usage: bench.py --tool build/fatfsimage/fatfsimage [--work DIR] [--out FILE]
+#                 [--repeat N] [--scenario NAME]... [-- extra tool options]
+#
+
+from __future__ import print_function
+
+import argparse
+import json
+import os
+import platform
+import random
+import shutil
+import subprocess
+import sys
+import time
+
+SECTOR = 4096
+
+# name: description
+SCENARIOS = {
+    "tiny": "5000 files of 16 to 2048 bytes in 50 directories",
+    "huge": "4 files of 8 MB",
+    "deep": "64 nested directories with 4 files each",
+    "wide": "one directory with 4000 files",
+    "mixed": "a bit of everything",
+}
+
+
+def write_file(path, rnd, size):
+    # Random but cheap to generate: repeat a random 4 KB block
+    block = bytearray(rnd.getrandbits(8) for _ in range(min(size, SECTOR)))
+    with open(path, "wb") as f:
+        left = size
+        while left > 0:
+            n = min(left, len(block))
+            f.write(block[:n])
+            left -= n
+    return size
+
+
+def generate(name, root, seed):
+    rnd = random.Random("%s-%d" % (name, seed))
+    total = 0
+    os.makedirs(root)
+
+    if name in ("tiny", "mixed"):
+        count = 5000 if name == "tiny" else 1000
+        for i in range(count):
+            d = os.path.join(root, "dir%02d" % (i % 50))
+            if not os.path.isdir(d):
+                os.makedirs(d)
+            total += write_file(os.path.join(d, "f%05d.bin" % i), rnd, rnd.randint(16, 2048))
+
+    if name in ("huge", "mixed"):
+        count = 4 if name == "huge" else 1
+        for i in range(count):
+            total += write_file(os.path.join(root, "big%d.bin" % i), rnd, 8 * 1024 * 1024)
+
+    if name in ("deep", "mixed"):
+        d = root
+        for level in range(64 if name == "deep" else 16):
+            d = os.path.join(d, "level%02d" % level)
+            os.makedirs(d)
+            for i in range(4):
+                total += write_file(os.path.join(d, "file%d.dat" % i), rnd, rnd.randint(100, 20000))
+
+    if name in ("wide", "mixed"):
+        d = os.path.join(root, "wide")
+        os.makedirs(d)
+        for i in range(4000 if name == "wide" else 500):
+            # Long mixed case names need LFN entries, like real assets do
+            total += write_file(os.path.join(d, "Asset_Sprite_%05d.png" % i), rnd, rnd.randint(200, 4000))
+
+    return total
+
+
+def tree_stats(root):
+    files = 0
+    dirs = 0
+    used = 0
+    for path, dirnames, filenames in os.walk(root):
+        dirs += len(dirnames)
+        for fn in filenames:
+            files += 1
+            size = os.path.getsize(os.path.join(path, fn))
+            used += (size + SECTOR - 1) // SECTOR * SECTOR
+    return files, dirs, used
+
+
+def image_kb(root):
+    # Room for the data at 4 KB clusters, directories, the FAT, wear
+    # levelling and some slack, rounded up to 64 KB
+    files, dirs, used = tree_stats(root)
+    need = used * 5 // 4 + (dirs + 1) * 8 * SECTOR + (files * 32) + 64 * SECTOR
+    return max(1024, (need + 65535) // 65536 * 64)
+
+
+def run(tool, extra, work, name, tree, kb):
+    image = os.path.join(work, name + ".img")
+    timings = os.path.join(work, name + ".json")
+    cmd = [tool, "--timings=" + timings] + extra + [image, str(kb), tree]
+
+    start = time.time()
+    proc = subprocess.Popen(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    output = proc.communicate()[0]
+    wall = time.time() - start
+
+    if proc.returncode != 0 or not os.path.exists(timings):
+        sys.stderr.write(output.decode("utf-8", "replace"))
+        raise RuntimeError("%s failed with %d" % (" ".join(cmd), proc.returncode))
+
+    with open(timings) as f:
+        result = json.load(f)
+
+    os.remove(timings)
+    os.remove(image)
+
+    result["process_wall"] = wall
+    return result
+
+
+def summarize(name, tree_bytes, runs):
+    phases = {}
+    for r in runs:
+        for p in r["phases"]:
+            phases.setdefault(p["name"], []).append(p)
+
+    summary = []
+    for p in runs[0]["phases"]:
+        samples = phases[p["name"]]
+        walls = sorted(s["wall"] for s in samples)
+        entry = {
+            "name": p["name"],
+            "wall_min": walls[0],
+            "wall_median": walls[len(walls) // 2],
+            "user": min(s["user"] for s in samples),
+            "sys": min(s["sys"] for s in samples),
+            "read_calls": samples[0]["read_calls"],
+            "write_calls": samples[0]["write_calls"],
+            "read_bytes": samples[0]["read_bytes"],
+            "write_bytes": samples[0]["write_bytes"],
+        }
+        if p["name"] == "load_files" and walls[0] > 0:
+            entry["source_mb_per_sec"] = tree_bytes / walls[0] / (1024 * 1024)
+        summary.append(entry)
+
+    totals = sorted(r["process_wall"] for r in runs)
+    return {
+        "scenario": name,
+        "description": SCENARIOS[name],
+        "source_bytes": tree_bytes,
+        "image_bytes": runs[0]["image_bytes"],
+        "directories": runs[0]["directories"],
+        "files": runs[0]["files"],
+        "runs": len(runs),
+        "wall_min": totals[0],
+        "wall_median": totals[len(totals) // 2],
+        "source_mb_per_sec": tree_bytes / totals[0] / (1024 * 1024),
+        "phases": summary,
+    }
+
+
+def git_revision(path):
+    try:
+        return subprocess.check_output(["git", "-C", path, "rev-parse", "HEAD"],
+                                       stderr=subprocess.STDOUT).decode().strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+# Written into the scratch directory, so only a directory this script made
+# is ever cleared out
+WORK_MARKER = ".fatfsimage-bench"
+
+
+def prepare_work(work):
+    """Empties the scratch directory left by an earlier run, or makes a new one."""
+    if os.path.exists(work):
+        if os.listdir(work) and not os.path.isfile(os.path.join(work, WORK_MARKER)):
+            sys.exit("%s exists and wasn't made by bench.py, pick another --work directory" % work)
+        shutil.rmtree(work)
+    os.makedirs(work)
+    open(os.path.join(work, WORK_MARKER), "w").close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Benchmark fatfsimage on synthetic source trees.")
+    parser.add_argument("--tool", required=True, help="fatfsimage binary")
+    parser.add_argument("--work", default="fatfsimage-bench", help="scratch directory for trees and images")
+    parser.add_argument("--out", default="-", help="results file (- for stdout)")
+    parser.add_argument("--repeat", type=int, default=3, help="runs per scenario")
+    parser.add_argument("--seed", type=int, default=1, help="tree generator seed")
+    parser.add_argument("--scenario", action="append", choices=sorted(SCENARIOS), help="scenario to run (default all)")
+    parser.add_argument("--keep", action="store_true", help="keep the generated trees")
+    parser.add_argument("extra", nargs="*", help="extra fatfsimage options, after --")
+    args = parser.parse_args()
+
+    tool = os.path.abspath(args.tool)
+    prepare_work(args.work)
+
+    results = {
+        "time": time.strftime("%Y-%m-%dT%H:%M:%SZ", time.gmtime()),
+        "host": platform.node(),
+        "platform": platform.platform(),
+        "cpus": os.sysconf("SC_NPROCESSORS_ONLN") if hasattr(os, "sysconf") else None,
+        "revision": git_revision(os.path.dirname(os.path.abspath(__file__))),
+        "tool": tool,
+        "options": args.extra,
+        "seed": args.seed,
+        "scenarios": [],
+    }
+
+    for name in args.scenario or sorted(SCENARIOS):
+        tree = os.path.join(args.work, name)
+        tree_bytes = generate(name, tree, args.seed)
+        kb = image_kb(tree)
+
+        sys.stderr.write("%s: %d bytes of sources, %d KB image\n" % (name, tree_bytes, kb))
+
+        runs = [run(tool, args.extra, args.work, name, tree, kb) for _ in range(args.repeat)]
+        results["scenarios"].append(summarize(name, tree_bytes, runs))
+
+        if not args.keep:
+            shutil.rmtree(tree)
+
+    text = json.dumps(results, indent=2, sort_keys=True)
+    if args.out == "-":
+        print(text)
+    else:
+        with open(args.out, "w") as f:
+            f.write(text + "\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -8,13 +8,22 @@ COMPONENT_PRIV_INCLUDEDIRS := private
 
 CC = gcc
 CXX = g++
+AR = ar
 
 CPPFLAGS = -D_XOPEN_SOURCE=500 \
            -D_GNU_SOURCE \
            -DLOG_LOCAL_LEVEL=10 \
            -include stdlib.h
 
-CFLAGS = -O0 -g
+FATFSIMAGE_CFLAGS ?= -O0 -g
+
+CFLAGS = $(FATFSIMAGE_CFLAGS)
+
+LIBS = -lc -lpthread -lz
+
+ifdef CONFIG_FATFSIMAGE_IO_URING
+LIBS += -luring
+endif
 
 CXXFLAGS = $(CFLAGS)
 
@@ -29,18 +38,34 @@ INCLUDES = $(COMPONENT_PATH)/private \
            ${IDF_PATH}/components/wear_levelling/private_include \
            ${IDF_PATH}/components/console/argtable3
 
-OBJS = $(COMPONENT_BUILD_DIR)/fatfsimage.o \
-       $(COMPONENT_BUILD_DIR)/WL_Flash.o \
-       $(COMPONENT_BUILD_DIR)/crc32.o \
-       $(COMPONENT_BUILD_DIR)/crc.o \
-       $(COMPONENT_BUILD_DIR)/argtable3.o \
-       $(COMPONENT_BUILD_DIR)/ff.o \
-       $(COMPONENT_BUILD_DIR)/ffsystem.o \
-       $(COMPONENT_BUILD_DIR)/ffunicode.o 
+# The image builder library (see fatfsimage.h), which the command is a thin
+# wrapper around.  It can't be called libfatfsimage.a as that name belongs
+# to the component archive the main app build links.
+LIB = $(COMPONENT_BUILD_DIR)/libfatfsbuilder.a
+
+LIB_OBJS = $(COMPONENT_BUILD_DIR)/fatfsimage.o \
+           $(COMPONENT_BUILD_DIR)/WL_Flash.o \
+           $(COMPONENT_BUILD_DIR)/crc32.o \
+           $(COMPONENT_BUILD_DIR)/crc.o \
+           $(COMPONENT_BUILD_DIR)/argtable3.o \
+           $(COMPONENT_BUILD_DIR)/ff.o \
+           $(COMPONENT_BUILD_DIR)/ffsystem.o \
+           $(COMPONENT_BUILD_DIR)/ffunicode.o
+
+OBJS = $(COMPONENT_BUILD_DIR)/main.o
+
+TRACE_OBJS = $(COMPONENT_BUILD_DIR)/fatfstrace.o \
+             $(COMPONENT_BUILD_DIR)/argtable3.o
 
-build: $(COMPONENT_BUILD_DIR)/fatfsimage
+build: $(COMPONENT_BUILD_DIR)/fatfsimage $(COMPONENT_BUILD_DIR)/fatfstrace
 
-$(COMPONENT_BUILD_DIR)/fatfsimage.o: $(COMPONENT_PATH)/fatfsimage.cpp
+$(COMPONENT_BUILD_DIR)/main.o: $(COMPONENT_PATH)/main.cpp $(COMPONENT_PATH)/fatfsimage.h
+	$(CXX) $(CXXFLAGS) $(CPPFLAGS) $(addprefix -I ,$(INCLUDES)) -c $< -o $@
+
+$(COMPONENT_BUILD_DIR)/fatfsimage.o: $(COMPONENT_PATH)/fatfsimage.cpp $(COMPONENT_PATH)/fatfsimage.h $(COMPONENT_PATH)/fatfstrace.h $(COMPONENT_PATH)/memoryflash.h
+	$(CXX) $(CXXFLAGS) $(CPPFLAGS) $(addprefix -I ,$(INCLUDES)) -c $< -o $@
+
+$(COMPONENT_BUILD_DIR)/fatfstrace.o: $(COMPONENT_PATH)/fatfstrace.cpp $(COMPONENT_PATH)/fatfstrace.h $(COMPONENT_PATH)/memoryflash.h
 	$(CXX) $(CXXFLAGS) $(CPPFLAGS) $(addprefix -I ,$(INCLUDES)) -c $< -o $@
 
 $(COMPONENT_BUILD_DIR)/WL_Flash.o: ${IDF_PATH}/components/wear_levelling/WL_Flash.cpp
@@ -64,9 +89,16 @@ $(COMPONENT_BUILD_DIR)/ffsystem.o: ${IDF_PATH}/components/fatfs/src/ffsystem.c
 $(COMPONENT_BUILD_DIR)/ffunicode.o: ${IDF_PATH}/components/fatfs/src/ffunicode.c
 	$(CC) $(CFLAGS) $(CPPFLAGS) $(addprefix -I ,$(INCLUDES)) -c $< -o $@
 
-$(COMPONENT_BUILD_DIR)/fatfsimage: $(OBJS)
-	$(CXX) $(CFLAGS) $(CPPFLAGS) $(addprefix -I ,$(INCLUDES)) $(OBJS) -o $@ -lc
+$(LIB): $(LIB_OBJS)
+	rm -f $@
+	$(AR) rcs $@ $(LIB_OBJS)
+
+$(COMPONENT_BUILD_DIR)/fatfsimage: $(OBJS) $(LIB)
+	$(CXX) $(CFLAGS) $(CPPFLAGS) $(addprefix -I ,$(INCLUDES)) $(OBJS) $(LIB) -o $@ $(LIBS)
 	# Create dummy archive to satisfy main app build
 	echo "!<arch>" >$(COMPONENT_BUILD_DIR)/libfatfsimage.a
 
+$(COMPONENT_BUILD_DIR)/fatfstrace: $(TRACE_OBJS)
+	$(CXX) $(CFLAGS) $(CPPFLAGS) $(TRACE_OBJS) -o $@
+
 .PHONY: build
@@ -12,22 +12,52 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <ctype.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include "sdkconfig.h"
 
 #include "argtable3.h"
+#include "crc32.h"
 #include "diskio.h"
 #include "esp_err.h"
 #include "esp_log.h"
 #include "esp_spi_flash.h"
+#include "fatfsimage.h"
+#include "fatfstrace.h"
 #include "ff.h"
+#include "memoryflash.h"
 #include "WL_Flash.h"
 
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#if CONFIG_FATFSIMAGE_IO_URING
+#include <liburing.h>
+#endif
+
 // Copied from "esp-idf/components/wear_leveling/wear_leveling.cpp"
 #ifndef MAX_WL_HANDLES
 #define MAX_WL_HANDLES 8
@@ -53,566 +83,8761 @@
 #define WL_CURRENT_VERSION  1
 #endif //WL_CURRENT_VERSION
 
+// Erase cycles each flash sector is assumed to survive when projecting
+// lifetimes in the wear levelling simulation
+#ifndef SIM_ENDURANCE
+#define SIM_ENDURANCE 100000
+#endif // SIM_ENDURANCE
+
+// Default device time for each sector read by the mount report, per KB of
+// filesystem sector.  Roughly a 40MHz QIO flash read.
+#ifndef READ_COST_US_PER_KB
+#define READ_COST_US_PER_KB 50
+#endif // READ_COST_US_PER_KB
+
+// Room "--auto-size" leaves for more data, as a percentage of what the
+// sources need
+#ifndef SIZE_HEADROOM_PERCENT
+#define SIZE_HEADROOM_PERCENT 10
+#endif // SIZE_HEADROOM_PERCENT
+
+// Source files are handed from the reader threads to the FatFs writer in
+// chunks of this size.  Each reader gets PREFETCH_CHUNKS of them.
+#ifndef PREFETCH_CHUNK_SIZE
+#define PREFETCH_CHUNK_SIZE (64 * 1024)
+#endif // PREFETCH_CHUNK_SIZE
+
+#ifndef PREFETCH_CHUNKS
+#define PREFETCH_CHUNKS 8
+#endif // PREFETCH_CHUNKS
+
+// Mapped source files are handed to f_write() in spans of whole clusters
+// no larger than this.
+#ifndef MMAP_SPAN_SIZE
+#define MMAP_SPAN_SIZE (1024 * 1024)
+#endif // MMAP_SPAN_SIZE
+
+#ifndef PREFETCH_DEFAULT_JOBS
+#define PREFETCH_DEFAULT_JOBS 4
+#endif // PREFETCH_DEFAULT_JOBS
+
+// Scanning is bound by metadata round trips rather than bandwidth, so it
+// pays to keep more of them in flight than there are readers
+#ifndef SCAN_DEFAULT_JOBS
+#define SCAN_DEFAULT_JOBS 16
+#endif // SCAN_DEFAULT_JOBS
+
+// Image data is fed to the compressor in pieces of this size
+#ifndef COMPRESS_CHUNK_SIZE
+#define COMPRESS_CHUNK_SIZE (64 * 1024)
+#endif // COMPRESS_CHUNK_SIZE
+
+// Writes kept in flight by the --cache backend
+#ifndef CACHE_DEFAULT_DEPTH
+#define CACHE_DEFAULT_DEPTH 32
+#endif // CACHE_DEFAULT_DEPTH
+
+// Sparse image files (--sparse) start with a header followed by chunks, each
+// covering a run of flash sectors.  Data chunks are followed by the
+// sectors' contents and fill chunks stand for sectors that are all "fill".
+// Everything is little-endian.
+#define SPARSE_MAGIC "FFISPARS"
+#define SPARSE_VERSION 1
+
+// Data chunks are split at this size so they can be built in memory
+#ifndef SPARSE_CHUNK_MAX
+#define SPARSE_CHUNK_MAX (1024 * 1024)
+#endif // SPARSE_CHUNK_MAX
+
+enum
+{
+    SPARSE_DATA = 1,
+    SPARSE_FILL = 2
+};
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t sector_size;
+    uint64_t image_bytes;
+    uint32_t chunks;
+    uint32_t reserved;
+} sparse_header;
+
+typedef struct
+{
+    uint32_t type;
+    uint32_t sectors;
+    uint32_t fill;
+    uint32_t reserved;
+} sparse_chunk;
+
 static const char TAG[] = "FatFSImage";
 static const char drv[] = "FatFSImage";
+static const char plan_drv[] = "1:";
 static WL_Flash flash;
 
-class FatFSImage : public Flash_Access
+// FatFs physical drives.  Drive 0 is the image being built and drive 1 is a
+// scratch volume used by the layout planner.  The FatFs sector size may be
+// smaller than the flash sector size, in which case disk_write() does a
+// read-modify-write of the flash sector like WL_Ext_Perf does on the device.
+typedef struct
 {
-private:
-    typedef struct
-    {
-        const char *srcbase;
-        const char *dstbase;
-        int srclen;
-        int dstlen;
-        char src[PATH_MAX];
-        char dst[PATH_MAX];
-        char buf[SPI_FLASH_SEC_SIZE];
-    } copy_state;
+    Flash_Access *flash;
+    size_t sector_size;
+    uint64_t sectors_read;          // by disk_read(), for the mount report
+} disk_drive;
 
-public:
-    FatFSImage();
-    virtual ~FatFSImage();
+static disk_drive drives[FF_VOLUMES] =
+{
+    { &flash, SPI_FLASH_SEC_SIZE },
+};
 
-    esp_err_t main(int argc, char *argv[]);
-    esp_err_t parse(int argc, char *argv[]);
-    esp_err_t init_wear_levelling();
-    esp_err_t create_image();
-    esp_err_t create_filesystem();
-    esp_err_t load_files();
-    esp_err_t copy(const char *src, const char *dst);
-    esp_err_t copy_sub(copy_state *cs);
+// ============================================================================
+// I/O statistics and tracing
+//
+// With --stats every call through disk_*(), the wear levelling layer and
+// the image's Flash_Access methods is counted and timed, and with --trace
+// each one is also recorded in a binary trace (see fatfstrace.h).  Only
+// drive 0 is counted, and all of these calls come from the one thread doing
+// the filesystem work, so no locking is needed.
+// ============================================================================
 
-    //
-    // Flash_Access implementaion
-    //
-    virtual size_t chip_size() final;
-    virtual esp_err_t erase_sector(size_t sector) final;
-    virtual esp_err_t erase_range(size_t start_address, size_t size) final;
-    virtual esp_err_t write(size_t dest_addr, const void *src, size_t size) final;
-    virtual esp_err_t read(size_t src_addr, void *dest, size_t size) final;
-    virtual size_t sector_size() final;
+enum
+{
+    STAT_DISK_READ,
+    STAT_DISK_WRITE,
+    STAT_DISK_IOCTL,
+    STAT_WL_READ,
+    STAT_WL_WRITE,
+    STAT_WL_ERASE,
+    STAT_IMAGE_READ,
+    STAT_IMAGE_WRITE,
+    STAT_IMAGE_ERASE,
+    STAT_COUNT
+};
 
-private:
-    struct
-    {
-        struct arg_lit *help;
-        struct arg_int *level;
-        struct arg_file *image;
-        struct arg_int *kb;
-        struct arg_file *paths;
-        struct arg_end *end;
-    }
-    args =
-    {
-        arg_litn("h", "help", 0, 1, "display this help and exit"),
-        arg_intn("l", "log", "<level>", 0, 1, "log level (0-5, 3 is default)"),
-        arg_filen(NULL, NULL, "<image>", 1, 1, "image file name"),
-        arg_intn(NULL, NULL, "<KB>", 1, 1, "disk size in KB"),
-        arg_filen(NULL, NULL, "<paths>", 1, 20, "directories/files to load"),
-        arg_end(1),
-    };
-    void **argtable = (void **) &args; // shame on me ;-)
-    static const int argcount = sizeof(args) / sizeof(void *);
+// Latency histogram buckets double in size, the first one holding calls of
+// up to 2^STAT_FIRST_BUCKET ns and the last everything that's slower
+#define STAT_BUCKETS 24
+#define STAT_FIRST_BUCKET 7
 
-    FILE *image;
-    FATFS *fs;
-    uint32_t image_bytes = 0;
-    uint32_t sector_bytes = 0;
-    uint32_t sector_count = 0;
-    uint32_t numdirs = 0;
-    uint32_t numfiles = 0;
+typedef struct
+{
+    const char *name;
+    uint64_t calls;
+    uint64_t bytes;
+    uint64_t nsecs;
+    uint64_t max_nsecs;
+    uint64_t hist[STAT_BUCKETS];
+} io_stat;
+
+// Trace records are collected in a ring and written out whenever it fills
+#ifndef TRACE_RING_RECORDS
+#define TRACE_RING_RECORDS 65536
+#endif // TRACE_RING_RECORDS
+
+static bool stats_enabled = false;
+static FILE *trace_file = NULL;
+static trace_record *trace_ring = NULL;
+static size_t trace_count = 0;
+static uint64_t trace_start = 0;
+static bool trace_failed = false;
+
+// Trace layer and operation of each counter
+static const uint8_t stat_trace[STAT_COUNT][2] =
+{
+    { TRACE_DISK, TRACE_READ },
+    { TRACE_DISK, TRACE_WRITE },
+    { TRACE_DISK, TRACE_IOCTL },
+    { TRACE_WL, TRACE_READ },
+    { TRACE_WL, TRACE_WRITE },
+    { TRACE_WL, TRACE_ERASE },
+    { TRACE_IMAGE, TRACE_READ },
+    { TRACE_IMAGE, TRACE_WRITE },
+    { TRACE_IMAGE, TRACE_ERASE },
 };
 
-FatFSImage::FatFSImage()
+static io_stat io_stats[STAT_COUNT] =
 {
-    sector_bytes = SPI_FLASH_SEC_SIZE;
-    image = NULL;
-    fs = NULL;
-    numdirs = 0;
-    numfiles = 0;
-}
+    { "disk_read" },
+    { "disk_write" },
+    { "disk_ioctl" },
+    { "wl_read" },
+    { "wl_write" },
+    { "wl_erase" },
+    { "image_read" },
+    { "image_write" },
+    { "image_erase" },
+};
 
-FatFSImage::~FatFSImage()
+static uint64_t stat_now()
 {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-int FatFSImage::main(int argc, char *argv[])
+static void stat_record(int which, size_t bytes, uint64_t nsecs)
 {
-    esp_err_t err = ESP_FAIL;
+    io_stat *st = &io_stats[which];
 
-    if (parse(argc, argv) == ESP_OK)
+    int bucket = 0;
+    while (bucket < STAT_BUCKETS - 1 && nsecs > ((uint64_t) 1 << (bucket + STAT_FIRST_BUCKET)))
     {
-        if (create_image() == ESP_OK)
-        {
-            if (init_wear_levelling() == ESP_OK)
-            {
-                if (create_filesystem() == ESP_OK)
-                {
-                    if (load_files() == ESP_OK)
-                    {
-                        FATFS *fs;
-                        DWORD nfree = 0;
-                        FRESULT res = f_getfree(drv, &nfree, &fs);
-                        printf("Filesystem created\n\n");
-                        printf("  directories created: %d\n", numdirs);
-                        printf("  files copied: %d\n", numfiles);
-                        printf("\n");
+        bucket++;
+    }
 
-                        printf("  flash sector size: %d\n", SPI_FLASH_SEC_SIZE);
-                        printf("  flash sectors: %d\n", image_bytes / SPI_FLASH_SEC_SIZE);
-                        printf("\n");
-                        printf("  filesystem sector size: %d\n", fs->ssize);
-                        printf("  filesystem sectors: %d\n", image_bytes / fs->ssize);
-                        printf("  filesystem cluster size: %d\n", fs->csize * fs->ssize);
-                        printf("  filesystem total clusters: %d\n", fs->n_fatent - 2);
-                        printf("  filesystem free clusters: %d\n", nfree);
-                        
-                        err = ESP_OK;
-                    }
-                    
-                    f_unmount(drv);
-                    delete fs;
-                }
-            }
+    st->calls++;
+    st->bytes += bytes;
+    st->nsecs += nsecs;
+    st->hist[bucket]++;
+    if (nsecs > st->max_nsecs)
+    {
+        st->max_nsecs = nsecs;
+    }
+}
 
-            fclose(image);
+static void trace_flush()
+{
+    if (trace_count > 0 && !trace_failed)
+    {
+        if (fwrite(trace_ring, sizeof(trace_record), trace_count, trace_file) != trace_count)
+        {
+            ESP_LOGE(TAG, "Trace write failed with %d", errno);
+            trace_failed = true;
         }
-
-        arg_freetable(argtable, argcount);
     }
 
-    return err;
+    trace_count = 0;
 }
 
-esp_err_t FatFSImage::parse(int argc, char *argv[])
+static void trace_add(int which, size_t addr, size_t bytes, uint64_t start, uint64_t nsecs)
 {
-    esp_err_t err;
+    trace_record *rec = &trace_ring[trace_count++];
 
-    int err_cnt = arg_parse(argc, argv, argtable);
+    memset(rec, 0, sizeof(*rec));
+    rec->time = start - trace_start;
+    rec->addr = addr;
+    rec->len = bytes;
+    rec->nsecs = nsecs > UINT32_MAX ? UINT32_MAX : nsecs;
+    rec->layer = stat_trace[which][0];
+    rec->op = stat_trace[which][1];
 
-    if (args.help->count > 0)
+    if (trace_count == TRACE_RING_RECORDS)
     {
-        printf("Usage: %s", argv[0]);
-        arg_print_syntax(stdout, argtable, "\n");
+        trace_flush();
+    }
+}
 
-        printf("Create and load a FATFS disk image.\n\n");
-        arg_print_glossary(stdout, argtable, "  %-25s %s\n");
+static esp_err_t trace_open(const char *path, const trace_header *hdr)
+{
+    trace_ring = (trace_record *) malloc(TRACE_RING_RECORDS * sizeof(trace_record));
+    if (trace_ring == NULL)
+    {
+        ESP_LOGE(TAG, "Unable to allocate memory");
+        return ESP_FAIL;
+    }
 
-        err = ESP_FAIL;
+    trace_file = fopen(path, "wb");
+    if (trace_file == NULL)
+    {
+        ESP_LOGE(TAG, "Unable to create '%s'", path);
+        return ESP_FAIL;
     }
-    else if (err_cnt > 0)
+
+    if (fwrite(hdr, sizeof(*hdr), 1, trace_file) != 1)
     {
-        /* Display the error details contained in the arg_end struct.*/
-        arg_print_errors(stdout, args.end, argv[0]);
+        ESP_LOGE(TAG, "Write failed with %d for '%s'", errno, path);
+        return ESP_FAIL;
+    }
 
-        printf("\nUsage: %s", argv[0]);
-        arg_print_syntax(stdout, argtable, "\n");
+    trace_start = stat_now();
 
-        err = ESP_FAIL;
+    return ESP_OK;
+}
+
+static esp_err_t trace_close()
+{
+    bool failed = false;
+
+    if (trace_file != NULL)
+    {
+        trace_flush();
+
+        failed = fclose(trace_file) != 0 || trace_failed;
+        trace_file = NULL;
     }
-    else
+
+    free(trace_ring);
+    trace_ring = NULL;
+
+    return failed ? ESP_FAIL : ESP_OK;
+}
+
+// Records the call it's declared in when it goes out of scope
+class StatTimer
+{
+public:
+    StatTimer(int which, size_t addr, size_t bytes, bool counted = true)
     {
-        image_bytes = args.kb->ival[0] * 1024;
-        sector_count = image_bytes / sector_bytes;
+        this->which = which;
+        this->addr = addr;
+        this->bytes = bytes;
+        active = (stats_enabled || trace_file != NULL) && counted;
+        start = active ? stat_now() : 0;
+    }
 
-        if (args.level->count > 0)
+    ~StatTimer()
+    {
+        if (active)
         {
-            int level = args.level->ival[0];
-            if (level < ESP_LOG_NONE)
+            uint64_t nsecs = stat_now() - start;
+
+            if (stats_enabled)
             {
-                level = ESP_LOG_NONE;
+                stat_record(which, bytes, nsecs);
             }
-            else if (level > ESP_LOG_VERBOSE)
+
+            if (trace_file != NULL)
             {
-                level = ESP_LOG_VERBOSE;
+                trace_add(which, addr, bytes, start, nsecs);
             }
-
-            esp_log_level_set(TAG, (esp_log_level_t) level);
         }
-
-        err = ESP_OK;
     }
 
-    return err;
-}
+private:
+    int which;
+    size_t addr;
+    size_t bytes;
+    bool active;
+    uint64_t start;
+};
 
-esp_err_t FatFSImage::create_image()
-{
-    ESP_LOGD(TAG, "Creating '%s' with %d bytes", args.image->filename[0], image_bytes);
+// ============================================================================
+// Content digests
+//
+// CRC32C (Castagnoli, reflected, initial value and final XOR of 0xffffffff)
+// is used by --verify.  It's computed with the CRC32 instructions when the
+// host has them (SSE 4.2 or ARMv8) and with slice-by-8 tables otherwise.
+// ============================================================================
 
-    image = fopen(args.image->filename[0], "w+");
-    if (image == NULL)
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static bool crc32c_hw_ok = false;
+
+static void crc32c_init()
+{
+    for (uint32_t i = 0; i < 256; i++)
     {
-        ESP_LOGE(TAG, "Open failed with %d for '%s'", errno, args.image->filename[0]);
-        return ESP_FAIL;
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++)
+        {
+            crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+        }
+        crc32c_table[0][i] = crc;
     }
 
-    char buf[SPI_FLASH_SEC_SIZE];
-    int bytes = image_bytes;
-
-    memset(buf, 0xff, sizeof(buf));
-
-    for (int i = 0, len = 0; i < bytes; i += len)
+    for (uint32_t i = 0; i < 256; i++)
     {
-        len = bytes > sizeof(buf) ? sizeof(buf) : bytes;
-
-        fwrite(buf, 1, len, image);
-        if (ferror(image))
+        for (int t = 1; t < 8; t++)
         {
-            ESP_LOGE(TAG, "Write failed with %d for '%s'", errno, args.image->filename);
-            return ESP_FAIL;
+            uint32_t prev = crc32c_table[t - 1][i];
+            crc32c_table[t][i] = (prev >> 8) ^ crc32c_table[0][prev & 0xff];
         }
     }
-    
-    return ESP_OK;
+
+#if defined(__x86_64__)
+    crc32c_hw_ok = __builtin_cpu_supports("sse4.2");
+#elif defined(__ARM_FEATURE_CRC32)
+    crc32c_hw_ok = true;
+#endif
 }
 
-esp_err_t FatFSImage::init_wear_levelling()
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
 {
-    ESP_LOGD(TAG, "Initalizing wear levelling");
-
-    esp_err_t err = ESP_OK;
-
-    wl_config_t cfg =
-    {
-        .start_addr = WL_DEFAULT_START_ADDR,
-        .full_mem_size = image_bytes,
-        .page_size = SPI_FLASH_SEC_SIZE,
-        .sector_size = SPI_FLASH_SEC_SIZE,
-        .updaterate = WL_DEFAULT_UPDATERATE,
-        .wr_size = WL_DEFAULT_WRITE_SIZE,
-        .version = WL_CURRENT_VERSION,
-        .temp_buff_size = WL_DEFAULT_TEMP_BUFF_SIZE,
-        .crc = 0
-    };
-
-    err = flash.config(&cfg, this);
-    if (err != ESP_OK)
+    while (len >= 8)
     {
-        ESP_LOGE(TAG, "Wear levelling configuration failed with %d", err);
-        return err;
+        uint32_t lo;
+        uint32_t hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+
+        crc = crc32c_table[7][lo & 0xff] ^
+              crc32c_table[6][(lo >> 8) & 0xff] ^
+              crc32c_table[5][(lo >> 16) & 0xff] ^
+              crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xff] ^
+              crc32c_table[2][(hi >> 8) & 0xff] ^
+              crc32c_table[1][(hi >> 16) & 0xff] ^
+              crc32c_table[0][hi >> 24];
+
+        p += 8;
+        len -= 8;
     }
 
-    err = flash.init();
-    if (err != ESP_OK)
+    while (len-- > 0)
     {
-        ESP_LOGE(TAG, "Wear levelling initialization failed with %d", err);
-        return err;
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
     }
 
-    return ESP_OK;
+    return crc;
 }
 
-esp_err_t FatFSImage::create_filesystem()
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
 {
-    ESP_LOGD(TAG, "Creating filesystem within image");
-
-    esp_err_t err;
-    FRESULT res;
+    uint64_t crc64 = crc;
 
-    res = f_mkfs(drv, FM_ANY | FM_SFD, 0, NULL, 0);
-    if (res != FR_OK)
+    while (len >= 8)
     {
-        ESP_LOGE(TAG, "Filesystem creation failed with %d", res);
-        return ESP_FAIL;
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc64 = __builtin_ia32_crc32di(crc64, v);
+        p += 8;
+        len -= 8;
     }
 
-    FATFS *f = new FATFS;
-    if (f == nullptr)
+    crc = (uint32_t) crc64;
+    while (len-- > 0)
     {
-        ESP_LOGE(TAG, "Insufficent memory for FATFS");
-        return ESP_FAIL;
+        crc = __builtin_ia32_crc32qi(crc, *p++);
     }
 
-    res = f_mount(f, drv, 0);
-    if (res != FR_OK)
+    return crc;
+}
+#elif defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    while (len >= 8)
     {
-        delete f;
-
-        ESP_LOGE(TAG, "Mounting filesystem failed with %d", res);
-        return ESP_FAIL;
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+        p += 8;
+        len -= 8;
     }
 
-    fs = f;
+    while (len-- > 0)
+    {
+        crc = __crc32cb(crc, *p++);
+    }
 
-    return ESP_OK;
+    return crc;
 }
-
-esp_err_t FatFSImage::load_files()
+#else
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
 {
-    ESP_LOGD(TAG, "Loading files");
+    return crc32c_sw(crc, p, len);
+}
+#endif
+
+// Continues "crc" (0 to start) over "len" more bytes
+static uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+
+    crc = ~crc;
+    crc = crc32c_hw_ok ? crc32c_hw(crc, (const uint8_t *) data, len) : crc32c_sw(crc, (const uint8_t *) data, len);
+
+    return ~crc;
+}
+
+// ============================================================================
+// Shared source cache
+//
+// In batch mode, source files used by more than one image are mapped by the
+// parent before the workers are forked, so every worker copies them from
+// the same pages instead of reading them again.
+// ============================================================================
+
+typedef struct
+{
+    const char *data;
+    size_t len;
+    int64_t mtime;
+} shared_source;
+
+static std::map<std::pair<dev_t, ino_t>, shared_source> shared_sources;
+
+// Returns the shared mapping of the open file, if it has one and the file
+// hasn't changed since it was mapped
+static const shared_source *find_shared(int fd)
+{
+    struct stat s;
+
+    if (shared_sources.empty() || fstat(fd, &s) != 0)
+    {
+        return NULL;
+    }
+
+    auto it = shared_sources.find(std::make_pair(s.st_dev, s.st_ino));
+    if (it == shared_sources.end() ||
+        it->second.len != (size_t) s.st_size ||
+        it->second.mtime != (int64_t) s.st_mtim.tv_sec * 1000000000 + s.st_mtim.tv_nsec)
+    {
+        return NULL;
+    }
+
+    return &it->second;
+}
+
+// Memory backed flash for the wear levelling simulation, counting the
+// erases of each physical sector along with the bytes and calls that reach
+// it through the wear levelling layer
+class SimFlash : public Flash_Access
+{
+public:
+    SimFlash(size_t size) : erases(size / SPI_FLASH_SEC_SIZE)
+    {
+        bytes = size;
+        mem = (uint8_t *) malloc(size);
+        if (mem != NULL)
+        {
+            memset(mem, 0xff, size);
+        }
+    }
+
+    virtual ~SimFlash()
+    {
+        free(mem);
+    }
+
+    bool valid()
+    {
+        return mem != NULL;
+    }
+
+    // Forgets what has been counted so far
+    void reset()
+    {
+        std::fill(erases.begin(), erases.end(), 0);
+        written = 0;
+        calls = 0;
+    }
+
+    virtual size_t chip_size() final
+    {
+        return bytes;
+    }
+
+    virtual esp_err_t erase_sector(size_t sector) final
+    {
+        return erase_range(sector * SPI_FLASH_SEC_SIZE, SPI_FLASH_SEC_SIZE);
+    }
+
+    virtual esp_err_t erase_range(size_t start_address, size_t size) final
+    {
+        if (start_address + size > bytes ||
+            start_address % SPI_FLASH_SEC_SIZE != 0 ||
+            size % SPI_FLASH_SEC_SIZE != 0)
+        {
+            return ESP_ERR_INVALID_SIZE;
+        }
+
+        for (size_t s = start_address / SPI_FLASH_SEC_SIZE; s < (start_address + size) / SPI_FLASH_SEC_SIZE; s++)
+        {
+            erases[s]++;
+        }
+        calls++;
+
+        memset(&mem[start_address], 0xff, size);
+        return ESP_OK;
+    }
+
+    virtual esp_err_t write(size_t dest_addr, const void *src, size_t size) final
+    {
+        if (dest_addr + size > bytes)
+        {
+            return ESP_ERR_INVALID_SIZE;
+        }
+
+        // Programming can only clear bits, as on the real thing
+        const uint8_t *s = (const uint8_t *) src;
+        for (size_t i = 0; i < size; i++)
+        {
+            mem[dest_addr + i] &= s[i];
+        }
+        written += size;
+        calls++;
+
+        return ESP_OK;
+    }
+
+    virtual esp_err_t read(size_t src_addr, void *dest, size_t size) final
+    {
+        if (src_addr + size > bytes)
+        {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        memcpy(dest, &mem[src_addr], size);
+        calls++;
+
+        return ESP_OK;
+    }
+
+    virtual size_t sector_size() final
+    {
+        return SPI_FLASH_SEC_SIZE;
+    }
+
+    std::vector<uint32_t> erases;   // per sector
+    uint64_t written = 0;           // bytes programmed
+    uint64_t calls = 0;             // erase, write and read calls
+
+private:
+    uint8_t *mem;
+    size_t bytes;
+};
+
+// Read-only view of an image file, for looking inside an existing image
+// before deciding what to do with it
+class ImageFileFlash : public Flash_Access
+{
+public:
+    ImageFileFlash(FILE *file, size_t size)
+    {
+        fd = fileno(file);
+        bytes = size;
+    }
+
+    virtual size_t chip_size() final
+    {
+        return bytes;
+    }
+
+    virtual esp_err_t erase_sector(size_t sector) final
+    {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    virtual esp_err_t erase_range(size_t start_address, size_t size) final
+    {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    virtual esp_err_t write(size_t dest_addr, const void *src, size_t size) final
+    {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    virtual esp_err_t read(size_t src_addr, void *dest, size_t size) final
+    {
+        if (src_addr + size > bytes || pread(fd, dest, size, src_addr) != (ssize_t) size)
+        {
+            return ESP_FAIL;
+        }
+        return ESP_OK;
+    }
+
+    virtual size_t sector_size() final
+    {
+        return SPI_FLASH_SEC_SIZE;
+    }
+
+private:
+    int fd;
+    size_t bytes;
+};
+
+// Write-back sector cache over the image file, so images far larger than
+// memory can be built.  Memory use is fixed by the number of cache slots.
+// Dirty sectors are written back together, coalesced into runs of adjacent
+// sectors, whenever a dirty slot has to be reused and on flush().  Up to
+// "depth" runs are in flight at once, through io_uring when built with
+// CONFIG_FATFSIMAGE_IO_URING or otherwise pwritev() on as many threads.
+class CachedImage : public Flash_Access
+{
+public:
+    CachedImage(int fd, size_t size, size_t cache_size, int depth);
+    virtual ~CachedImage();
+
+    bool valid();
+
+    virtual size_t chip_size() final;
+    virtual esp_err_t erase_sector(size_t sector) final;
+    virtual esp_err_t erase_range(size_t start_address, size_t size) final;
+    virtual esp_err_t write(size_t dest_addr, const void *src, size_t size) final;
+    virtual esp_err_t read(size_t src_addr, void *dest, size_t size) final;
+    virtual size_t sector_size() final;
+    virtual esp_err_t flush() final;
+
+private:
+    typedef struct
+    {
+        off_t offset;
+        size_t bytes;
+        int iov;                    // first iovec
+        int count;
+    } write_run;
+
+    int lookup(size_t sector, bool load);
+    void touch(int slot);
+    void unlink(int slot);
+    esp_err_t write_back();
+    esp_err_t write_runs();
+    esp_err_t write_rest(const write_run *run, size_t done);
+    static void *writer_thread(void *arg);
+
+    int fd;
+    size_t bytes;
+    int depth;
+    int nslots;
+    uint8_t *mem = NULL;
+    std::unordered_map<size_t, int> index;
+    std::vector<size_t> sectors;    // sector held by each slot
+    std::vector<char> dirty;
+    std::vector<int> prev;          // LRU list, most recent at head
+    std::vector<int> next;
+    int head = -1;
+    int tail = -1;
+    int used = 0;
+    int ndirty = 0;
+
+    std::vector<struct iovec> iovs;
+    std::vector<write_run> runs;
+    size_t next_run = 0;
+    bool run_failed = false;
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+#if CONFIG_FATFSIMAGE_IO_URING
+    struct io_uring ring;
+    bool have_ring = false;
+#endif
+};
+
+CachedImage::CachedImage(int fd, size_t size, size_t cache_size, int depth)
+{
+    this->fd = fd;
+    bytes = size;
+    this->depth = depth > 0 ? depth : 1;
+    nslots = cache_size / SPI_FLASH_SEC_SIZE;
+    if (nslots < 2)
+    {
+        nslots = 2;
+    }
+
+    if (posix_memalign((void **) &mem, SPI_FLASH_SEC_SIZE, (size_t) nslots * SPI_FLASH_SEC_SIZE) != 0)
+    {
+        mem = NULL;
+        return;
+    }
+
+    index.reserve(nslots);
+    sectors.resize(nslots);
+    dirty.resize(nslots);
+    prev.resize(nslots);
+    next.resize(nslots);
+
+#if CONFIG_FATFSIMAGE_IO_URING
+    have_ring = io_uring_queue_init(this->depth, &ring, 0) == 0;
+    if (!have_ring)
+    {
+        ESP_LOGW(TAG, "io_uring not available, using pwritev()");
+    }
+#endif
+}
+
+CachedImage::~CachedImage()
+{
+#if CONFIG_FATFSIMAGE_IO_URING
+    if (have_ring)
+    {
+        io_uring_queue_exit(&ring);
+    }
+#endif
+
+    free(mem);
+}
+
+bool CachedImage::valid()
+{
+    return mem != NULL;
+}
+
+size_t CachedImage::chip_size()
+{
+    return bytes;
+}
+
+esp_err_t CachedImage::erase_sector(size_t sector)
+{
+    return erase_range(sector * SPI_FLASH_SEC_SIZE, SPI_FLASH_SEC_SIZE);
+}
+
+esp_err_t CachedImage::erase_range(size_t start_address, size_t size)
+{
+    if (start_address + size > bytes)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    while (size > 0)
+    {
+        size_t ofs = start_address % SPI_FLASH_SEC_SIZE;
+        size_t len = SPI_FLASH_SEC_SIZE - ofs < size ? SPI_FLASH_SEC_SIZE - ofs : size;
+
+        int slot = lookup(start_address / SPI_FLASH_SEC_SIZE, len != SPI_FLASH_SEC_SIZE);
+        if (slot < 0)
+        {
+            return ESP_FAIL;
+        }
+
+        memset(&mem[(size_t) slot * SPI_FLASH_SEC_SIZE + ofs], 0xff, len);
+        if (!dirty[slot])
+        {
+            dirty[slot] = 1;
+            ndirty++;
+        }
+
+        start_address += len;
+        size -= len;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t CachedImage::write(size_t dest_addr, const void *src, size_t size)
+{
+    if (dest_addr + size > bytes)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    const uint8_t *p = (const uint8_t *) src;
+    while (size > 0)
+    {
+        size_t ofs = dest_addr % SPI_FLASH_SEC_SIZE;
+        size_t len = SPI_FLASH_SEC_SIZE - ofs < size ? SPI_FLASH_SEC_SIZE - ofs : size;
+
+        // Whole sectors don't need the old contents
+        int slot = lookup(dest_addr / SPI_FLASH_SEC_SIZE, len != SPI_FLASH_SEC_SIZE);
+        if (slot < 0)
+        {
+            return ESP_FAIL;
+        }
+
+        memcpy(&mem[(size_t) slot * SPI_FLASH_SEC_SIZE + ofs], p, len);
+        if (!dirty[slot])
+        {
+            dirty[slot] = 1;
+            ndirty++;
+        }
+
+        p += len;
+        dest_addr += len;
+        size -= len;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t CachedImage::read(size_t src_addr, void *dest, size_t size)
+{
+    if (src_addr + size > bytes)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    uint8_t *p = (uint8_t *) dest;
+    while (size > 0)
+    {
+        size_t ofs = src_addr % SPI_FLASH_SEC_SIZE;
+        size_t len = SPI_FLASH_SEC_SIZE - ofs < size ? SPI_FLASH_SEC_SIZE - ofs : size;
+
+        // Sectors that aren't cached are read straight from the file so
+        // that long scans don't push out the sectors being worked on
+        auto it = index.find(src_addr / SPI_FLASH_SEC_SIZE);
+        if (it != index.end())
+        {
+            memcpy(p, &mem[(size_t) it->second * SPI_FLASH_SEC_SIZE + ofs], len);
+        }
+        else if (pread(fd, p, len, src_addr) != (ssize_t) len)
+        {
+            ESP_LOGE(TAG, "Read failed with %d at 0x%08x", errno, (uint32_t) src_addr);
+            return ESP_FAIL;
+        }
+
+        p += len;
+        src_addr += len;
+        size -= len;
+    }
+
+    return ESP_OK;
+}
+
+size_t CachedImage::sector_size()
+{
+    return SPI_FLASH_SEC_SIZE;
+}
+
+esp_err_t CachedImage::flush()
+{
+    if (write_back() != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+
+    return fdatasync(fd) == 0 ? ESP_OK : ESP_FAIL;
+}
+
+// Returns the slot holding "sector", reading it in first if "load" is set
+int CachedImage::lookup(size_t sector, bool load)
+{
+    auto it = index.find(sector);
+    if (it != index.end())
+    {
+        touch(it->second);
+        return it->second;
+    }
+
+    int slot;
+    if (used < nslots)
+    {
+        slot = used++;
+    }
+    else
+    {
+        slot = tail;
+        if (dirty[slot] && write_back() != ESP_OK)
+        {
+            return -1;
+        }
+
+        unlink(slot);
+        index.erase(sectors[slot]);
+    }
+
+    uint8_t *p = &mem[(size_t) slot * SPI_FLASH_SEC_SIZE];
+    if (load && pread(fd, p, SPI_FLASH_SEC_SIZE, sector * SPI_FLASH_SEC_SIZE) != SPI_FLASH_SEC_SIZE)
+    {
+        ESP_LOGE(TAG, "Read failed with %d for sector %d", errno, (int) sector);
+        return -1;
+    }
+
+    sectors[slot] = sector;
+    dirty[slot] = 0;
+    index[sector] = slot;
+
+    prev[slot] = -1;
+    next[slot] = -1;
+    touch(slot);
+
+    return slot;
+}
+
+void CachedImage::touch(int slot)
+{
+    if (slot == head)
+    {
+        return;
+    }
+
+    if (prev[slot] != -1 || next[slot] != -1 || slot == tail)
+    {
+        unlink(slot);
+    }
+
+    prev[slot] = -1;
+    next[slot] = head;
+    if (head != -1)
+    {
+        prev[head] = slot;
+    }
+    head = slot;
+
+    if (tail == -1)
+    {
+        tail = slot;
+    }
+}
+
+void CachedImage::unlink(int slot)
+{
+    if (prev[slot] != -1)
+    {
+        next[prev[slot]] = next[slot];
+    }
+    else
+    {
+        head = next[slot];
+    }
+
+    if (next[slot] != -1)
+    {
+        prev[next[slot]] = prev[slot];
+    }
+    else
+    {
+        tail = prev[slot];
+    }
+
+    prev[slot] = -1;
+    next[slot] = -1;
+}
+
+// Writes every dirty sector, in address order, as runs of adjacent sectors
+esp_err_t CachedImage::write_back()
+{
+    if (ndirty == 0)
+    {
+        return ESP_OK;
+    }
+
+    std::vector<std::pair<size_t, int>> order;
+    order.reserve(ndirty);
+    for (int slot = 0; slot < used; slot++)
+    {
+        if (dirty[slot])
+        {
+            order.push_back(std::make_pair(sectors[slot], slot));
+        }
+    }
+    std::sort(order.begin(), order.end());
+
+    iovs.clear();
+    runs.clear();
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        write_run *run = runs.empty() ? NULL : &runs.back();
+        off_t offset = (off_t) order[i].first * SPI_FLASH_SEC_SIZE;
+
+        if (run == NULL || run->offset + (off_t) run->bytes != offset || run->count == IOV_MAX)
+        {
+            write_run r = { offset, 0, (int) iovs.size(), 0 };
+            runs.push_back(r);
+            run = &runs.back();
+        }
+
+        struct iovec iov = { &mem[(size_t) order[i].second * SPI_FLASH_SEC_SIZE], SPI_FLASH_SEC_SIZE };
+        iovs.push_back(iov);
+        run->bytes += SPI_FLASH_SEC_SIZE;
+        run->count++;
+    }
+
+    ESP_LOGD(TAG, "Writing back %d sectors in %d runs", (int) order.size(), (int) runs.size());
+
+    if (write_runs() != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        dirty[order[i].second] = 0;
+    }
+    ndirty = 0;
+
+    return ESP_OK;
+}
+
+esp_err_t CachedImage::write_runs()
+{
+    next_run = 0;
+    run_failed = false;
+
+#if CONFIG_FATFSIMAGE_IO_URING
+    if (have_ring)
+    {
+        int inflight = 0;
+
+        while (next_run < runs.size() || inflight > 0)
+        {
+            while (next_run < runs.size() && inflight < depth)
+            {
+                struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+                if (sqe == NULL)
+                {
+                    break;
+                }
+
+                write_run *run = &runs[next_run];
+                io_uring_prep_writev(sqe, fd, &iovs[run->iov], run->count, run->offset);
+                io_uring_sqe_set_data(sqe, run);
+                next_run++;
+                inflight++;
+            }
+
+            io_uring_submit(&ring);
+
+            struct io_uring_cqe *cqe;
+            int res = io_uring_wait_cqe(&ring, &cqe);
+            if (res < 0)
+            {
+                ESP_LOGE(TAG, "io_uring wait failed with %d", -res);
+                return ESP_FAIL;
+            }
+
+            write_run *run = (write_run *) io_uring_cqe_get_data(cqe);
+            res = cqe->res;
+            io_uring_cqe_seen(&ring, cqe);
+            inflight--;
+
+            // Short writes are finished off synchronously
+            if (res < 0 || (size_t) res < run->bytes)
+            {
+                if (write_rest(run, res < 0 ? 0 : res) != ESP_OK)
+                {
+                    run_failed = true;
+                }
+            }
+        }
+
+        return run_failed ? ESP_FAIL : ESP_OK;
+    }
+#endif
+
+    int threads = (size_t) depth < runs.size() ? depth : runs.size();
+    std::vector<pthread_t> tids;
+
+    for (int i = 1; i < threads; i++)
+    {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, writer_thread, this) == 0)
+        {
+            tids.push_back(tid);
+        }
+    }
+
+    writer_thread(this);
+
+    for (size_t i = 0; i < tids.size(); i++)
+    {
+        pthread_join(tids[i], NULL);
+    }
+
+    return run_failed ? ESP_FAIL : ESP_OK;
+}
+
+void *CachedImage::writer_thread(void *arg)
+{
+    CachedImage *ci = (CachedImage *) arg;
+
+    while (true)
+    {
+        pthread_mutex_lock(&ci->lock);
+        write_run *run = ci->next_run < ci->runs.size() ? &ci->runs[ci->next_run++] : NULL;
+        pthread_mutex_unlock(&ci->lock);
+
+        if (run == NULL)
+        {
+            break;
+        }
+
+        if (ci->write_rest(run, 0) != ESP_OK)
+        {
+            pthread_mutex_lock(&ci->lock);
+            ci->run_failed = true;
+            pthread_mutex_unlock(&ci->lock);
+        }
+    }
+
+    return NULL;
+}
+
+// Writes what's left of a run from "done" bytes in
+esp_err_t CachedImage::write_rest(const write_run *run, size_t done)
+{
+    while (done < run->bytes)
+    {
+        int first = done / SPI_FLASH_SEC_SIZE;
+        struct iovec iov[IOV_MAX];
+        int count = run->count - first;
+
+        memcpy(iov, &iovs[run->iov + first], count * sizeof(struct iovec));
+        iov[0].iov_base = (uint8_t *) iov[0].iov_base + done % SPI_FLASH_SEC_SIZE;
+        iov[0].iov_len -= done % SPI_FLASH_SEC_SIZE;
+
+        ssize_t cnt = pwritev(fd, iov, count, run->offset + done);
+        if (cnt == -1 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (cnt <= 0)
+        {
+            ESP_LOGE(TAG, "Write failed with %d at 0x%08x", errno, (uint32_t) (run->offset + done));
+            return ESP_FAIL;
+        }
+
+        done += cnt;
+    }
+
+    return ESP_OK;
+}
+
+// Builds a complete FAT volume in memory and writes it out in one strictly
+// sequential pass without reading anything back.  Every object gets one
+// contiguous cluster run, allocated in the order the entries were added.
+class FatFSDirect
+{
+public:
+    FatFSDirect(Flash_Access *flash, UINT sector_size);
+
+    esp_err_t add(const char *src, const char *path, bool isdir, uint64_t size);
+    esp_err_t layout(UINT cluster_size, BYTE format);
+    esp_err_t write();
+
+    BYTE fs_type() { return type; }
+    UINT cluster_size() { return csize * ss; }
+    DWORD clusters() { return nclst; }
+    DWORD free_clusters() { return nclst - (next - 2); }
+    uint32_t dirs() { return numdirs; }
+    uint32_t files() { return numfiles; }
+    uint64_t file_bytes() { return numbytes; }
+
+private:
+    typedef struct
+    {
+        std::string src;
+        std::string name;           // leaf name
+        int parent;
+        bool isdir;
+        uint64_t size;
+        std::vector<int> children;
+        BYTE sfn[11];
+        BYTE ntres;                 // lower case flags for short names
+        std::vector<WCHAR> lfn;     // empty when the short name is enough
+        DWORD clust;
+        DWORD count;                // clusters
+    } node;
+
+    esp_err_t make_sfn(node *n, std::unordered_map<std::string, int> *used);
+    int dir_slots(node *n);
+    void dir_entry(BYTE *p, const BYTE *sfn, BYTE attr, BYTE ntres, DWORD clust, DWORD size);
+    void set_fat(std::vector<BYTE> &fat, DWORD clst, DWORD val);
+    esp_err_t write_sectors(DWORD sect, const void *data, size_t len);
+    esp_err_t write_dir(node *n, BYTE *buf, size_t len);
+    esp_err_t write_file(node *n, BYTE *buf, size_t len);
+
+    Flash_Access *flash;
+    std::vector<node> nodes;
+    std::unordered_map<std::string, int> paths;
+    UINT ss;
+    BYTE type = 0;
+    DWORD csize = 0;                // sectors per cluster
+    DWORD nsect = 0;
+    DWORD rsvd = 0;
+    DWORD fatsz = 0;
+    DWORD rootsz = 0;               // FAT12/16 root directory sectors
+    DWORD fatbase = 0;
+    DWORD dirbase = 0;
+    DWORD database = 0;
+    DWORD nclst = 0;
+    DWORD next = 2;                 // next free cluster
+    DWORD fattime = 0;
+    uint32_t numdirs = 0;
+    uint32_t numfiles = 0;
+    uint64_t numbytes = 0;
+};
+
+class FatFSImage : public Flash_Access
+{
+private:
+    typedef struct
+    {
+        const char *srcbase;
+        const char *dstbase;
+        int srclen;
+        int dstlen;
+        char src[PATH_MAX];
+        char dst[PATH_MAX];
+        char buf[SPI_FLASH_SEC_SIZE];
+    } copy_state;
+
+    typedef struct prefetch_chunk
+    {
+        struct prefetch_chunk *next;
+        const char *data;           // buf or a mapping of the whole file
+        size_t len;
+        void *map;                  // mapping to release, if any
+        char buf[PREFETCH_CHUNK_SIZE];
+    } prefetch_chunk;
+
+    typedef struct
+    {
+        char *src;
+        char *dst;
+        bool isdir;
+        off_t size;
+        int64_t mtime;              // nanoseconds
+        uint32_t hash;              // of the data as read
+        DWORD sclust;               // first cluster once written
+        bool written;
+        bool done;                  // reader has queued all data
+        int error;                  // errno from the reader
+        prefetch_chunk *head;
+        prefetch_chunk *tail;
+        uint32_t digest;            // CRC32C of the source for --verify
+        bool digested;              // digest taken while loading
+        int digest_error;           // errno from digesting the source
+    } copy_entry;
+
+    // A scanned entry and, for a directory, what it contains
+    typedef struct scan_node
+    {
+        copy_entry entry;
+        std::vector<struct scan_node *> children;
+    } scan_node;
+
+    typedef struct
+    {
+        UINT sector_size;
+        UINT cluster_size;
+        BYTE format;                // FM_FAT or FM_FAT32
+        BYTE fs_type;               // FS_FAT12, FS_FAT16 or FS_FAT32
+        DWORD clusters;             // total data clusters
+        DWORD needed;               // clusters needed by the sources
+        DWORD dir_clusters;         // of those, the ones for directories
+        uint64_t fat_bytes;
+        uint64_t slack_bytes;
+        uint64_t free_bytes;
+        double fat_per_open;        // FAT sectors read to follow a chain
+        bool fits;
+    } layout_plan;
+
+    typedef struct
+    {
+        bool isdir;
+        off_t size;
+        int64_t mtime;
+        uint32_t hash;
+        std::string chain;          // "start+count" cluster runs
+        long ndx;                   // entry being written, or -1 if unchanged
+    } manifest_entry;
+
+    typedef struct
+    {
+        const char *name;
+        esp_err_t err;
+        double wall;                // seconds
+        double user;
+        double sys;
+        uint64_t read_calls;        // from /proc/self/io
+        uint64_t write_calls;
+        uint64_t read_bytes;
+        uint64_t write_bytes;
+    } phase_timing;
+
+public:
+    FatFSImage();
+    virtual ~FatFSImage();
+
+    esp_err_t main(int argc, char *argv[]);
+    esp_err_t parse(int argc, char *argv[]);
+    esp_err_t init_wear_levelling();
+    esp_err_t create_image();
+    esp_err_t open_cache();
+    esp_err_t create_filesystem();
+    esp_err_t plan_layout();
+    esp_err_t plan_candidate(layout_plan *plan);
+    esp_err_t size_image();
+    esp_err_t size_fits(uint32_t bytes, uint32_t csize, uint32_t headroom, layout_plan *plan, size_t *volume, bool *fits);
+    void print_sizing(const char *title, uint32_t bytes, size_t volume, const layout_plan *plan);
+    esp_err_t scan_files();
+    esp_err_t load_files();
+    esp_err_t flush_image();
+    esp_err_t write_compressed();
+    esp_err_t write_sparse();
+    esp_err_t write_delta();
+    esp_err_t write_direct();
+    esp_err_t check_image();
+    esp_err_t verify_image();
+    static void *digest_thread(void *arg);
+    void digest_sources();
+    esp_err_t write_digests(const char *path);
+
+    //
+    // Batch mode
+    //
+    typedef struct
+    {
+        int line;
+        std::vector<std::string> words;
+        std::string image;
+        std::vector<std::string> paths;
+        pid_t pid;
+        uint64_t start;
+    } batch_image;
+
+    esp_err_t run_batch(int argc, char *argv[]);
+    esp_err_t read_batch(const std::vector<std::string> &common, std::vector<batch_image> &images);
+    void output_files(std::vector<std::pair<const char *, std::string>> &outputs);
+    esp_err_t share_sources(std::vector<batch_image> &images);
+    pid_t start_batch_image(batch_image *bi, const std::vector<std::string> &common);
+
+    //
+    // Library builder
+    //
+    esp_err_t build_begin(const fatfs_params *params);
+    esp_err_t build_dir(const char *path);
+    esp_err_t build_file(const char *path, const void *data, size_t len, fatfs_source source, void *ctx);
+    esp_err_t build_path(const char *src, const char *dst);
+    esp_err_t build_finish(fatfs_sink sink, void *ctx);
+    esp_err_t make_dirs(const std::string &path, bool last);
+
+    //
+    // List and extract
+    //
+    typedef struct
+    {
+        std::string path;
+        int fd;
+        int pending;                // chunks queued but not yet written
+        bool done;                  // all chunks queued
+        int error;
+        struct timespec mtime;
+    } extract_file;
+
+    typedef struct extract_chunk
+    {
+        struct extract_chunk *next;
+        extract_file *file;
+        off_t offset;
+        size_t len;
+        char *buf;
+    } extract_chunk;
+
+    esp_err_t inspect_image();
+    esp_err_t open_existing();
+    esp_err_t mount_existing();
+    esp_err_t walk_image(const std::string &path, const std::string &host);
+    bool first_visit(const FF_DIR *dir, const std::string &path);
+    esp_err_t extract_data(const std::string &path, extract_file *xf);
+    static void *extract_thread(void *arg);
+    void extract_writer();
+    void close_extracted(extract_file *xf);
+
+    //
+    // Wear levelling simulation
+    //
+    enum
+    {
+        SIM_WRITE,
+        SIM_APPEND,
+        SIM_DELETE,
+        SIM_RENAME,
+        SIM_MKDIR,
+        SIM_REPEAT
+    };
+
+    typedef struct
+    {
+        int op;                     // SIM_*
+        int line;
+        std::string path;
+        std::string to;             // new name for SIM_RENAME
+        uint64_t count;             // bytes, or passes for SIM_REPEAT
+        size_t end;                 // index past the body of a SIM_REPEAT
+    } sim_op;
+
+    typedef struct
+    {
+        uint32_t updaterate;
+        uint32_t wr_size;
+        uint32_t temp_buff;
+        bool fits;
+        uint64_t erases;
+        uint32_t max_erases;        // of the most worn sector, in this pass
+        double wear;                // per sector per pass once levelled
+        uint64_t calls;
+        double amplification;
+    } sim_result;
+
+    esp_err_t simulate_wear();
+    esp_err_t read_workload(const char *path);
+    esp_err_t simulate_config(sim_result *r, const uint8_t *volume, size_t len);
+    esp_err_t run_workload(size_t begin, size_t end);
+    FRESULT sim_write(const std::string &path, uint64_t bytes, BYTE mode);
+
+    //
+    // Mount report
+    //
+    esp_err_t mount_report();
+    esp_err_t list_files(const std::string &path, std::vector<std::string> &names);
+
+    //
+    // Phase timings
+    //
+    esp_err_t timed(const char *name, esp_err_t (FatFSImage::*phase)());
+    static void sample_usage(phase_timing *t);
+    esp_err_t write_timings();
+    void print_stats();
+    esp_err_t start_trace();
+    esp_err_t copy(const char *src, const char *dst);
+    esp_err_t copy_sub(copy_state *cs);
+    int copy_file(const char *src, char *dst, int *dstlen, off_t size, char *buf, size_t buflen);
+    esp_err_t copy_entries();
+    esp_err_t order_entries(const char *path);
+    std::string entry_name(const copy_entry *e);
+
+    //
+    // Source scanning
+    //
+    static void *scanner_thread(void *arg);
+    void scanner();
+    void scan_dir(scan_node *node, std::vector<scan_node *> *subdirs);
+    scan_node *scan_entry(const std::string &src, const std::string &dst, const struct stat *s);
+    void flatten(scan_node *node);
+
+    //
+    // Incremental manifest
+    //
+    esp_err_t read_manifest();
+    esp_err_t apply_manifest();
+    esp_err_t write_manifest();
+    esp_err_t boot_crc(Flash_Access *fa, uint32_t *crc);
+    uint32_t hash_file(const char *path);
+    std::string cluster_chain(DWORD clst);
+    DWORD fat_entry(DWORD clst, BYTE *sec, DWORD *cached);
+    esp_err_t target_dir(const char *src, const char *dst);
+    bool known_absent(const char *path);
+    void index_add(const char *path, bool isdir);
+    void count_dir_slots();
+    void presize_dir(const std::string &dir);
+    esp_err_t target_file(const char *src, char *dst, int *dstlen);
+    FRESULT open_target(FIL *fp, const char *dst, off_t size);
+    void finish_target(FIL *fp);
+    esp_err_t close_target(FIL *fp, const char *dst, bool failed, DWORD *sclust);
+    void write_span(FIL *fp, const char *data, size_t len);
+    int map_source(int fd, void **map, size_t *len);
+    esp_err_t copy_mapped(const char *src, const char *dst);
+
+    //
+    // Prefetch pipeline
+    //
+    esp_err_t prefetch();
+    static void *reader_thread(void *arg);
+    void reader();
+    esp_err_t write_entry(size_t ndx);
+    prefetch_chunk *get_chunk(size_t ndx);
+    void put_chunk(prefetch_chunk *chunk);
+    prefetch_chunk *next_chunk(size_t ndx);
+
+    //
+    // Flash_Access implementaion
+    //
+    virtual size_t chip_size() final;
+    virtual esp_err_t erase_sector(size_t sector) final;
+    virtual esp_err_t erase_range(size_t start_address, size_t size) final;
+    virtual esp_err_t write(size_t dest_addr, const void *src, size_t size) final;
+    virtual esp_err_t read(size_t src_addr, void *dest, size_t size) final;
+    virtual size_t sector_size() final;
+
+    //
+    // Image backends
+    //
+    bool is_erased(size_t sector);
+    esp_err_t backend_erase(size_t start_address, size_t size);
+    esp_err_t backend_write(size_t dest_addr, const void *src, size_t size);
+    esp_err_t backend_read(size_t src_addr, void *dest, size_t size);
+    esp_err_t fill_erased();
+
+private:
+    friend class FatFSBuilder;
+
+    struct
+    {
+        struct arg_lit *help;
+        struct arg_int *level;
+        struct arg_lit *stdio;
+        struct arg_int *jobs;
+        struct arg_int *scan_jobs;
+        struct arg_lit *contiguous;
+        struct arg_lit *mmap;
+        struct arg_file *order;
+        struct arg_lit *plan;
+        struct arg_int *ssize;
+        struct arg_int *csize;
+        struct arg_int *wl_updaterate;
+        struct arg_int *wl_write_size;
+        struct arg_lit *wl_device;
+        struct arg_lit *raw;
+        struct arg_lit *dry_run;
+        struct arg_lit *auto_size;
+        struct arg_int *headroom;
+        struct arg_lit *incremental;
+        struct arg_file *delta;
+        struct arg_int *offset;
+        struct arg_lit *direct;
+        struct arg_lit *check;
+        struct arg_file *verify;
+        struct arg_int *cache;
+        struct arg_int *depth;
+        struct arg_file *timings;
+        struct arg_str *stats;
+        struct arg_file *trace;
+        struct arg_file *compress;
+        struct arg_file *sparse;
+        struct arg_file *batch;
+        struct arg_int *batch_jobs;
+        struct arg_lit *list;
+        struct arg_file *extract;
+        struct arg_file *simulate;
+        struct arg_file *mount_report;
+        struct arg_int *read_cost;
+        struct arg_file *mount_json;
+        struct arg_file *image;
+        struct arg_int *kb;
+        struct arg_file *paths;
+        struct arg_end *end;
+    }
+    args =
+    {
+        arg_litn("h", "help", 0, 1, "display this help and exit"),
+        arg_intn("l", "log", "<level>", 0, 1, "log level (0-5, 3 is default)"),
+        arg_litn(NULL, "stdio", 0, 1, "use file I/O instead of an in-memory image"),
+        arg_intn("j", "jobs", "<n>", 0, 1, "source reader threads (0 disables prefetch, 4 is default)"),
+        arg_intn(NULL, "scan-jobs", "<n>", 0, 1, "source tree scanner threads (16 is default)"),
+        arg_litn("c", "contiguous", 0, 1, "preallocate each file as one contiguous cluster run"),
+        arg_litn("m", "mmap", 0, 1, "map source files and write them in whole clusters"),
+        arg_filen("o", "order", "<file>", 0, 1, "create the image paths listed in <file> first"),
+        arg_litn("p", "plan", 0, 1, "pick sector size, cluster size and FAT type for the sources"),
+        arg_intn(NULL, "sector-size", "<bytes>", 0, 1, "filesystem sector size (512 or 4096)"),
+        arg_intn(NULL, "cluster-size", "<bytes>", 0, 1, "filesystem cluster size"),
+        arg_intn(NULL, "wl-update-rate", "<n>", 0, 1, "wear levelling update rate (16 is default)"),
+        arg_intn(NULL, "wl-write-size", "<bytes>", 0, 1, "wear levelling state write size (16 is default)"),
+        arg_litn(NULL, "wl-device-matches", 0, 1, "the device firmware uses the same --wl-write-size"),
+        arg_litn(NULL, "raw", 0, 1, "leave out wear levelling, for partitions mounted read-only"),
+        arg_litn(NULL, "dry-run", 0, 1, "work out the space the sources need without building the image"),
+        arg_litn(NULL, "auto-size", 0, 1, "make the image the smallest size that fits (<KB> is the most allowed)"),
+        arg_intn(NULL, "headroom", "<percent>", 0, 1, "room left for more data by --auto-size (10 is default)"),
+        arg_litn("i", "incremental", 0, 1, "update the existing image using its manifest"),
+        arg_filen("d", "delta", "<baseline>", 0, 1, "write the flash sectors changed since <baseline>"),
+        arg_intn(NULL, "offset", "<addr>", 0, 1, "partition offset used for --delta addresses"),
+        arg_litn(NULL, "direct", 0, 1, "write the filesystem structures directly in one pass"),
+        arg_litn(NULL, "check", 0, 1, "compare the finished image with the sources"),
+        arg_filen(NULL, "verify", "<file>", 0, 1, "remount the finished image and check file digests, writing them to <file> if given"),
+        arg_intn(NULL, "cache", "<KB>", 0, 1, "build the image file through a write-back cache of <KB>"),
+        arg_intn(NULL, "queue-depth", "<n>", 0, 1, "writes in flight for --cache (32 is default)"),
+        arg_filen(NULL, "timings", "<file>", 0, 1, "write per-phase timings as JSON to <file> (- for stdout)"),
+        arg_strn(NULL, "stats", "json", 0, 1, "report I/O counters and latencies, as JSON if given"),
+        arg_filen(NULL, "trace", "<file>", 0, 1, "record a binary trace of all image I/O in <file>"),
+        arg_filen("z", "compress", "<file>", 0, 1, "write the image zlib compressed to <file> (- for stdout)"),
+        arg_filen(NULL, "sparse", "<file>", 0, 1, "write the image as a sparse file of data and erased ranges"),
+        arg_filen(NULL, "batch", "<file>", 0, 1, "build every image listed in <file>, several at once"),
+        arg_intn(NULL, "batch-jobs", "<n>", 0, 1, "images built at once by --batch (one per CPU is default)"),
+        arg_litn(NULL, "list", 0, 1, "list the contents of an existing image"),
+        arg_filen(NULL, "extract", "<dir>", 0, 1, "extract the contents of an existing image into <dir>"),
+        arg_filen(NULL, "simulate", "<file>", 0, 1, "replay the device workload in <file> on an existing image"),
+        arg_filen(NULL, "mount-report", "<file>", 0, 1, "report the sectors read to mount an existing image and open its files (or those in <file>)"),
+        arg_intn(NULL, "read-cost", "<us>", 0, 1, "device time per sector read for --mount-report (50 per KB of sector is default)"),
+        arg_filen(NULL, "mount-report-json", "<file>", 0, 1, "write the --mount-report results as JSON to <file> (- for stdout)"),
+        arg_filen(NULL, NULL, "<image>", 0, 1, "image file name"),
+        arg_intn(NULL, NULL, "<KB>", 0, 1, "disk size in KB"),
+        arg_filen(NULL, NULL, "<paths>", 0, 20, "directories/files to load"),
+        arg_end(1),
+    };
+    void **argtable = (void **) &args; // shame on me ;-)
+    static const int argcount = sizeof(args) / sizeof(void *);
+
+    FILE *image;
+    uint8_t *buffer;
+    CachedImage *cache = NULL;
+    std::vector<bool> erased;       // flash sectors known to be all 0xff
+    bool raw_image = true;          // write the uncompressed image file
+    int compress_fd = -1;           // stdout when compressing to it
+    int mount_json_fd = -1;         // stdout when the mount report JSON goes there
+    FATFS *fs;
+    uint32_t image_bytes = 0;
+    uint32_t sector_bytes = 0;
+    uint32_t sector_count = 0;
+    uint32_t numdirs = 0;
+    uint32_t numfiles = 0;
+    uint64_t copied_bytes = 0;
+    uint32_t fat_sector_bytes = SPI_FLASH_SEC_SIZE;
+    uint32_t cluster_bytes = 0;
+    BYTE fat_format = FM_ANY;
+
+    int jobs = 0;
+    int scan_jobs = 1;
+    bool contiguous = false;
+    bool scanned = false;
+    std::vector<copy_entry> entries;
+
+    // Totals of the scanned sources
+    uint32_t source_dirs = 0;
+    uint32_t source_files = 0;
+    uint64_t source_bytes = 0;
+
+    // Directories waiting for a scanner thread and the number being read
+    std::vector<scan_node *> scan_queue;
+    int scan_busy = 0;
+    pthread_cond_t scan_ready = PTHREAD_COND_INITIALIZER;
+    std::vector<phase_timing> timings;
+
+    bool reuse = false;
+    std::string manifest_path;
+    uint32_t manifest_boot_crc = 0;  // boot sector of the image it describes
+    std::unordered_map<std::string, manifest_entry> manifest;
+
+    // Names created in each directory made by this run (folded to upper
+    // case) and the directory entries each new directory will need
+    std::unordered_map<std::string, std::unordered_set<std::string>> dir_index;
+    std::unordered_map<std::string, uint32_t> dir_need;
+    std::vector<std::string> manifest_order;
+    std::vector<std::pair<std::string, manifest_entry>> records;
+    uint32_t numunchanged = 0;
+    uint32_t numdeleted = 0;
+    size_t next_read = 0;
+    size_t next_write = 0;
+    prefetch_chunk *pool = NULL;
+    prefetch_chunk *free_chunks = NULL;
+    int free_count = 0;
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t chunk_freed = PTHREAD_COND_INITIALIZER;
+    pthread_cond_t chunk_queued = PTHREAD_COND_INITIALIZER;
+
+    extract_chunk *extract_free = NULL;
+    extract_chunk *extract_head = NULL;
+    extract_chunk *extract_tail = NULL;
+    bool extract_done = false;
+    std::vector<extract_file *> extract_files;
+    std::vector<std::pair<std::string, struct timespec>> extract_dirs;
+    std::unordered_set<DWORD> walked_dirs;  // start clusters already walked
+    uint64_t extract_bytes = 0;
+
+    size_t next_digest = 0;
+
+    uint32_t wl_updaterate = WL_DEFAULT_UPDATERATE;
+    uint32_t wl_write_size = WL_DEFAULT_WRITE_SIZE;
+    bool raw_fat = false;           // FAT straight on the flash, no wear levelling
+
+    std::vector<sim_op> sim_ops;
+    double sim_period = 0;          // device seconds per pass of the workload
+    uint32_t sim_endurance = SIM_ENDURANCE;
+    uint64_t sim_written = 0;       // bytes written by the workload
+};
+
+FatFSImage::FatFSImage()
+{
+    // "--stats" on its own means plain text
+    args.stats->hdr.flag |= ARG_HASOPTVALUE;
+
+    // "--verify" on its own writes no digest manifest
+    args.verify->hdr.flag |= ARG_HASOPTVALUE;
+
+    // "--mount-report" on its own opens every file
+    args.mount_report->hdr.flag |= ARG_HASOPTVALUE;
+
+    sector_bytes = SPI_FLASH_SEC_SIZE;
+    image = NULL;
+    buffer = NULL;
+    fs = NULL;
+    numdirs = 0;
+    numfiles = 0;
+}
+
+FatFSImage::~FatFSImage()
+{
+    if (buffer)
+    {
+        free(buffer);
+    }
+
+    delete cache;
+
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        free(entries[i].src);
+        free(entries[i].dst);
+    }
+}
+
+int FatFSImage::main(int argc, char *argv[])
+{
+    esp_err_t err = ESP_FAIL;
+    bool parsed = parse(argc, argv) == ESP_OK;
+
+    if (parsed && args.batch->count > 0)
+    {
+        return run_batch(argc, argv);
+    }
+
+    if (parsed && args.simulate->count > 0)
+    {
+        return simulate_wear();
+    }
+
+    if (parsed && args.mount_report->count > 0)
+    {
+        return mount_report();
+    }
+
+    if (parsed && (args.list->count > 0 || args.extract->count > 0))
+    {
+        return inspect_image();
+    }
+
+    if (parsed && start_trace() == ESP_OK)
+    {
+        bool sized = timed("scan_files", &FatFSImage::scan_files) == ESP_OK &&
+                     timed("size_image", &FatFSImage::size_image) == ESP_OK;
+
+        if (sized && args.dry_run->count > 0)
+        {
+            err = ESP_OK;
+        }
+        else if (sized && timed("create_image", &FatFSImage::create_image) == ESP_OK)
+        {
+            if (timed("init_wear_levelling", &FatFSImage::init_wear_levelling) == ESP_OK)
+            {
+                if (timed("plan_layout", &FatFSImage::plan_layout) == ESP_OK &&
+                    timed("create_filesystem", &FatFSImage::create_filesystem) == ESP_OK)
+                {
+                    if (timed("load_files", &FatFSImage::load_files) == ESP_OK)
+                    {
+                        FATFS *fs;
+                        DWORD nfree = 0;
+                        FRESULT res = f_getfree(drv, &nfree, &fs);
+                        printf("Filesystem created\n\n");
+                        printf("  directories created: %d\n", numdirs);
+                        printf("  files copied: %d\n", numfiles);
+                        if (reuse)
+                        {
+                            printf("  files unchanged: %d\n", numunchanged);
+                            printf("  entries deleted: %d\n", numdeleted);
+                        }
+                        printf("\n");
+
+                        printf("  flash sector size: %d\n", SPI_FLASH_SEC_SIZE);
+                        printf("  flash sectors: %d\n", image_bytes / SPI_FLASH_SEC_SIZE);
+                        printf("  flash sectors erased: %d\n",
+                               (int) std::count(erased.begin(), erased.end(), true));
+                        printf("\n");
+                        printf("  filesystem sector size: %d\n", fs->ssize);
+                        printf("  filesystem sectors: %d\n", image_bytes / fs->ssize);
+                        printf("  filesystem cluster size: %d\n", fs->csize * fs->ssize);
+                        printf("  filesystem total clusters: %d\n", fs->n_fatent - 2);
+                        printf("  filesystem free clusters: %d\n", nfree);
+                        
+                        err = ESP_OK;
+                    }
+                    
+                    f_unmount(drv);
+                    delete fs;
+
+                    if (err == ESP_OK)
+                    {
+                        err = timed("flush_image", &FatFSImage::flush_image);
+                    }
+
+                    if (err == ESP_OK)
+                    {
+                        err = timed("verify_image", &FatFSImage::verify_image);
+                    }
+
+                    if (err == ESP_OK)
+                    {
+                        err = timed("write_compressed", &FatFSImage::write_compressed);
+                    }
+
+                    if (err == ESP_OK)
+                    {
+                        err = timed("write_sparse", &FatFSImage::write_sparse);
+                    }
+
+                    if (err == ESP_OK)
+                    {
+                        err = timed("write_delta", &FatFSImage::write_delta);
+                    }
+                }
+            }
+
+            if (image)
+            {
+                fclose(image);
+            }
+        }
+
+        if (args.timings->count > 0 && write_timings() != ESP_OK)
+        {
+            err = ESP_FAIL;
+        }
+
+        if (args.stats->count > 0)
+        {
+            print_stats();
+        }
+
+        if (trace_close() != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Unable to write trace '%s'", args.trace->filename[0]);
+            err = ESP_FAIL;
+        }
+
+        arg_freetable(argtable, argcount);
+    }
+
+    return err;
+}
+
+// ============================================================================
+// Phase timings
+//
+// Each top level step of main() is timed with wall clock, CPU time and the
+// read/write syscall counts the kernel keeps in /proc/self/io, so runs can
+// be compared by the benchmark scripts.
+// ============================================================================
+
+esp_err_t FatFSImage::timed(const char *name, esp_err_t (FatFSImage::*phase)())
+{
+    phase_timing before;
+    phase_timing after;
+
+    sample_usage(&before);
+    esp_err_t err = (this->*phase)();
+    sample_usage(&after);
+
+    after.name = name;
+    after.err = err;
+    after.wall -= before.wall;
+    after.user -= before.user;
+    after.sys -= before.sys;
+    after.read_calls -= before.read_calls;
+    after.write_calls -= before.write_calls;
+    after.read_bytes -= before.read_bytes;
+    after.write_bytes -= before.write_bytes;
+    timings.push_back(after);
+
+    return err;
+}
+
+void FatFSImage::sample_usage(phase_timing *t)
+{
+    memset(t, 0, sizeof(*t));
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    t->wall = ts.tv_sec + ts.tv_nsec / 1e9;
+
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == 0)
+    {
+        t->user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+        t->sys = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    }
+
+    // Not available everywhere, the counts just stay zero
+    FILE *fp = fopen("/proc/self/io", "r");
+    if (fp != NULL)
+    {
+        char name[32];
+        unsigned long long val;
+
+        while (fscanf(fp, "%31[^:]: %llu\n", name, &val) == 2)
+        {
+            if (strcmp(name, "syscr") == 0)
+            {
+                t->read_calls = val;
+            }
+            else if (strcmp(name, "syscw") == 0)
+            {
+                t->write_calls = val;
+            }
+            else if (strcmp(name, "rchar") == 0)
+            {
+                t->read_bytes = val;
+            }
+            else if (strcmp(name, "wchar") == 0)
+            {
+                t->write_bytes = val;
+            }
+        }
+
+        fclose(fp);
+    }
+}
+
+esp_err_t FatFSImage::write_timings()
+{
+    const char *path = args.timings->filename[0];
+    bool console = strcmp(path, "-") == 0;
+
+    FILE *fp = console ? stdout : fopen(path, "w");
+    if (fp == NULL)
+    {
+        ESP_LOGE(TAG, "Unable to create '%s'", path);
+        return ESP_FAIL;
+    }
+
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"image_bytes\": %u,\n", image_bytes);
+    fprintf(fp, "  \"directories\": %u,\n", numdirs);
+    fprintf(fp, "  \"files\": %u,\n", numfiles);
+    fprintf(fp, "  \"source_bytes\": %llu,\n", (unsigned long long) source_bytes);
+    fprintf(fp, "  \"phases\": [\n");
+    for (size_t i = 0; i < timings.size(); i++)
+    {
+        phase_timing *t = &timings[i];
+        fprintf(fp,
+                "    { \"name\": \"%s\", \"ok\": %s, \"wall\": %.6f, \"user\": %.6f, \"sys\": %.6f, "
+                "\"read_calls\": %llu, \"write_calls\": %llu, \"read_bytes\": %llu, \"write_bytes\": %llu }%s\n",
+                t->name,
+                t->err == ESP_OK ? "true" : "false",
+                t->wall,
+                t->user,
+                t->sys,
+                (unsigned long long) t->read_calls,
+                (unsigned long long) t->write_calls,
+                (unsigned long long) t->read_bytes,
+                (unsigned long long) t->write_bytes,
+                i + 1 < timings.size() ? "," : "");
+    }
+    fprintf(fp, "  ]\n");
+    fprintf(fp, "}\n");
+
+    if (!console && fclose(fp) != 0)
+    {
+        ESP_LOGE(TAG, "Write failed with %d for '%s'", errno, path);
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t FatFSImage::start_trace()
+{
+    if (args.trace->count == 0)
+    {
+        return ESP_OK;
+    }
+
+    trace_header hdr = {};
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TRACE_VERSION;
+    hdr.record_size = sizeof(trace_record);
+    hdr.image_bytes = image_bytes;
+    hdr.flash_sector_size = SPI_FLASH_SEC_SIZE;
+
+    if (trace_open(args.trace->filename[0], &hdr) != ESP_OK)
+    {
+        trace_close();
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+void FatFSImage::print_stats()
+{
+    io_stat *image_write = &io_stats[STAT_IMAGE_WRITE];
+    io_stat *image_erase = &io_stats[STAT_IMAGE_ERASE];
+    io_stat *wl_write = &io_stats[STAT_WL_WRITE];
+    io_stat *disk_write = &io_stats[STAT_DISK_WRITE];
+
+    // Image bytes written per byte of file data, and what each layer adds
+    double amplification = copied_bytes ? (double) image_write->bytes / copied_bytes : 0;
+    double erase_amplification = copied_bytes ? (double) image_erase->bytes / copied_bytes : 0;
+    double wl_overhead = wl_write->bytes ? (double) image_write->bytes / wl_write->bytes : 0;
+    double disk_overhead = disk_write->bytes ? (double) wl_write->bytes / disk_write->bytes : 0;
+
+    if (strcmp(args.stats->sval[0], "json") == 0)
+    {
+        printf("{\n");
+        printf("  \"source_bytes\": %llu,\n", (unsigned long long) copied_bytes);
+        printf("  \"write_amplification\": %.4f,\n", amplification);
+        printf("  \"erase_amplification\": %.4f,\n", erase_amplification);
+        printf("  \"wl_write_overhead\": %.4f,\n", wl_overhead);
+        printf("  \"disk_write_overhead\": %.4f,\n", disk_overhead);
+        printf("  \"ops\": [\n");
+        for (int i = 0; i < STAT_COUNT; i++)
+        {
+            io_stat *st = &io_stats[i];
+
+            printf("    { \"name\": \"%s\", \"calls\": %llu, \"bytes\": %llu, \"nsecs\": %llu, \"max_nsecs\": %llu, \"histogram\": [",
+                   st->name,
+                   (unsigned long long) st->calls,
+                   (unsigned long long) st->bytes,
+                   (unsigned long long) st->nsecs,
+                   (unsigned long long) st->max_nsecs);
+
+            // Only the buckets that were hit, keyed by their upper bound
+            const char *sep = "";
+            for (int b = 0; b < STAT_BUCKETS; b++)
+            {
+                if (st->hist[b] > 0)
+                {
+                    printf("%s{ \"le_nsecs\": %llu, \"calls\": %llu }",
+                           sep,
+                           b == STAT_BUCKETS - 1 ? 0ULL : 1ULL << (b + STAT_FIRST_BUCKET),
+                           (unsigned long long) st->hist[b]);
+                    sep = ", ";
+                }
+            }
+            printf("] }%s\n", i + 1 < STAT_COUNT ? "," : "");
+        }
+        printf("  ]\n");
+        printf("}\n");
+        return;
+    }
+
+    printf("\nI/O statistics\n\n");
+    printf("  %-12s %10s %14s %12s %10s %10s\n", "call", "count", "bytes", "total ms", "avg us", "max us");
+    for (int i = 0; i < STAT_COUNT; i++)
+    {
+        io_stat *st = &io_stats[i];
+        printf("  %-12s %10llu %14llu %12.3f %10.3f %10.3f\n",
+               st->name,
+               (unsigned long long) st->calls,
+               (unsigned long long) st->bytes,
+               st->nsecs / 1e6,
+               st->calls ? st->nsecs / 1e3 / st->calls : 0.0,
+               st->max_nsecs / 1e3);
+    }
+
+    printf("\n  latency histograms (calls taking up to the given time)\n");
+    for (int i = 0; i < STAT_COUNT; i++)
+    {
+        io_stat *st = &io_stats[i];
+        if (st->calls == 0)
+        {
+            continue;
+        }
+
+        printf("    %-12s", st->name);
+        for (int b = 0; b < STAT_BUCKETS; b++)
+        {
+            if (st->hist[b] == 0)
+            {
+                continue;
+            }
+
+            uint64_t ns = 1ULL << (b + STAT_FIRST_BUCKET);
+            if (b == STAT_BUCKETS - 1)
+            {
+                printf(" more:%llu", (unsigned long long) st->hist[b]);
+            }
+            else if (ns < 1000)
+            {
+                printf(" %lluns:%llu", (unsigned long long) ns, (unsigned long long) st->hist[b]);
+            }
+            else if (ns < 1000000)
+            {
+                printf(" %lluus:%llu", (unsigned long long) (ns / 1000), (unsigned long long) st->hist[b]);
+            }
+            else
+            {
+                printf(" %llums:%llu", (unsigned long long) (ns / 1000000), (unsigned long long) st->hist[b]);
+            }
+        }
+        printf("\n");
+    }
+
+    printf("\n");
+    printf("  source bytes copied: %llu\n", (unsigned long long) copied_bytes);
+    printf("  write amplification: %.3f\n", amplification);
+    printf("  erase amplification: %.3f\n", erase_amplification);
+    printf("  wear levelling write overhead: %.3f\n", wl_overhead);
+    printf("  disk write overhead: %.3f\n", disk_overhead);
+    printf("\n");
+}
+
+esp_err_t FatFSImage::parse(int argc, char *argv[])
+{
+    esp_err_t err;
+
+    int err_cnt = arg_parse(argc, argv, argtable);
+
+    // Modes that work on an image that already exists
+    bool existing = args.list->count > 0 || args.extract->count > 0 || args.simulate->count > 0 ||
+                    args.mount_report->count > 0;
+
+    if (args.help->count > 0)
+    {
+        printf("Usage: %s", argv[0]);
+        arg_print_syntax(stdout, argtable, "\n");
+
+        printf("Create and load a FATFS disk image.\n\n");
+        arg_print_glossary(stdout, argtable, "  %-25s %s\n");
+
+        err = ESP_FAIL;
+    }
+    else if (err_cnt > 0)
+    {
+        /* Display the error details contained in the arg_end struct.*/
+        arg_print_errors(stdout, args.end, argv[0]);
+
+        printf("\nUsage: %s", argv[0]);
+        arg_print_syntax(stdout, argtable, "\n");
+
+        err = ESP_FAIL;
+    }
+    else if (args.batch->count > 0)
+    {
+        if (args.image->count > 0 || args.kb->count > 0 || args.paths->count > 0)
+        {
+            printf("--batch takes the images to build from %s\n", args.batch->filename[0]);
+            return ESP_FAIL;
+        }
+
+        err = ESP_OK;
+    }
+    else if (existing && (args.image->count == 0 || args.paths->count > 0))
+    {
+        printf("--list, --extract, --simulate and --mount-report only take <image> and, optionally, <KB>\n");
+
+        err = ESP_FAIL;
+    }
+    else if (!existing && (args.image->count == 0 || args.paths->count == 0 ||
+                           (args.kb->count == 0 && args.dry_run->count == 0 && args.auto_size->count == 0)))
+    {
+        printf("<image>, <KB> and <paths> are required\n");
+
+        printf("\nUsage: %s", argv[0]);
+        arg_print_syntax(stdout, argtable, "\n");
+
+        err = ESP_FAIL;
+    }
+    else
+    {
+        // Existing images can be opened without giving their size
+        if (args.kb->count > 0)
+        {
+            uint64_t bytes = (uint64_t) args.kb->ival[0] * 1024;
+            if (args.kb->ival[0] <= 0 || bytes > UINT32_MAX)
+            {
+                printf("Image size must be between 1 and %d KB\n", (int) (UINT32_MAX / 1024));
+                return ESP_FAIL;
+            }
+
+            image_bytes = bytes;
+            sector_count = image_bytes / sector_bytes;
+        }
+
+        jobs = args.jobs->count > 0 ? args.jobs->ival[0] : PREFETCH_DEFAULT_JOBS;
+        if (jobs < 0)
+        {
+            jobs = 0;
+        }
+
+        scan_jobs = args.scan_jobs->count > 0 ? args.scan_jobs->ival[0] : SCAN_DEFAULT_JOBS;
+        if (scan_jobs < 1)
+        {
+            scan_jobs = 1;
+        }
+
+        contiguous = args.contiguous->count > 0;
+
+        if (args.auto_size->count > 0 && args.incremental->count > 0)
+        {
+            printf("--auto-size can't be combined with --incremental\n");
+            return ESP_FAIL;
+        }
+
+        if (args.headroom->count > 0 && args.headroom->ival[0] < 0)
+        {
+            printf("--headroom can't be negative\n");
+            return ESP_FAIL;
+        }
+
+        if (args.read_cost->count > 0 && args.read_cost->ival[0] <= 0)
+        {
+            printf("--read-cost must be at least 1\n");
+            return ESP_FAIL;
+        }
+
+        if (args.mount_json->count > 0 && args.mount_report->count == 0)
+        {
+            printf("--mount-report-json needs --mount-report\n");
+            return ESP_FAIL;
+        }
+
+        // Like --compress=-, everything else printed goes to stderr
+        if (args.mount_json->count > 0 && strcmp(args.mount_json->filename[0], "-") == 0)
+        {
+            fflush(stdout);
+            mount_json_fd = dup(STDOUT_FILENO);
+            if (mount_json_fd == -1 || dup2(STDERR_FILENO, STDOUT_FILENO) == -1)
+            {
+                printf("Unable to redirect stdout\n");
+                return ESP_FAIL;
+            }
+        }
+
+        if (args.wl_updaterate->count > 0)
+        {
+            if (args.wl_updaterate->ival[0] <= 0)
+            {
+                printf("--wl-update-rate must be at least 1\n");
+                return ESP_FAIL;
+            }
+            wl_updaterate = args.wl_updaterate->ival[0];
+        }
+
+        // It has to fit a flash sector a whole number of times, and the
+        // state records are at least 16 bytes
+        if (args.wl_write_size->count > 0)
+        {
+            int n = args.wl_write_size->ival[0];
+            if (n < 16 || n > SPI_FLASH_SEC_SIZE || (n & (n - 1)) != 0)
+            {
+                printf("--wl-write-size must be a power of 2 from 16 to %d\n", SPI_FLASH_SEC_SIZE);
+                return ESP_FAIL;
+            }
+            wl_write_size = n;
+        }
+
+        // The device lays out the state with its own compiled in write
+        // size, so an image built with any other can't be mounted unless
+        // the firmware was changed to match.  Existing images can be read
+        // with whatever they were built with.
+        if (!existing && wl_write_size != WL_DEFAULT_WRITE_SIZE && args.wl_device->count == 0)
+        {
+            printf("--wl-write-size=%u needs the device firmware built with the same write size, "
+                   "say so with --wl-device-matches\n",
+                   wl_write_size);
+            return ESP_FAIL;
+        }
+
+        if (args.stats->count > 0)
+        {
+            if (args.stats->sval[0][0] != '\0' && strcmp(args.stats->sval[0], "json") != 0)
+            {
+                printf("--stats only takes \"json\"\n");
+                return ESP_FAIL;
+            }
+
+            stats_enabled = true;
+        }
+
+        // An in-memory image that's only wanted compressed or sparse never
+        // hits the disk raw, unless the next incremental run needs it
+        if (args.compress->count > 0 || args.sparse->count > 0)
+        {
+            raw_image = args.stdio->count > 0 || args.cache->count > 0 || args.incremental->count > 0;
+        }
+
+        if (args.compress->count > 0)
+        {
+            // Keep the compressed stream apart from everything else printed
+            if (strcmp(args.compress->filename[0], "-") == 0)
+            {
+                fflush(stdout);
+                compress_fd = dup(STDOUT_FILENO);
+                if (compress_fd == -1 || dup2(STDERR_FILENO, STDOUT_FILENO) == -1)
+                {
+                    printf("Unable to redirect stdout\n");
+                    return ESP_FAIL;
+                }
+            }
+        }
+
+        if (args.cache->count > 0 && args.stdio->count > 0)
+        {
+            printf("--cache can't be combined with --stdio\n");
+            return ESP_FAIL;
+        }
+
+        if (args.direct->count > 0 && args.incremental->count > 0)
+        {
+            printf("--direct can't be combined with --incremental\n");
+            return ESP_FAIL;
+        }
+
+        // Ordering, planning, incremental updates, direct writing and
+        // checking work on the scanned entries, which only the prefetch
+        // pipeline copies
+        if ((args.order->count > 0 || args.plan->count > 0 || args.incremental->count > 0 ||
+             args.direct->count > 0 || args.check->count > 0 || args.verify->count > 0 ||
+             args.dry_run->count > 0 || args.auto_size->count > 0) && jobs == 0)
+        {
+            jobs = 1;
+        }
+
+        if (args.ssize->count > 0)
+        {
+            fat_sector_bytes = args.ssize->ival[0];
+            if (fat_sector_bytes != 512 && fat_sector_bytes != SPI_FLASH_SEC_SIZE)
+            {
+                printf("Sector size must be 512 or %d\n", SPI_FLASH_SEC_SIZE);
+                return ESP_FAIL;
+            }
+        }
+
+        // The device's raw flash driver only does whole flash sectors
+        raw_fat = args.raw->count > 0;
+        if (raw_fat && fat_sector_bytes != SPI_FLASH_SEC_SIZE)
+        {
+            printf("--raw needs %d byte sectors\n", SPI_FLASH_SEC_SIZE);
+            return ESP_FAIL;
+        }
+
+        if (raw_fat && args.simulate->count > 0)
+        {
+            printf("--simulate can't be combined with --raw\n");
+            return ESP_FAIL;
+        }
+
+        if (args.csize->count > 0)
+        {
+            cluster_bytes = args.csize->ival[0];
+        }
+
+        manifest_path = std::string(args.image->filename[0]) + ".manifest";
+
+        if (args.level->count > 0)
+        {
+            int level = args.level->ival[0];
+            if (level < ESP_LOG_NONE)
+            {
+                level = ESP_LOG_NONE;
+            }
+            else if (level > ESP_LOG_VERBOSE)
+            {
+                level = ESP_LOG_VERBOSE;
+            }
+
+            esp_log_level_set(TAG, (esp_log_level_t) level);
+        }
+
+        err = ESP_OK;
+    }
+
+    return err;
+}
+
+esp_err_t FatFSImage::create_image()
+{
+    if (args.incremental->count > 0 && read_manifest() == ESP_OK)
+    {
+        image = fopen(args.image->filename[0], "r+");
+        if (image != NULL)
+        {
+            // The manifest has to describe this very image, not just one
+            // of the same size
+            ImageFileFlash existing(image, image_bytes);
+            uint32_t crc = 0;
+
+            struct stat s;
+            if (fstat(fileno(image), &s) == 0 && s.st_size == image_bytes &&
+                boot_crc(&existing, &crc) == ESP_OK && crc == manifest_boot_crc)
+            {
+                reuse = true;
+            }
+            else
+            {
+                ESP_LOGI(TAG, "Manifest doesn't match the image, building a new image");
+                fclose(image);
+                image = NULL;
+            }
+        }
+    }
+
+    if (reuse)
+    {
+        ESP_LOGD(TAG, "Updating '%s'", args.image->filename[0]);
+
+        if (args.cache->count > 0)
+        {
+            return open_cache();
+        }
+
+        if (args.stdio->count == 0)
+        {
+            buffer = (uint8_t *) malloc(image_bytes);
+            if (buffer == NULL)
+            {
+                ESP_LOGE(TAG, "Unable to allocate %d bytes for image", image_bytes);
+                return ESP_FAIL;
+            }
+
+            if (fread(buffer, 1, image_bytes, image) != image_bytes)
+            {
+                ESP_LOGE(TAG, "Read failed with %d for '%s'", errno, args.image->filename[0]);
+                return ESP_FAIL;
+            }
+        }
+
+        return ESP_OK;
+    }
+
+    manifest.clear();
+    manifest_order.clear();
+
+    // Whatever manifest there is describes the image about to be replaced,
+    // and --incremental writes a new one once the image is built
+    if (!manifest_path.empty() && unlink(manifest_path.c_str()) != 0 && errno != ENOENT)
+    {
+        ESP_LOGE(TAG, "Unable to remove '%s' (%d)", manifest_path.c_str(), errno);
+        return ESP_FAIL;
+    }
+
+    ESP_LOGD(TAG, "Creating '%s' with %d bytes", args.image->filename[0], image_bytes);
+
+    image = raw_image ? fopen(args.image->filename[0], "w+") : NULL;
+    if (raw_image && image == NULL)
+    {
+        ESP_LOGE(TAG, "Open failed with %d for '%s'", errno, args.image->filename[0]);
+        return ESP_FAIL;
+    }
+
+    // A new image starts out fully erased.  Erased sectors are only tracked
+    // here and read back as 0xff, so nothing is filled in until a sector is
+    // partly written or the raw image is written out by flush_image().
+    erased.assign(image_bytes / SPI_FLASH_SEC_SIZE, true);
+
+    if (image != NULL && ftruncate(fileno(image), image_bytes) != 0)
+    {
+        ESP_LOGE(TAG, "Unable to size '%s' (%d)", args.image->filename[0], errno);
+        return ESP_FAIL;
+    }
+
+    if (args.cache->count > 0)
+    {
+        return open_cache();
+    }
+
+    // The image is built in memory and written once by flush_image() unless
+    // the stdio or cache backend was requested.
+    if (args.stdio->count == 0)
+    {
+        buffer = (uint8_t *) malloc(image_bytes);
+        if (buffer == NULL)
+        {
+            ESP_LOGE(TAG, "Unable to allocate %d bytes for image", image_bytes);
+            return ESP_FAIL;
+        }
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t FatFSImage::open_cache()
+{
+    size_t size = (size_t) args.cache->ival[0] * 1024;
+    int depth = args.depth->count > 0 ? args.depth->ival[0] : CACHE_DEFAULT_DEPTH;
+
+    ESP_LOGD(TAG, "Using a %d KB cache with %d writes in flight", args.cache->ival[0], depth);
+
+    cache = new CachedImage(fileno(image), image_bytes, size, depth);
+    if (!cache->valid())
+    {
+        ESP_LOGE(TAG, "Unable to allocate %d KB for the cache", args.cache->ival[0]);
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t FatFSImage::flush_image()
+{
+    if (cache)
+    {
+        ESP_LOGD(TAG, "Writing back cached sectors to '%s'", args.image->filename[0]);
+
+        if (cache->flush() != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Write back failed for '%s'", args.image->filename[0]);
+            return ESP_FAIL;
+        }
+    }
+    else if (buffer == NULL && fflush(image) != 0)
+    {
+        ESP_LOGE(TAG, "Write failed with %d for '%s'", errno, args.image->filename[0]);
+        return ESP_FAIL;
+    }
+
+    if (!raw_image)
+    {
+        return ESP_OK;
+    }
+
+    if (fill_erased() != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+
+    if (buffer == NULL)
+    {
+        return ESP_OK;
+    }
+
+    ESP_LOGD(TAG, "Writing %d bytes to '%s'", image_bytes, args.image->filename[0]);
+
+    rewind(image);
+
+    size_t written = fwrite(buffer, 1, image_bytes, image);
+    if (written != image_bytes || fflush(image) != 0)
+    {
+        ESP_LOGE(TAG, "Write failed with %d for '%s'", errno, args.image->filename[0]);
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+// Writes 0xff over the erased sectors the backend never filled in, so the
+// raw image file matches what reads of the image return
+esp_err_t FatFSImage::fill_erased()
+{
+    std::vector<uint8_t> ones;
+    size_t sectors = erased.size();
+
+    for (size_t sector = 0; sector < sectors; )
+    {
+        if (!erased[sector])
+        {
+            sector++;
+            continue;
+        }
+
+        size_t first = sector;
+        while (sector < sectors && erased[sector])
+        {
+            sector++;
+        }
+
+        size_t addr = first * SPI_FLASH_SEC_SIZE;
+        size_t end = sector * SPI_FLASH_SEC_SIZE;
+
+        if (buffer)
+        {
+            memset(buffer + addr, 0xff, end - addr);
+            continue;
+        }
+
+        if (ones.empty())
+        {
+            ones.assign(COMPRESS_CHUNK_SIZE, 0xff);
+        }
+
+        while (addr < end)
+        {
+            size_t len = end - addr < ones.size() ? end - addr : ones.size();
+            ssize_t cnt = pwrite(fileno(image), ones.data(), len, addr);
+            if (cnt == -1 && errno == EINTR)
+            {
+                continue;
+            }
+
+            if (cnt <= 0)
+            {
+                ESP_LOGE(TAG, "Write failed with %d for '%s'", errno, args.image->filename[0]);
+                return ESP_FAIL;
+            }
+
+            addr += cnt;
+        }
+    }
+
+    return ESP_OK;
+}
+
+// Streams the finished image through deflate as a zlib stream at level 9,
+// the same thing esptool builds for its compressed (FLASH_DEFL_*) uploads.
+esp_err_t FatFSImage::write_compressed()
+{
+    if (args.compress->count == 0)
+    {
+        return ESP_OK;
+    }
+
+    const char *path = args.compress->filename[0];
+
+    ESP_LOGD(TAG, "Compressing image to '%s'", path);
+
+    FILE *fp = compress_fd != -1 ? fdopen(compress_fd, "wb") : fopen(path, "wb");
+    if (fp == NULL)
+    {
+        ESP_LOGE(TAG, "Unable to create '%s'", path);
+        return ESP_FAIL;
+    }
+    compress_fd = -1;
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit(&zs, Z_BEST_COMPRESSION) != Z_OK)
+    {
+        ESP_LOGE(TAG, "Unable to initialize compression");
+        fclose(fp);
+        return ESP_FAIL;
+    }
+
+    std::vector<uint8_t> in(COMPRESS_CHUNK_SIZE);
+    std::vector<uint8_t> out(COMPRESS_CHUNK_SIZE);
+    esp_err_t err = ESP_OK;
+
+    for (size_t addr = 0; addr < image_bytes && err == ESP_OK; )
+    {
+        size_t len = image_bytes - addr < in.size() ? image_bytes - addr : in.size();
+        if (read(addr, in.data(), len) != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Unable to read image at 0x%08x", (uint32_t) addr);
+            err = ESP_FAIL;
+            break;
+        }
+        addr += len;
+
+        zs.next_in = in.data();
+        zs.avail_in = len;
+
+        int flush = addr == image_bytes ? Z_FINISH : Z_NO_FLUSH;
+        do
+        {
+            zs.next_out = out.data();
+            zs.avail_out = out.size();
+            deflate(&zs, flush);
+
+            size_t have = out.size() - zs.avail_out;
+            if (fwrite(out.data(), 1, have, fp) != have)
+            {
+                ESP_LOGE(TAG, "Write failed with %d for '%s'", errno, path);
+                err = ESP_FAIL;
+                break;
+            }
+        } while (zs.avail_out == 0);
+    }
+
+    uint64_t total = zs.total_out;
+    deflateEnd(&zs);
+
+    if (fclose(fp) != 0 && err == ESP_OK)
+    {
+        ESP_LOGE(TAG, "Write failed with %d for '%s'", errno, path);
+        err = ESP_FAIL;
+    }
+
+    if (err == ESP_OK)
+    {
+        printf("\n  compressed image: %llu bytes (%.1f%%)\n",
+               (unsigned long long) total,
+               100.0 * total / image_bytes);
+    }
+
+    return err;
+}
+
+// Writes the image as a sparse file.  Sectors still marked as erased, or that
+// were written with nothing but 0xff, become fill chunks and only the rest
+// of the image is stored.
+esp_err_t FatFSImage::write_sparse()
+{
+    if (args.sparse->count == 0)
+    {
+        return ESP_OK;
+    }
+
+    const char *path = args.sparse->filename[0];
+
+    ESP_LOGD(TAG, "Writing sparse image to '%s'", path);
+
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL)
+    {
+        ESP_LOGE(TAG, "Unable to create '%s'", path);
+        return ESP_FAIL;
+    }
+
+    sparse_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SPARSE_MAGIC, sizeof(hdr.magic));
+    hdr.version = SPARSE_VERSION;
+    hdr.sector_size = SPI_FLASH_SEC_SIZE;
+    hdr.image_bytes = image_bytes;
+
+    esp_err_t err = ESP_OK;
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+    {
+        err = ESP_FAIL;
+    }
+
+    // The chunk header is written when its run is complete, with the data
+    // sectors collected until then
+    std::vector<uint8_t> data;
+    uint8_t buf[SPI_FLASH_SEC_SIZE];
+    sparse_chunk chunk;
+    memset(&chunk, 0, sizeof(chunk));
+    uint64_t stored = 0;
+
+    size_t sectors = image_bytes / SPI_FLASH_SEC_SIZE;
+    for (size_t sector = 0; sector <= sectors && err == ESP_OK; sector++)
+    {
+        uint32_t type = 0;
+        if (sector < sectors)
+        {
+            type = SPARSE_FILL;
+            if (!is_erased(sector))
+            {
+                if (read(sector * SPI_FLASH_SEC_SIZE, buf, sizeof(buf)) != ESP_OK)
+                {
+                    ESP_LOGE(TAG, "Unable to read image at 0x%08x", (uint32_t) (sector * SPI_FLASH_SEC_SIZE));
+                    err = ESP_FAIL;
+                    break;
+                }
+
+                for (size_t i = 0; i < sizeof(buf); i++)
+                {
+                    if (buf[i] != 0xff)
+                    {
+                        type = SPARSE_DATA;
+                        break;
+                    }
+                }
+            }
+        }
+
+        if (chunk.sectors > 0 && (type != chunk.type || data.size() >= SPARSE_CHUNK_MAX))
+        {
+            if (fwrite(&chunk, sizeof(chunk), 1, fp) != 1 ||
+                fwrite(data.data(), 1, data.size(), fp) != data.size())
+            {
+                err = ESP_FAIL;
+                break;
+            }
+
+            stored += data.size();
+            hdr.chunks++;
+            chunk.sectors = 0;
+            data.clear();
+        }
+
+        if (type == 0)
+        {
+            break;
+        }
+
+        chunk.type = type;
+        chunk.fill = type == SPARSE_FILL ? 0xff : 0;
+        chunk.sectors++;
+        if (type == SPARSE_DATA)
+        {
+            data.insert(data.end(), buf, buf + sizeof(buf));
+        }
+    }
+
+    // Now that the chunks are counted
+    if (err == ESP_OK && (fseek(fp, 0, SEEK_SET) != 0 || fwrite(&hdr, sizeof(hdr), 1, fp) != 1))
+    {
+        err = ESP_FAIL;
+    }
+
+    if (fclose(fp) != 0)
+    {
+        err = ESP_FAIL;
+    }
+
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Write failed with %d for '%s'", errno, path);
+        return ESP_FAIL;
+    }
+
+    printf("\n  sparse image: %llu data bytes in %u chunks (%.1f%%)\n",
+           (unsigned long long) stored,
+           hdr.chunks,
+           100.0 * stored / image_bytes);
+
+    return ESP_OK;
+}
+
+// Compares the finished image with the baseline one flash sector at a time
+// and writes each run of changed sectors to "<image>.delta/<offset>.bin".
+// "<image>.delta/ranges" lists the "<flash address> <file>" pairs, ready to
+// be given to esptool's write_flash, and "<image>.delta/ranges0" holds the
+// same words NUL terminated for "xargs -0" when paths may contain spaces.
+// A missing or mismatched baseline makes the whole image one range.
+esp_err_t FatFSImage::write_delta()
+{
+    if (args.delta->count == 0)
+    {
+        return ESP_OK;
+    }
+
+    std::string dir = std::string(args.image->filename[0]) + ".delta";
+    uint32_t offset = args.offset->count > 0 ? args.offset->ival[0] : 0;
+
+    ESP_LOGD(TAG, "Writing delta from '%s' to '%s'", args.delta->filename[0], dir.c_str());
+
+    if (mkdir(dir.c_str(), 0777) == -1 && errno != EEXIST)
+    {
+        ESP_LOGE(TAG, "Unable to create directory '%s'", dir.c_str());
+        return ESP_FAIL;
+    }
+
+    // Clear out blobs from the last run
+    DIR *dirp = opendir(dir.c_str());
+    if (dirp != NULL)
+    {
+        struct dirent *dp;
+        while ((dp = readdir(dirp)) != NULL)
+        {
+            int len = strlen(dp->d_name);
+            if (len > 4 && strcmp(&dp->d_name[len - 4], ".bin") == 0)
+            {
+                unlink((dir + "/" + dp->d_name).c_str());
+            }
+        }
+        closedir(dirp);
+    }
+
+    FILE *base = fopen(args.delta->filename[0], "rb");
+    if (base != NULL)
+    {
+        struct stat s;
+        if (fstat(fileno(base), &s) == -1 || s.st_size != image_bytes)
+        {
+            ESP_LOGW(TAG, "Baseline '%s' doesn't match the image size", args.delta->filename[0]);
+            fclose(base);
+            base = NULL;
+        }
+    }
+    else
+    {
+        ESP_LOGW(TAG, "No baseline '%s', the whole image will be written", args.delta->filename[0]);
+    }
+
+    std::vector<std::pair<uint32_t, uint32_t>> ranges;
+    uint8_t cur[SPI_FLASH_SEC_SIZE];
+    uint8_t old[SPI_FLASH_SEC_SIZE];
+    uint32_t changed = 0;
+
+    for (uint32_t addr = 0; addr < image_bytes; addr += sizeof(cur))
+    {
+        if (read(addr, cur, sizeof(cur)) != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Unable to read image at 0x%08x", addr);
+            if (base)
+            {
+                fclose(base);
+            }
+            return ESP_FAIL;
+        }
+
+        if (base != NULL &&
+            fread(old, 1, sizeof(old), base) == sizeof(old) &&
+            memcmp(cur, old, sizeof(cur)) == 0)
+        {
+            continue;
+        }
+
+        changed++;
+
+        if (!ranges.empty() && ranges.back().first + ranges.back().second == addr)
+        {
+            ranges.back().second += sizeof(cur);
+        }
+        else
+        {
+            ranges.push_back(std::make_pair(addr, (uint32_t) sizeof(cur)));
+        }
+    }
+
+    if (base)
+    {
+        fclose(base);
+    }
+
+    std::string list = dir + "/ranges";
+    FILE *lf = fopen(list.c_str(), "w");
+    if (lf == NULL)
+    {
+        ESP_LOGE(TAG, "Unable to create '%s'", list.c_str());
+        return ESP_FAIL;
+    }
+
+    std::string list0 = list + "0";
+    FILE *nf = fopen(list0.c_str(), "wb");
+    if (nf == NULL)
+    {
+        ESP_LOGE(TAG, "Unable to create '%s'", list0.c_str());
+        fclose(lf);
+        return ESP_FAIL;
+    }
+
+    esp_err_t err = ESP_OK;
+    for (size_t i = 0; i < ranges.size() && err == ESP_OK; i++)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "/%08x.bin", ranges[i].first);
+        std::string path = dir + name;
+
+        FILE *bf = fopen(path.c_str(), "wb");
+        if (bf == NULL)
+        {
+            ESP_LOGE(TAG, "Unable to create '%s'", path.c_str());
+            err = ESP_FAIL;
+            break;
+        }
+
+        for (uint32_t addr = ranges[i].first; addr < ranges[i].first + ranges[i].second; addr += sizeof(cur))
+        {
+            if (read(addr, cur, sizeof(cur)) != ESP_OK || fwrite(cur, 1, sizeof(cur), bf) != sizeof(cur))
+            {
+                ESP_LOGE(TAG, "Write failed with %d for '%s'", errno, path.c_str());
+                err = ESP_FAIL;
+                break;
+            }
+        }
+
+        if (fclose(bf) != 0)
+        {
+            err = ESP_FAIL;
+        }
+
+        fprintf(lf, "0x%x %s\n", offset + ranges[i].first, path.c_str());
+        fprintf(nf, "0x%x%c%s%c", offset + ranges[i].first, '\0', path.c_str(), '\0');
+    }
+
+    if (fclose(nf) != 0)
+    {
+        ESP_LOGE(TAG, "Unable to write '%s'", list0.c_str());
+        err = ESP_FAIL;
+    }
+
+    if (fclose(lf) != 0)
+    {
+        err = ESP_FAIL;
+    }
+
+    printf("Delta written to '%s'\n\n", dir.c_str());
+    printf("  changed sectors: %d of %d\n", changed, image_bytes / SPI_FLASH_SEC_SIZE);
+    printf("  ranges: %d\n", (int) ranges.size());
+    printf("\n");
+
+    return err;
+}
+
+static wl_config_t wl_config(uint32_t bytes, uint32_t updaterate, uint32_t wr_size, uint32_t temp_buff)
+{
+    wl_config_t cfg =
+    {
+        .start_addr = WL_DEFAULT_START_ADDR,
+        .full_mem_size = bytes,
+        .page_size = SPI_FLASH_SEC_SIZE,
+        .sector_size = SPI_FLASH_SEC_SIZE,
+        .updaterate = updaterate,
+        .wr_size = wr_size,
+        .version = WL_CURRENT_VERSION,
+        .temp_buff_size = temp_buff,
+        .crc = 0
+    };
+
+    return cfg;
+}
+
+esp_err_t FatFSImage::init_wear_levelling()
+{
+    // Without wear levelling FatFs works on the image itself
+    if (raw_fat)
+    {
+        drives[0].flash = this;
+        return ESP_OK;
+    }
+
+    ESP_LOGD(TAG, "Initalizing wear levelling");
+
+    drives[0].flash = &flash;
+
+    esp_err_t err = ESP_OK;
+
+    wl_config_t cfg = wl_config(image_bytes, wl_updaterate, wl_write_size, WL_DEFAULT_TEMP_BUFF_SIZE);
+
+    err = flash.config(&cfg, this);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Wear levelling configuration failed with %d", err);
+        return err;
+    }
+
+    err = flash.init();
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Wear levelling initialization failed with %d", err);
+        return err;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t FatFSImage::create_filesystem()
+{
+    ESP_LOGD(TAG, "Creating filesystem within image");
+
+    esp_err_t err;
+    FRESULT res;
+
+    drives[0].sector_size = fat_sector_bytes;
+
+    // The direct writer lays out the filesystem itself
+    if (!reuse && args.direct->count == 0)
+    {
+        res = f_mkfs(drv, fat_format | FM_SFD, cluster_bytes, NULL, 0);
+        if (res != FR_OK)
+        {
+            ESP_LOGE(TAG, "Filesystem creation failed with %d", res);
+            return ESP_FAIL;
+        }
+    }
+
+    FATFS *f = new FATFS;
+    if (f == nullptr)
+    {
+        ESP_LOGE(TAG, "Insufficent memory for FATFS");
+        return ESP_FAIL;
+    }
+
+    res = f_mount(f, drv, reuse ? 1 : 0);
+    if (res != FR_OK)
+    {
+        delete f;
+
+        ESP_LOGE(TAG, "Mounting filesystem failed with %d", res);
+        return ESP_FAIL;
+    }
+
+    fs = f;
+
+    // A freshly formatted root is known to be empty
+    if (!reuse)
+    {
+        dir_index[""];
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t FatFSImage::load_files()
+{
+    ESP_LOGD(TAG, "Loading files");
+
+    if (scan_files() != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+
+    if (args.direct->count > 0)
+    {
+        if (write_direct() != ESP_OK)
+        {
+            return ESP_FAIL;
+        }
+
+        return args.check->count > 0 ? check_image() : ESP_OK;
+    }
+
+    if (!reuse)
+    {
+        count_dir_slots();
+        presize_dir("");
+    }
+
+    if (args.incremental->count > 0 && apply_manifest() != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+
+    esp_err_t err = jobs > 0 ? prefetch() : copy_entries();
+
+    // The image has changed even if some files failed, so the manifest has
+    // to describe what did make it in
+    if (args.incremental->count > 0 && write_manifest() != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Not every source could be copied");
+        return ESP_FAIL;
+    }
+
+    return args.check->count > 0 ? check_image() : ESP_OK;
+}
+
+// Copies the scanned entries in order on this thread, for "--jobs=0".
+// Directories are made, and presized, by target_dir() just as with the
+// prefetch pipeline, so the layout doesn't depend on "--jobs".
+esp_err_t FatFSImage::copy_entries()
+{
+    std::vector<char> buf(SPI_FLASH_SEC_SIZE);
+    char dst[PATH_MAX];
+    esp_err_t err = ESP_OK;
+
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        copy_entry *e = &entries[i];
+
+        if (e->isdir)
+        {
+            if (target_dir(e->src, e->dst) != ESP_OK)
+            {
+                err = ESP_FAIL;
+            }
+            continue;
+        }
+
+        strcpy(dst, e->dst);
+        int dstlen = strlen(dst);
+        if (copy_file(e->src, dst, &dstlen, e->size, buf.data(), buf.size()) != 0)
+        {
+            err = ESP_FAIL;
+        }
+    }
+
+    return err;
+}
+
+esp_err_t FatFSImage::write_direct()
+{
+    ESP_LOGD(TAG, "Writing filesystem directly");
+
+    FatFSDirect direct(drives[0].flash, fat_sector_bytes);
+
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        copy_entry *e = &entries[i];
+        if (direct.add(e->src, entry_name(e).c_str(), e->isdir, e->size) != ESP_OK)
+        {
+            return ESP_FAIL;
+        }
+    }
+
+    if (direct.layout(cluster_bytes, fat_format) != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG,
+             "Direct layout: FAT%d, %d byte clusters, %d of %d clusters used",
+             direct.fs_type() == FS_FAT12 ? 12 : direct.fs_type() == FS_FAT16 ? 16 : 32,
+             direct.cluster_size(),
+             direct.clusters() - direct.free_clusters(),
+             direct.clusters());
+
+    if (direct.write() != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+
+    numdirs = direct.dirs();
+    numfiles = direct.files();
+    copied_bytes = direct.file_bytes();
+
+    return ESP_OK;
+}
+
+// Reads everything back through FatFs and compares it with the sources
+esp_err_t FatFSImage::check_image()
+{
+    ESP_LOGD(TAG, "Checking image against the sources");
+
+    std::vector<char> want(PREFETCH_CHUNK_SIZE);
+    std::vector<char> got(PREFETCH_CHUNK_SIZE);
+    int mismatches = 0;
+
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        copy_entry *e = &entries[i];
+        std::string name = entry_name(e);
+
+        // The root itself
+        if (name.empty())
+        {
+            continue;
+        }
+
+        FILINFO fno;
+        FRESULT res = f_stat(name.c_str(), &fno);
+        if (res != FR_OK)
+        {
+            ESP_LOGE(TAG, "'%s' is missing from the image (%d)", name.c_str(), res);
+            mismatches++;
+            continue;
+        }
+
+        if (e->isdir != ((fno.fattrib & AM_DIR) != 0))
+        {
+            ESP_LOGE(TAG, "'%s' has the wrong type in the image", name.c_str());
+            mismatches++;
+            continue;
+        }
+
+        if (e->isdir)
+        {
+            continue;
+        }
+
+        if ((off_t) fno.fsize != e->size)
+        {
+            ESP_LOGE(TAG, "'%s' is %d bytes in the image instead of %d", name.c_str(), (int) fno.fsize, (int) e->size);
+            mismatches++;
+            continue;
+        }
+
+        FILE *srcf = fopen(e->src, "rb");
+        if (srcf == NULL)
+        {
+            ESP_LOGE(TAG, "Unable to open source '%s'", e->src);
+            mismatches++;
+            continue;
+        }
+
+        FIL dstf;
+        res = f_open(&dstf, name.c_str(), FA_READ);
+        if (res != FR_OK)
+        {
+            ESP_LOGE(TAG, "Unable to open '%s' in the image (%d)", name.c_str(), res);
+            fclose(srcf);
+            mismatches++;
+            continue;
+        }
+
+        while (true)
+        {
+            UINT br = 0;
+            size_t len = fread(want.data(), 1, want.size(), srcf);
+            res = f_read(&dstf, got.data(), got.size(), &br);
+
+            if (res != FR_OK || br != len || memcmp(want.data(), got.data(), len) != 0)
+            {
+                ESP_LOGE(TAG, "'%s' differs from its source", name.c_str());
+                mismatches++;
+                break;
+            }
+
+            if (len < want.size())
+            {
+                break;
+            }
+        }
+
+        f_close(&dstf);
+        fclose(srcf);
+    }
+
+    if (mismatches > 0)
+    {
+        ESP_LOGE(TAG, "%d entries don't match their sources", mismatches);
+        return ESP_FAIL;
+    }
+
+    printf("Image matches the sources\n\n");
+
+    return ESP_OK;
+}
+
+// Remounts the finished image and reads every file back through the whole
+// stack, comparing its CRC32C with that of the source.  The readers digest
+// the sources as they load them, so only those written some other way
+// (--direct) are read again, by "--jobs" threads while the image is read
+// back.
+esp_err_t FatFSImage::verify_image()
+{
+    if (args.verify->count == 0)
+    {
+        return ESP_OK;
+    }
+
+    ESP_LOGD(TAG, "Verifying image");
+
+    std::vector<pthread_t> threads;
+    next_digest = 0;
+    for (int i = 0; i < jobs; i++)
+    {
+        pthread_t t;
+        if (pthread_create(&t, NULL, digest_thread, this) != 0)
+        {
+            break;
+        }
+        threads.push_back(t);
+    }
+
+    // Mount afresh so nothing comes from what FatFs had cached
+    FATFS *f = new FATFS;
+    FRESULT res = f_mount(f, drv, 1);
+    if (res != FR_OK)
+    {
+        ESP_LOGE(TAG, "Remounting filesystem failed with %d", res);
+    }
+
+    std::vector<uint32_t> digests(entries.size());
+    std::vector<bool> found(entries.size());
+    std::vector<char> buf(MMAP_SPAN_SIZE);
+    int mismatches = 0;
+
+    for (size_t i = 0; i < entries.size() && res == FR_OK; i++)
+    {
+        copy_entry *e = &entries[i];
+        std::string name = entry_name(e);
+
+        // The root itself
+        if (name.empty())
+        {
+            found[i] = true;
+            continue;
+        }
+
+        FILINFO fno;
+        if (f_stat(name.c_str(), &fno) != FR_OK || e->isdir != ((fno.fattrib & AM_DIR) != 0))
+        {
+            ESP_LOGE(TAG, "'%s' is missing from the image", name.c_str());
+            mismatches++;
+            continue;
+        }
+
+        if (e->isdir)
+        {
+            found[i] = true;
+            continue;
+        }
+
+        if ((off_t) fno.fsize != e->size)
+        {
+            ESP_LOGE(TAG, "'%s' is %d bytes in the image instead of %d", name.c_str(), (int) fno.fsize, (int) e->size);
+            mismatches++;
+            continue;
+        }
+
+        FIL fil;
+        if (f_open(&fil, name.c_str(), FA_READ) != FR_OK)
+        {
+            ESP_LOGE(TAG, "Unable to open '%s' in the image", name.c_str());
+            mismatches++;
+            continue;
+        }
+
+        uint32_t crc = 0;
+        while (true)
+        {
+            UINT br = 0;
+            if (f_read(&fil, buf.data(), buf.size(), &br) != FR_OK)
+            {
+                ESP_LOGE(TAG, "Unable to read '%s' in the image", name.c_str());
+                mismatches++;
+                break;
+            }
+
+            crc = crc32c(crc, buf.data(), br);
+            if (br < buf.size())
+            {
+                found[i] = true;
+                break;
+            }
+        }
+        f_close(&fil);
+
+        digests[i] = crc;
+    }
+
+    f_unmount(drv);
+    delete f;
+
+    // Whatever the threads didn't get to is done here
+    digest_sources();
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (res != FR_OK)
+    {
+        return ESP_FAIL;
+    }
+
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        copy_entry *e = &entries[i];
+        if (e->isdir || !found[i])
+        {
+            continue;
+        }
+
+        if (e->digest_error != 0)
+        {
+            ESP_LOGE(TAG, "Unable to read source '%s' (%d)", e->src, e->digest_error);
+            mismatches++;
+        }
+        else if (digests[i] != e->digest)
+        {
+            ESP_LOGE(TAG, "'%s' differs from its source (CRC32C %08x, not %08x)",
+                     entry_name(e).c_str(), digests[i], e->digest);
+            mismatches++;
+        }
+    }
+
+    if (mismatches > 0)
+    {
+        ESP_LOGE(TAG, "%d entries don't match their sources", mismatches);
+        return ESP_FAIL;
+    }
+
+    printf("\n  verified: %d entries\n", (int) entries.size());
+
+    if (args.verify->filename[0][0] != '\0')
+    {
+        return write_digests(args.verify->filename[0]);
+    }
+
+    return ESP_OK;
+}
+
+void *FatFSImage::digest_thread(void *arg)
+{
+    ((FatFSImage *) arg)->digest_sources();
+
+    return NULL;
+}
+
+// Takes source files not digested while loading one at a time until none
+// are left
+void FatFSImage::digest_sources()
+{
+    std::vector<char> buf(MMAP_SPAN_SIZE);
+
+    while (1)
+    {
+        pthread_mutex_lock(&lock);
+        size_t ndx = next_digest++;
+        pthread_mutex_unlock(&lock);
+
+        if (ndx >= entries.size())
+        {
+            break;
+        }
+
+        copy_entry *e = &entries[ndx];
+        if (e->isdir || e->digested)
+        {
+            continue;
+        }
+
+        int fd = open(e->src, O_RDONLY);
+        if (fd == -1)
+        {
+            e->digest_error = errno;
+            continue;
+        }
+
+        uint32_t crc = 0;
+        while (1)
+        {
+            ssize_t cnt = ::read(fd, buf.data(), buf.size());
+            if (cnt == -1 && errno == EINTR)
+            {
+                continue;
+            }
+
+            if (cnt == -1)
+            {
+                e->digest_error = errno;
+            }
+
+            if (cnt <= 0)
+            {
+                break;
+            }
+
+            crc = crc32c(crc, buf.data(), cnt);
+        }
+        close(fd);
+
+        e->digest = crc;
+    }
+}
+
+// Writes "<crc32c> <size> <path>" for every file, for checking the image
+// contents later on the device
+esp_err_t FatFSImage::write_digests(const char *path)
+{
+    FILE *f = fopen(path, "w");
+    if (f == NULL)
+    {
+        ESP_LOGE(TAG, "Unable to create '%s'", path);
+        return ESP_FAIL;
+    }
+
+    fprintf(f, "# crc32c size path\n");
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        copy_entry *e = &entries[i];
+        if (!e->isdir)
+        {
+            fprintf(f, "%08x %lld %s\n", e->digest, (long long) e->size, entry_name(e).c_str());
+        }
+    }
+
+    if (fclose(f) != 0)
+    {
+        ESP_LOGE(TAG, "Write failed with %d for '%s'", errno, path);
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+// ============================================================================
+// Source scanning
+//
+// Before the filesystem is touched, the source trees are walked by a pool
+// of scanner threads into the list of entries (the manifest) that planning,
+// ordering and the prefetch pipeline all run from, so no host metadata
+// calls are left to interleave with FatFs work.
+//
+// Each directory is read through its own descriptor and its entries are
+// looked up with fstatat(), which only resolves the name within that
+// directory instead of the whole path from the top every time.  Directories
+// are handed out one at a time, so the round trips of up to "--scan-jobs"
+// of them overlap.  The tree is flattened afterwards, depth first and in
+// readdir() order, just as a serial walk would have produced it.
+// ============================================================================
+
+esp_err_t FatFSImage::scan_files()
+{
+    if (scanned)
+    {
+        return ESP_OK;
+    }
+
+    ESP_LOGD(TAG, "Scanning files");
+
+    std::vector<scan_node *> roots;
+    for (int i = 0; i < args.paths->count; ++i)
+    {
+        const char *src = args.paths->filename[i];
+
+        struct stat s;
+        if (strlen(src) >= PATH_MAX)
+        {
+            ESP_LOGE(TAG, "Source name '%s' is too long", src);
+        }
+        else if (stat(src, &s) == -1)
+        {
+            ESP_LOGE(TAG, "Unable to get file info for '%s'", src);
+        }
+        else if (!S_ISDIR(s.st_mode) && !S_ISREG(s.st_mode))
+        {
+            ESP_LOGE(TAG, "'%s' is not a normal file or directory", src);
+        }
+        else
+        {
+            scan_node *node = scan_entry(src, "", &s);
+            if (node == NULL)
+            {
+                break;
+            }
+
+            roots.push_back(node);
+            if (node->entry.isdir)
+            {
+                scan_queue.push_back(node);
+            }
+        }
+    }
+
+    // The calling thread scans too, so there's always at least one
+    std::vector<pthread_t> scanners;
+    for (int i = 1; i < scan_jobs && !scan_queue.empty(); i++)
+    {
+        pthread_t t;
+        if (pthread_create(&t, NULL, scanner_thread, this) != 0)
+        {
+            ESP_LOGW(TAG, "Unable to start scanner thread");
+            break;
+        }
+        scanners.push_back(t);
+    }
+
+    scanner();
+
+    for (size_t i = 0; i < scanners.size(); i++)
+    {
+        pthread_join(scanners[i], NULL);
+    }
+
+    for (size_t i = 0; i < roots.size(); i++)
+    {
+        flatten(roots[i]);
+    }
+
+    ESP_LOGI(TAG, "Scanned %u directories and %u files (%llu bytes)",
+             source_dirs,
+             source_files,
+             (unsigned long long) source_bytes);
+
+    scanned = true;
+
+    if (args.order->count > 0 && order_entries(args.order->filename[0]) != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+void *FatFSImage::scanner_thread(void *arg)
+{
+    ((FatFSImage *) arg)->scanner();
+
+    return NULL;
+}
+
+// Reads queued directories until none are left and none are being read,
+// since any directory still being read may yet queue more
+void FatFSImage::scanner()
+{
+    std::vector<scan_node *> subdirs;
+
+    pthread_mutex_lock(&lock);
+    while (1)
+    {
+        while (scan_queue.empty() && scan_busy > 0)
+        {
+            pthread_cond_wait(&scan_ready, &lock);
+        }
+
+        if (scan_queue.empty())
+        {
+            break;
+        }
+
+        // Taking the newest keeps the walk roughly depth first, so the
+        // directories in flight stay close together
+        scan_node *node = scan_queue.back();
+        scan_queue.pop_back();
+        scan_busy++;
+        pthread_mutex_unlock(&lock);
+
+        subdirs.clear();
+        scan_dir(node, &subdirs);
+
+        pthread_mutex_lock(&lock);
+        scan_queue.insert(scan_queue.end(), subdirs.rbegin(), subdirs.rend());
+        scan_busy--;
+        pthread_cond_broadcast(&scan_ready);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void FatFSImage::scan_dir(scan_node *node, std::vector<scan_node *> *subdirs)
+{
+    std::string src = node->entry.src;
+    std::string dst = node->entry.dst;
+
+    int fd = open(src.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dirp = fd == -1 ? NULL : fdopendir(fd);
+    if (dirp == NULL)
+    {
+        ESP_LOGW(TAG, "Unable to read directory '%s'", src.c_str());
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return;
+    }
+
+    while (1)
+    {
+        struct dirent *dp = readdir(dirp);
+        if (dp == NULL)
+        {
+            break;
+        }
+
+        if (strcmp(dp->d_name, ".") == 0 ||
+            strcmp(dp->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        size_t len = 1 + strlen(dp->d_name);
+        if (src.size() + len >= PATH_MAX)
+        {
+            ESP_LOGE(TAG, "Source name '%s/%s' is too long", src.c_str(), dp->d_name);
+            continue;
+        }
+
+        if (dst.size() + len >= PATH_MAX)
+        {
+            ESP_LOGE(TAG, "Target name '%s/%s' is too long", dst.c_str(), dp->d_name);
+            continue;
+        }
+
+        struct stat s;
+        if (fstatat(fd, dp->d_name, &s, 0) == -1)
+        {
+            ESP_LOGE(TAG, "Unable to get file info for '%s/%s'", src.c_str(), dp->d_name);
+            continue;
+        }
+
+        if (!S_ISDIR(s.st_mode) && !S_ISREG(s.st_mode))
+        {
+            ESP_LOGE(TAG, "'%s/%s' is not a normal file or directory", src.c_str(), dp->d_name);
+            continue;
+        }
+
+        scan_node *child = scan_entry(src + "/" + dp->d_name, dst + "/" + dp->d_name, &s);
+        if (child == NULL)
+        {
+            break;
+        }
+
+        node->children.push_back(child);
+        if (child->entry.isdir)
+        {
+            subdirs->push_back(child);
+        }
+    }
+
+    closedir(dirp);
+}
+
+FatFSImage::scan_node *FatFSImage::scan_entry(const std::string &src, const std::string &dst, const struct stat *s)
+{
+    scan_node *node = new scan_node();
+
+    node->entry.src = strdup(src.c_str());
+    node->entry.dst = strdup(dst.c_str());
+    node->entry.isdir = S_ISDIR(s->st_mode);
+    node->entry.size = s->st_size;
+    node->entry.mtime = (int64_t) s->st_mtim.tv_sec * 1000000000 + s->st_mtim.tv_nsec;
+    if (node->entry.src == NULL || node->entry.dst == NULL)
+    {
+        ESP_LOGE(TAG, "Unable to allocate memory");
+        free(node->entry.src);
+        free(node->entry.dst);
+        delete node;
+        return NULL;
+    }
+
+    return node;
+}
+
+// Moves a scanned tree into the entries, parents ahead of their contents,
+// and adds it to the source totals
+void FatFSImage::flatten(scan_node *node)
+{
+    entries.push_back(node->entry);
+
+    if (node->entry.isdir)
+    {
+        source_dirs++;
+    }
+    else
+    {
+        source_files++;
+        source_bytes += node->entry.size;
+    }
+
+    for (size_t i = 0; i < node->children.size(); i++)
+    {
+        flatten(node->children[i]);
+    }
+
+    delete node;
+}
+
+int FatFSImage::copy(const char *src, const char *dst)
+{
+    ESP_LOGD(TAG, "Processing '%s'", src);
+
+    int err = 0;
+
+    copy_state *cs = (copy_state *) malloc(sizeof(copy_state));
+    if (cs == NULL)
+    {
+        ESP_LOGE(TAG, "Unable to allocate memory");
+        return -1;
+    }
+
+    int len;
+    for (len = 0; src[len] && len < sizeof(cs->src); len++)
+    {
+        cs->src[len] = src[len];
+    }
+
+    if (len == sizeof(cs->src))
+    {
+        ESP_LOGE(TAG, "Source name '%s' is too long", src);
+        free(cs);
+        return -1;
+    }
+    cs->src[len] = '\0';
+    cs->srclen = len;
+
+    for (len = 0; dst[len] && len < sizeof(cs->dst); len++)
+    {
+        cs->dst[len] = dst[len];
+    }
+
+    if (len == sizeof(cs->dst))
+    {
+        ESP_LOGE(TAG, "Target name '%s' is too long", dst);
+        free(cs);
+        return -1;
+    }
+    cs->dst[len] = '\0';
+    cs->dstlen = len;
+
+    cs->srcbase = src;
+    cs->dstbase = dst;
+
+    err = copy_sub(cs);
+
+    free(cs);
+
+    return err;
+}
+
+int FatFSImage::copy_sub(copy_state *cs)
+{
+    int err = 0;
+
+    struct stat s;
+    if (stat(cs->src, &s) == -1)
+    {
+        ESP_LOGE(TAG, "Unable to get file info for '%s'", cs->src);
+        return -1;
+    }
+
+    if (S_ISDIR(s.st_mode))
+    {
+        if (target_dir(cs->src, cs->dst) != ESP_OK)
+        {
+            return -1;
+        }
+
+        DIR *dirp = opendir(cs->src);
+        if (dirp != NULL)
+        {
+            while (1)
+            {
+                struct dirent *dp = readdir(dirp);
+                if (dp == NULL)
+                {
+                    break;
+                }
+
+                if (strcmp(dp->d_name, ".") == 0 ||
+                    strcmp(dp->d_name, "..") == 0)
+                {
+                    continue;
+                }
+
+                int srcorig = cs->srclen;
+                int dstorig = cs->dstlen;
+
+                cs->srclen += 1 + strlen(dp->d_name);
+                cs->dstlen += 1 + strlen(dp->d_name);
+
+                if (cs->srclen >= PATH_MAX)
+                {
+                    ESP_LOGE(TAG, "Source name '%s/%s' is too long", cs->src, dp->d_name);
+                    err = -1;
+                }
+                else if (cs->dstlen >= PATH_MAX)
+                {
+                    ESP_LOGE(TAG, "Target name '%s/%s' is too long", cs->dst, dp->d_name);
+                    err = -1;
+                }
+                else
+                {
+                    cs->src[srcorig] = '/';
+                    strcpy(&cs->src[srcorig + 1], dp->d_name);
+
+                    cs->dst[dstorig] = '/';
+                    strcpy(&cs->dst[dstorig + 1], dp->d_name);
+
+                    err = copy_sub(cs);
+
+                    cs->src[srcorig] = '\0';
+                    cs->dst[dstorig] = '\0';
+                }
+
+                cs->srclen = srcorig;
+                cs->dstlen = dstorig;
+            }
+
+            closedir(dirp);
+        }
+    }
+    else if (!S_ISREG(s.st_mode))
+    {
+        ESP_LOGE(TAG, "'%s' is not a normal file or directory", cs->src);
+        err = -1;
+    }
+    else
+    {
+        err = copy_file(cs->src, cs->dst, &cs->dstlen, s.st_size, cs->buf, sizeof(cs->buf));
+    }
+
+    return err;
+}
+
+// Copies one source file to the image the simple way, reading it in
+// "buflen" byte pieces on the calling thread
+int FatFSImage::copy_file(const char *src, char *dst, int *dstlen, off_t size, char *buf, size_t buflen)
+{
+    FRESULT res;
+    int err = 0;
+
+    if (target_file(src, dst, dstlen) != ESP_OK)
+    {
+        return -1;
+    }
+
+    if (args.mmap->count > 0)
+    {
+        return copy_mapped(src, dst);
+    }
+
+    ESP_LOGD(TAG, "Copying file '%s' to '%s'", src, dst);
+
+    FILE *srcf = fopen(src, "rb");
+    if (srcf == NULL)
+    {
+        ESP_LOGE(TAG, "Unable to open source '%s'", src);
+        return -1;
+    }
+    else
+    {
+        FIL dstf;
+
+        res = open_target(&dstf, dst, size);
+        if (res != FR_OK)
+        {
+            ESP_LOGE(TAG, "Unable to open target '%s'", dst);
+            err = -1;
+        }
+        else
+        {
+            while (!feof(srcf) && !ferror(srcf) && f_error(&dstf) == FR_OK)
+            {
+                UINT bw;
+                size_t read = fread(buf, 1, buflen, srcf);
+                f_write(&dstf, buf, read, &bw);
+            }
+
+            bool failed = ferror(srcf) != 0;
+            if (failed)
+            {
+                ESP_LOGE(TAG, "Read returned %d for source '%s'", errno, src);
+            }
+
+            err = close_target(&dstf, dst, failed, NULL) == ESP_OK ? 0 : -1;
+        }
+        fclose(srcf);
+    }
+
+    return err;
+}
+
+// Reads a list of image paths, one per line, such as the order file.
+// Blank lines and lines starting with '#' are skipped and the paths are
+// made absolute.
+static esp_err_t read_path_list(const char *path, std::vector<std::string> &names)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        ESP_LOGE(TAG, "Unable to open '%s'", path);
+        return ESP_FAIL;
+    }
+
+    char line[PATH_MAX + 1];
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        char *p = line;
+        while (*p == ' ' || *p == '\t')
+        {
+            p++;
+        }
+
+        int len = strlen(p);
+        while (len > 0 && strchr(" \t\r\n", p[len - 1]))
+        {
+            p[--len] = '\0';
+        }
+
+        if (len == 0 || *p == '#')
+        {
+            continue;
+        }
+
+        names.push_back(*p == '/' ? p : std::string("/") + p);
+    }
+
+    fclose(f);
+
+    return ESP_OK;
+}
+
+// Moves the entries named in the order file, in the order listed, to the
+// front of the list.  The directories leading to them go first so that the
+// listed files end up back to back at the start of the data area and ahead
+// of the other entries in their directories.
+esp_err_t FatFSImage::order_entries(const char *path)
+{
+    ESP_LOGD(TAG, "Ordering entries using '%s'", path);
+
+    std::vector<std::string> listed;
+    if (read_path_list(path, listed) != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+
+    std::unordered_map<std::string, size_t> names;
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        std::string name = entry_name(&entries[i]);
+        if (!name.empty())
+        {
+            names[name] = i;
+        }
+    }
+
+    std::vector<size_t> hot;
+    for (size_t i = 0; i < listed.size(); i++)
+    {
+        auto it = names.find(listed[i]);
+        if (it == names.end())
+        {
+            ESP_LOGW(TAG, "Ordered path '%s' not found in sources", listed[i].c_str());
+            continue;
+        }
+
+        hot.push_back(it->second);
+    }
+
+    std::vector<copy_entry> ordered;
+    std::vector<bool> used(entries.size(), false);
+
+    ordered.reserve(entries.size());
+
+    // Top level directories map to the root and must come first
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        if (entries[i].isdir && entries[i].dst[0] == '\0')
+        {
+            ordered.push_back(entries[i]);
+            used[i] = true;
+        }
+    }
+
+    for (size_t i = 0; i < hot.size(); i++)
+    {
+        std::string name = entries[hot[i]].dst;
+
+        for (size_t sep = name.find('/', 1); ; sep = name.find('/', sep + 1))
+        {
+            auto it = names.find(name.substr(0, sep));
+            if (it != names.end() && entries[it->second].isdir && !used[it->second])
+            {
+                ordered.push_back(entries[it->second]);
+                used[it->second] = true;
+            }
+
+            if (sep == std::string::npos)
+            {
+                break;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < hot.size(); i++)
+    {
+        if (!used[hot[i]])
+        {
+            ordered.push_back(entries[hot[i]]);
+            used[hot[i]] = true;
+        }
+    }
+
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        if (!used[i])
+        {
+            ordered.push_back(entries[i]);
+        }
+    }
+
+    entries.swap(ordered);
+
+    return ESP_OK;
+}
+
+// The image path of an entry, or empty for top level directories (the root)
+std::string FatFSImage::entry_name(const copy_entry *e)
+{
+    // Files given directly on the command line land in the root
+    if (e->dst[0] == '\0' && !e->isdir)
+    {
+        const char *p = strrchr(e->src, '/');
+        return std::string("/") + (p ? p + 1 : e->src);
+    }
+
+    return e->dst;
+}
+
+esp_err_t FatFSImage::target_dir(const char *src, const char *dst)
+{
+    FILINFO fno;
+    FRESULT res = known_absent(dst) ? FR_NO_FILE : f_stat(dst, &fno);
+    if (res == FR_OK && !(fno.fattrib & AM_DIR))
+    {
+        ESP_LOGE(TAG, "Attempt to copy directory '%s' to non-directorys '%s'", src, dst);
+        return ESP_FAIL;
+    }
+
+    if (res == FR_NO_FILE)
+    {
+        ESP_LOGD(TAG, "Creating directory '%s'", dst);
+        res = f_mkdir(dst);
+        if (res != FR_OK)
+        {
+            ESP_LOGE(TAG, "Unable to create directory '%s'", dst);
+            return ESP_FAIL;
+        }
+
+        numdirs++;
+
+        index_add(dst, true);
+        presize_dir(dst);
+    }
+
+    return ESP_OK;
+}
+
+// Folds a name the way FatFs compares them, or returns false if it can't
+// be sure to.  Non-ASCII names fold by code page and a "~" may match a
+// generated short name.
+static bool fold_name(const char *name, std::string *key)
+{
+    key->clear();
+    for (const char *p = name; *p; p++)
+    {
+        unsigned char c = *p;
+        if (c & 0x80 || c == '~')
+        {
+            return false;
+        }
+
+        *key += (char) toupper(c);
+    }
+
+    // FatFs drops trailing dots and spaces
+    while (!key->empty() && (key->back() == '.' || key->back() == ' '))
+    {
+        key->pop_back();
+    }
+
+    return !key->empty();
+}
+
+// Tells whether "path" certainly doesn't exist yet, from the names created
+// in directories made by this run.  Saves a linear scan of the directory
+// for every new entry.
+bool FatFSImage::known_absent(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL)
+    {
+        return false;
+    }
+
+    auto it = dir_index.find(std::string(path, slash - path));
+    if (it == dir_index.end())
+    {
+        return false;
+    }
+
+    std::string key;
+    return fold_name(slash + 1, &key) && it->second.count(key) == 0;
+}
+
+void FatFSImage::index_add(const char *path, bool isdir)
+{
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL)
+    {
+        return;
+    }
+
+    auto it = dir_index.find(std::string(path, slash - path));
+    if (it == dir_index.end())
+    {
+        return;
+    }
+
+    // A name that can't be folded is never reported absent anyway
+    std::string key;
+    if (fold_name(slash + 1, &key))
+    {
+        it->second.insert(key);
+    }
+
+    if (isdir)
+    {
+        dir_index[path];
+    }
+}
+
+esp_err_t FatFSImage::target_file(const char *src, char *dst, int *dstlen)
+{
+    FILINFO fno;
+
+    // The root (empty name) can't be stat'd, but is always a directory
+    FRESULT res = dst[0] == '\0' ? FR_OK : known_absent(dst) ? FR_NO_FILE : f_stat(dst, &fno);
+    if (res == FR_OK && (dst[0] == '\0' || fno.fattrib & AM_DIR))
+    {
+        const char *p = strrchr(src, '/');
+        p = p ? p + 1 : src;
+
+        int len = *dstlen + 1 + strlen(p);
+        if (len >= PATH_MAX)
+        {
+            ESP_LOGE(TAG, "Target name '%s/%s' is too long", dst, p);
+            return ESP_FAIL;
+        }
+
+        dst[*dstlen] = '/';
+        strcpy(&dst[*dstlen + 1], p);
+        *dstlen = len;
+
+        res = known_absent(dst) ? FR_NO_FILE : f_stat(dst, &fno);
+    }
+
+    if (res != FR_NO_FILE)
+    {
+        ESP_LOGE(TAG, "Unable to create destination file '%s'", dst);
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+FRESULT FatFSImage::open_target(FIL *fp, const char *dst, off_t size)
+{
+    FRESULT res = f_open(fp, dst, FA_WRITE | FA_CREATE_ALWAYS);
+    if (res == FR_OK)
+    {
+        index_add(dst, false);
+    }
+
+    if (res != FR_OK || !contiguous || size == 0)
+    {
+        return res;
+    }
+
+    // Reserve one contiguous cluster run for the whole file so the data
+    // is then written without any FAT chain updates.  If there isn't a
+    // big enough run left, just let the file grow as usual.
+    if (f_expand(fp, size, 1) != FR_OK)
+    {
+        ESP_LOGW(TAG, "Unable to preallocate %ld contiguous bytes for '%s'", (long) size, dst);
+    }
+
+    return FR_OK;
+}
+
+void FatFSImage::finish_target(FIL *fp)
+{
+    // Give back any preallocated space if the source shrank while copying
+    if (f_error(fp) == FR_OK && f_tell(fp) < f_size(fp))
+    {
+        f_truncate(fp);
+    }
+}
+
+// Closes a file opened with open_target(), counting it if it was written
+// in full or removing it again if not.  "failed" means the source let it
+// down, and "sclust" (if not NULL) gets its first cluster.
+esp_err_t FatFSImage::close_target(FIL *fp, const char *dst, bool failed, DWORD *sclust)
+{
+    esp_err_t err = failed ? ESP_FAIL : ESP_OK;
+
+    finish_target(fp);
+
+    if (err == ESP_OK && f_error(fp) != FR_OK)
+    {
+        ESP_LOGE(TAG, "Write returned %d for target '%s'", f_error(fp), dst);
+        err = ESP_FAIL;
+    }
+
+    if (err == ESP_OK)
+    {
+        numfiles++;
+        copied_bytes += f_size(fp);
+
+        if (sclust != NULL)
+        {
+            *sclust = fp->obj.sclust;
+        }
+    }
+
+    f_close(fp);
+
+    if (err != ESP_OK)
+    {
+        f_unlink(dst);
+        // ignore errors
+    }
+
+    return err;
+}
+
+void FatFSImage::write_span(FIL *fp, const char *data, size_t len)
+{
+    // Spans start on a cluster boundary and cover whole clusters, so FatFs
+    // hands them straight to disk_write() instead of going through the
+    // per-sector window.  Only the tail of the file is buffered.
+    UINT csize = fs->csize * fs->ssize;
+    UINT span = MMAP_SPAN_SIZE < csize ? csize : MMAP_SPAN_SIZE / csize * csize;
+
+    while (len > 0 && f_error(fp) == FR_OK)
+    {
+        UINT bw;
+        UINT cnt = len < span ? len : span;
+
+        f_write(fp, data, cnt, &bw);
+        data += cnt;
+        len -= cnt;
+    }
+}
+
+int FatFSImage::map_source(int fd, void **map, size_t *len)
+{
+    struct stat s;
+    if (fstat(fd, &s) == -1)
+    {
+        return errno;
+    }
+
+    *map = NULL;
+    *len = s.st_size;
+
+    // Can't map an empty file
+    if (*len == 0)
+    {
+        return 0;
+    }
+
+    int flags = MAP_PRIVATE;
+#if defined(MAP_POPULATE)
+    // Fault the pages in now rather than on the writer thread
+    if (jobs > 0)
+    {
+        flags |= MAP_POPULATE;
+    }
+#endif
+
+    void *p = mmap(NULL, *len, PROT_READ, flags, fd, 0);
+    if (p == MAP_FAILED)
+    {
+        return errno;
+    }
+
+    madvise(p, *len, MADV_SEQUENTIAL);
+
+    *map = p;
+
+    return 0;
+}
+
+esp_err_t FatFSImage::copy_mapped(const char *src, const char *dst)
+{
+    ESP_LOGD(TAG, "Mapping file '%s' to '%s'", src, dst);
+
+    int fd = open(src, O_RDONLY);
+    if (fd == -1)
+    {
+        ESP_LOGE(TAG, "Unable to open source '%s'", src);
+        return -1;
+    }
+
+    void *map;
+    size_t len;
+    int error = map_source(fd, &map, &len);
+    close(fd);
+
+    if (error != 0)
+    {
+        ESP_LOGE(TAG, "Read returned %d for source '%s'", error, src);
+        return -1;
+    }
+
+    int err = 0;
+    FIL dstf;
+
+    FRESULT res = open_target(&dstf, dst, len);
+    if (res != FR_OK)
+    {
+        ESP_LOGE(TAG, "Unable to open target '%s'", dst);
+        err = -1;
+    }
+    else
+    {
+        write_span(&dstf, (const char *) map, len);
+        err = close_target(&dstf, dst, false, NULL) == ESP_OK ? 0 : -1;
+    }
+
+    if (map)
+    {
+        munmap(map, len);
+    }
+
+    return err;
+}
+
+// ============================================================================
+// Incremental manifest
+//
+// The manifest sits next to the image and records every entry loaded into
+// it, one per line:
+//
+//   D <path>
+//   F <path> <size> <mtime> <crc32> <cluster runs>
+//
+// Fields are separated by tabs and the mtime is in nanoseconds.  The first
+// line identifies the image: its size, filesystem sector and cluster sizes,
+// whether it has wear levelling and a CRC of its boot sector, which holds
+// the volume serial number.  A manifest is only used with the very image it
+// was written for, and full builds remove it.
+// ============================================================================
+
+esp_err_t FatFSImage::read_manifest()
+{
+    FILE *f = fopen(manifest_path.c_str(), "r");
+    if (f == NULL)
+    {
+        ESP_LOGI(TAG, "No manifest found, building a new image");
+        return ESP_FAIL;
+    }
+
+    unsigned long bytes = 0;
+    unsigned long ssize = 0;
+    unsigned long csize = 0;
+    char layer[8] = "";
+    unsigned long crc = 0;
+    if (fscanf(f, "fatfsimage-manifest 2 %lu %lu %lu %7s %lx\n", &bytes, &ssize, &csize, layer, &crc) != 5 ||
+        bytes != image_bytes ||
+        strcmp(layer, raw_fat ? "raw" : "wl") != 0 ||
+        (args.ssize->count > 0 && ssize != fat_sector_bytes) ||
+        (args.csize->count > 0 && csize != cluster_bytes))
+    {
+        ESP_LOGI(TAG, "Manifest doesn't match, building a new image");
+        fclose(f);
+        return ESP_FAIL;
+    }
+
+    fat_sector_bytes = ssize;
+    manifest_boot_crc = crc;
+
+    char line[PATH_MAX + 1024];
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        line[strcspn(line, "\n")] = '\0';
+
+        char *type = strtok(line, "\t");
+        char *path = strtok(NULL, "\t");
+        if (type == NULL || path == NULL)
+        {
+            continue;
+        }
+
+        manifest_entry m = {};
+        m.isdir = type[0] == 'D';
+        m.ndx = -1;
+
+        if (!m.isdir)
+        {
+            char *size = strtok(NULL, "\t");
+            char *mtime = strtok(NULL, "\t");
+            char *hash = strtok(NULL, "\t");
+            char *chain = strtok(NULL, "\t");
+            if (hash == NULL)
+            {
+                continue;
+            }
+
+            m.size = strtoll(size, NULL, 10);
+            m.mtime = strtoll(mtime, NULL, 10);
+            m.hash = strtoul(hash, NULL, 16);
+            m.chain = chain ? chain : "";
+        }
+
+        manifest[path] = m;
+        manifest_order.push_back(path);
+    }
+
+    fclose(f);
+
+    return ESP_OK;
+}
+
+// Removes whatever is no longer in the sources from the image and drops
+// unchanged files from the entries to be copied.
+esp_err_t FatFSImage::apply_manifest()
+{
+    std::unordered_map<std::string, size_t> names;
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        names[entry_name(&entries[i])] = i;
+    }
+
+    // Children were recorded after their parents, so walk backwards to
+    // empty directories before removing them
+    for (size_t i = manifest_order.size(); i-- > 0; )
+    {
+        const std::string &name = manifest_order[i];
+        auto it = names.find(name);
+        if (it == names.end() || entries[it->second].isdir != manifest[name].isdir)
+        {
+            ESP_LOGD(TAG, "Deleting '%s'", name.c_str());
+
+            if (f_unlink(name.c_str()) == FR_OK)
+            {
+                numdeleted++;
+            }
+        }
+    }
+
+    std::vector<copy_entry> changed;
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        copy_entry *e = &entries[i];
+        std::string name = entry_name(e);
+        auto it = manifest.find(name);
+
+        if (!e->isdir && it != manifest.end() && !it->second.isdir)
+        {
+            manifest_entry *m = &it->second;
+
+            // A new timestamp alone doesn't mean new contents
+            if (m->size == e->size &&
+                (m->mtime == e->mtime || m->hash == hash_file(e->src)))
+            {
+                manifest_entry r = *m;
+                r.mtime = e->mtime;
+                records.push_back(std::make_pair(name, r));
+                numunchanged++;
+
+                free(e->src);
+                free(e->dst);
+                continue;
+            }
+
+            ESP_LOGD(TAG, "Replacing '%s'", name.c_str());
+            f_unlink(name.c_str());
+        }
+
+        if (!name.empty())
+        {
+            manifest_entry r = {};
+            r.isdir = e->isdir;
+            r.ndx = changed.size();
+            records.push_back(std::make_pair(name, r));
+        }
+
+        changed.push_back(*e);
+    }
+
+    entries.swap(changed);
+
+    return ESP_OK;
+}
+
+esp_err_t FatFSImage::write_manifest()
+{
+    std::string temp = manifest_path + ".tmp";
+
+    FILE *f = fopen(temp.c_str(), "w");
+    if (f == NULL)
+    {
+        ESP_LOGE(TAG, "Unable to create manifest '%s'", temp.c_str());
+        return ESP_FAIL;
+    }
+
+    uint32_t crc = 0;
+    if (boot_crc(NULL, &crc) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Unable to read the boot sector");
+        fclose(f);
+        return ESP_FAIL;
+    }
+
+    fprintf(f, "fatfsimage-manifest 2 %u %u %u %s %08x\n",
+            image_bytes,
+            fat_sector_bytes,
+            fs->csize * fs->ssize,
+            raw_fat ? "raw" : "wl",
+            crc);
+
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        manifest_entry *r = &records[i].second;
+
+        if (r->ndx >= 0)
+        {
+            copy_entry *e = &entries[r->ndx];
+
+            // Files that failed to copy are left out so they're retried
+            if (!e->isdir && !e->written)
+            {
+                continue;
+            }
+
+            r->size = e->size;
+            r->mtime = e->mtime;
+            r->hash = e->hash;
+            r->chain = e->isdir ? "" : cluster_chain(e->sclust);
+        }
+
+        if (r->isdir)
+        {
+            fprintf(f, "D\t%s\n", records[i].first.c_str());
+        }
+        else
+        {
+            fprintf(f, "F\t%s\t%lld\t%lld\t%08x\t%s\n",
+                    records[i].first.c_str(),
+                    (long long) r->size,
+                    (long long) r->mtime,
+                    r->hash,
+                    r->chain.c_str());
+        }
+    }
+
+    if (fclose(f) != 0 || rename(temp.c_str(), manifest_path.c_str()) != 0)
+    {
+        ESP_LOGE(TAG, "Unable to write manifest '%s'", manifest_path.c_str());
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+// CRC of the boot sector of the image on "fa", through wear levelling
+// unless it's raw, or of the image being built if "fa" is NULL
+esp_err_t FatFSImage::boot_crc(Flash_Access *fa, uint32_t *crc)
+{
+    WL_Flash wl;
+    Flash_Access *volume = fa != NULL ? fa : drives[0].flash;
+
+    if (fa != NULL && !raw_fat)
+    {
+        wl_config_t cfg = wl_config(image_bytes, wl_updaterate, wl_write_size, WL_DEFAULT_TEMP_BUFF_SIZE);
+        if (wl.config(&cfg, fa) != ESP_OK || wl.init() != ESP_OK)
+        {
+            return ESP_FAIL;
+        }
+        volume = &wl;
+    }
+
+    std::vector<uint8_t> sec(fat_sector_bytes);
+    if (volume->read(0, sec.data(), sec.size()) != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+
+    *crc = crc32c(0, sec.data(), sec.size());
+
+    return ESP_OK;
+}
+
+uint32_t FatFSImage::hash_file(const char *path)
+{
+    uint32_t hash = 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        return hash;
+    }
+
+    char buf[PREFETCH_CHUNK_SIZE];
+    ssize_t len;
+    while ((len = ::read(fd, buf, sizeof(buf))) > 0)
+    {
+        hash = crc32::crc32_le(hash, (const unsigned char *) buf, len);
+    }
+
+    close(fd);
+
+    return hash;
+}
+
+std::string FatFSImage::cluster_chain(DWORD clst)
+{
+    std::string runs;
+    BYTE sec[FF_MAX_SS];
+    DWORD cached = 0;
+    DWORD start = clst;
+    DWORD count = 0;
+    DWORD steps = 0;
+
+    // The step limit stops a corrupt FAT with a loop in it from hanging
+    while (clst >= 2 && clst < fs->n_fatent && steps++ < fs->n_fatent)
+    {
+        count++;
+
+        DWORD next = fat_entry(clst, sec, &cached);
+        if (next != clst + 1)
+        {
+            if (!runs.empty())
+            {
+                runs += ",";
+            }
+            runs += std::to_string(start) + "+" + std::to_string(count);
+
+            start = next;
+            count = 0;
+        }
+
+        clst = next;
+    }
+
+    return runs;
+}
+
+// Reads a FAT entry straight from the volume.  FatFs has flushed its window
+// by the time this is used, since every file has been closed.
+DWORD FatFSImage::fat_entry(DWORD clst, BYTE *sec, DWORD *cached)
+{
+    UINT ss = fs->ssize;
+    DWORD ofs;
+    DWORD val = 0;
+    int bytes;
+
+    switch (fs->fs_type)
+    {
+        case FS_FAT12:
+            ofs = clst + clst / 2;
+            bytes = 2;
+            break;
+
+        case FS_FAT16:
+            ofs = clst * 2;
+            bytes = 2;
+            break;
+
+        default:
+            ofs = clst * 4;
+            bytes = 4;
+            break;
+    }
+
+    // A FAT12 entry may straddle two sectors, so go a byte at a time
+    for (int i = 0; i < bytes; i++, ofs++)
+    {
+        DWORD sect = fs->fatbase + ofs / ss;
+        if (sect != *cached)
+        {
+            if (disk_read(fs->pdrv, sec, sect, 1) != RES_OK)
+            {
+                return 0;
+            }
+            *cached = sect;
+        }
+
+        val |= (DWORD) sec[ofs % ss] << (i * 8);
+    }
+
+    switch (fs->fs_type)
+    {
+        case FS_FAT12:
+            return (clst & 1) ? val >> 4 : val & 0xfff;
+
+        case FS_FAT16:
+            return val;
+
+        default:
+            return val & 0x0fffffff;
+    }
+}
+
+// ============================================================================
+// Prefetch pipeline
+//
+// A pool of reader threads opens and reads the scanned files ahead of the
+// FatFs writer and queues their contents in chunks taken from a bounded pool.
+// All FatFs calls stay on the writer (calling) thread.
+//
+// The last free chunk is reserved for the file the writer is waiting on, so
+// readers that are further ahead can never starve it.
+// ============================================================================
+
+esp_err_t FatFSImage::prefetch()
+{
+    ESP_LOGD(TAG, "Copying %d entries with %d readers", (int) entries.size(), jobs);
+
+    int count = jobs * PREFETCH_CHUNKS;
+
+    pool = (prefetch_chunk *) malloc(count * sizeof(prefetch_chunk));
+    if (pool == NULL)
+    {
+        ESP_LOGE(TAG, "Unable to allocate memory");
+        return ESP_FAIL;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        pool[i].map = NULL;
+        pool[i].next = free_chunks;
+        free_chunks = &pool[i];
+    }
+    free_count = count;
+    next_read = 0;
+    next_write = 0;
+
+    std::vector<pthread_t> readers;
+    for (int i = 0; i < jobs; i++)
+    {
+        pthread_t t;
+        if (pthread_create(&t, NULL, reader_thread, this) != 0)
+        {
+            ESP_LOGE(TAG, "Unable to start reader thread");
+            break;
+        }
+        readers.push_back(t);
+    }
+
+    // Without any readers there'd be nobody to fill the queues
+    if (readers.empty())
+    {
+        free(pool);
+        pool = NULL;
+        return ESP_FAIL;
+    }
+
+    esp_err_t err = ESP_OK;
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        pthread_mutex_lock(&lock);
+        next_write = i;
+        pthread_cond_broadcast(&chunk_freed);
+        pthread_mutex_unlock(&lock);
+
+        // Carry on with the rest, so one bad source shows up along with
+        // any others
+        if (entries[i].isdir ? target_dir(entries[i].src, entries[i].dst) != ESP_OK : write_entry(i) != ESP_OK)
+        {
+            err = ESP_FAIL;
+        }
+    }
+
+    for (size_t i = 0; i < readers.size(); i++)
+    {
+        pthread_join(readers[i], NULL);
+    }
+
+    free(pool);
+    pool = NULL;
+    free_chunks = NULL;
+
+    return err;
+}
+
+void *FatFSImage::reader_thread(void *arg)
+{
+    ((FatFSImage *) arg)->reader();
+
+    return NULL;
+}
+
+void FatFSImage::reader()
+{
+    while (1)
+    {
+        pthread_mutex_lock(&lock);
+        while (next_read < entries.size() && entries[next_read].isdir)
+        {
+            next_read++;
+        }
+
+        if (next_read >= entries.size())
+        {
+            pthread_mutex_unlock(&lock);
+            break;
+        }
+
+        size_t ndx = next_read++;
+        copy_entry *e = &entries[ndx];
+        pthread_mutex_unlock(&lock);
+
+        int error = 0;
+        uint32_t hash = 0;
+        bool hashing = args.incremental->count > 0;
+        uint32_t digest = 0;
+        bool digesting = args.verify->count > 0;
+        int fd = open(e->src, O_RDONLY);
+        if (fd == -1)
+        {
+            error = errno;
+        }
+
+        const shared_source *shared = error == 0 ? find_shared(fd) : NULL;
+
+        // With --mmap, or for files in the shared cache, the whole file
+        // travels as a single chunk pointing at the mapping.  The chunk
+        // still comes from the pool, which bounds the number of files
+        // mapped at once.
+        if (error == 0 && (shared != NULL || args.mmap->count > 0))
+        {
+            prefetch_chunk *chunk = get_chunk(ndx);
+
+            if (shared != NULL)
+            {
+                // Owned by the cache, so put_chunk() mustn't unmap it
+                chunk->map = NULL;
+                chunk->data = shared->data;
+                chunk->len = shared->len;
+            }
+            else
+            {
+                error = map_source(fd, &chunk->map, &chunk->len);
+                chunk->data = (const char *) chunk->map;
+            }
+
+            if (error != 0 || chunk->data == NULL)
+            {
+                put_chunk(chunk);
+            }
+            else
+            {
+                chunk->next = NULL;
+
+                if (hashing)
+                {
+                    hash = crc32::crc32_le(hash, (const unsigned char *) chunk->data, chunk->len);
+                }
+
+                if (digesting)
+                {
+                    digest = crc32c(digest, chunk->data, chunk->len);
+                }
+
+                pthread_mutex_lock(&lock);
+                e->head = chunk;
+                e->tail = chunk;
+                pthread_cond_broadcast(&chunk_queued);
+                pthread_mutex_unlock(&lock);
+            }
+
+            close(fd);
+            fd = -1;
+        }
+
+        while (error == 0 && fd != -1)
+        {
+            prefetch_chunk *chunk = get_chunk(ndx);
+
+            ssize_t len = 0;
+            while (len < (ssize_t) sizeof(chunk->buf))
+            {
+                ssize_t cnt = ::read(fd, &chunk->buf[len], sizeof(chunk->buf) - len);
+                if (cnt == -1 && errno == EINTR)
+                {
+                    continue;
+                }
+
+                if (cnt == -1)
+                {
+                    error = errno;
+                }
+
+                if (cnt <= 0)
+                {
+                    break;
+                }
+
+                len += cnt;
+            }
+
+            if (len == 0 || error != 0)
+            {
+                put_chunk(chunk);
+                break;
+            }
+
+            chunk->data = chunk->buf;
+            chunk->len = len;
+            chunk->next = NULL;
+
+            if (hashing)
+            {
+                hash = crc32::crc32_le(hash, (const unsigned char *) chunk->data, chunk->len);
+            }
+
+            if (digesting)
+            {
+                digest = crc32c(digest, chunk->data, chunk->len);
+            }
+
+            pthread_mutex_lock(&lock);
+            if (e->tail)
+            {
+                e->tail->next = chunk;
+            }
+            else
+            {
+                e->head = chunk;
+            }
+            e->tail = chunk;
+            pthread_cond_broadcast(&chunk_queued);
+            pthread_mutex_unlock(&lock);
+
+            // Short read means end of file
+            if (len < (ssize_t) sizeof(chunk->buf))
+            {
+                break;
+            }
+        }
+
+        if (fd != -1)
+        {
+            close(fd);
+        }
+
+        pthread_mutex_lock(&lock);
+        e->error = error;
+        e->hash = hash;
+        e->digest = digest;
+        e->digested = digesting && error == 0;
+        e->done = true;
+        pthread_cond_broadcast(&chunk_queued);
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+esp_err_t FatFSImage::write_entry(size_t ndx)
+{
+    copy_entry *e = &entries[ndx];
+    char dst[PATH_MAX];
+    int dstlen = strlen(e->dst);
+    int err = 0;
+    FRESULT res;
+    FIL dstf;
+
+    strcpy(dst, e->dst);
+
+    if (target_file(e->src, dst, &dstlen) != ESP_OK)
+    {
+        err = -1;
+    }
+    else
+    {
+        ESP_LOGD(TAG, "Copying file '%s' to '%s'", e->src, dst);
+
+        res = open_target(&dstf, dst, e->size);
+        if (res != FR_OK)
+        {
+            ESP_LOGE(TAG, "Unable to open target '%s'", dst);
+            err = -1;
+        }
+    }
+
+    // Chunks must be drained even when the target couldn't be opened so
+    // they make it back to the pool.
+    prefetch_chunk *chunk;
+    while ((chunk = next_chunk(ndx)) != NULL)
+    {
+        if (err == 0)
+        {
+            write_span(&dstf, chunk->data, chunk->len);
+        }
+
+        put_chunk(chunk);
+    }
+
+    if (err == 0)
+    {
+        if (e->error != 0)
+        {
+            ESP_LOGE(TAG, "Read returned %d for source '%s'", e->error, e->src);
+        }
+
+        e->written = close_target(&dstf, dst, e->error != 0, &e->sclust) == ESP_OK;
+    }
+
+    return err == 0 && e->written ? ESP_OK : ESP_FAIL;
+}
+
+FatFSImage::prefetch_chunk *FatFSImage::get_chunk(size_t ndx)
+{
+    pthread_mutex_lock(&lock);
+    while (free_count == 0 || (free_count == 1 && ndx != next_write))
+    {
+        pthread_cond_wait(&chunk_freed, &lock);
+    }
+
+    prefetch_chunk *chunk = free_chunks;
+    free_chunks = chunk->next;
+    free_count--;
+    pthread_mutex_unlock(&lock);
+
+    return chunk;
+}
+
+void FatFSImage::put_chunk(prefetch_chunk *chunk)
+{
+    if (chunk->map)
+    {
+        munmap(chunk->map, chunk->len);
+        chunk->map = NULL;
+    }
+
+    pthread_mutex_lock(&lock);
+    chunk->next = free_chunks;
+    free_chunks = chunk;
+    free_count++;
+    pthread_cond_broadcast(&chunk_freed);
+    pthread_mutex_unlock(&lock);
+}
+
+FatFSImage::prefetch_chunk *FatFSImage::next_chunk(size_t ndx)
+{
+    copy_entry *e = &entries[ndx];
+
+    pthread_mutex_lock(&lock);
+    while (e->head == NULL && !e->done)
+    {
+        pthread_cond_wait(&chunk_queued, &lock);
+    }
+
+    prefetch_chunk *chunk = e->head;
+    if (chunk)
+    {
+        e->head = chunk->next;
+        if (e->head == NULL)
+        {
+            e->tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    return chunk;
+}
+
+
+// ============================================================================
+// Layout planner
+//
+// Every sector size, cluster size and FAT type combination is formatted onto
+// a scratch volume the size of the wear levelled image to get the real
+// FatFs geometry, and then the scanned sources are fitted into it.
+// ============================================================================
+
+// Number of 32 byte directory entries FatFs uses for a name
+static int dir_slots(const char *name)
+{
+    int len = strlen(name);
+    const char *dot = strrchr(name, '.');
+    int body = dot ? dot - name : len;
+    int ext = dot ? len - body - 1 : 0;
+    bool sfn = body > 0 && body <= 8 && ext <= 3 && (dot == NULL || strchr(name, '.') == dot);
+    int upper[2] = { 0, 0 };
+    int lower[2] = { 0, 0 };
+
+    for (int i = 0; sfn && i < len; i++)
+    {
+        unsigned char c = name[i];
+        int part = i > body;
+
+        if (c >= 'A' && c <= 'Z')
+        {
+            upper[part]++;
+        }
+        else if (c >= 'a' && c <= 'z')
+        {
+            lower[part]++;
+        }
+        else if (c != '.' && (c < '0' || c > '9') && !strchr("!#$%&'()-@^_`{}~", c))
+        {
+            sfn = false;
+        }
+    }
+
+    // Mixed case within the body or extension needs a long name
+    if (sfn && !(upper[0] && lower[0]) && !(upper[1] && lower[1]))
+    {
+        return 1;
+    }
+
+    return 1 + (len + 12) / 13;
+}
+
+// Adds up the directory entries each directory of the scanned tree needs
+void FatFSImage::count_dir_slots()
+{
+    dir_need.clear();
+
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        std::string name = entry_name(&entries[i]);
+        if (name.empty())
+        {
+            continue;
+        }
+
+        size_t slash = name.rfind('/');
+        dir_need[name.substr(0, slash)] += dir_slots(name.c_str() + slash + 1);
+
+        // "." and ".."
+        if (entries[i].isdir)
+        {
+            dir_need[name] += 2;
+        }
+    }
+}
+
+// Grows a new directory to the clusters its entries will need before any
+// are created, so it gets one contiguous run up front instead of being
+// extended a cluster at a time in between its files' data.  FatFs has no
+// call for that, so the directory is filled with long-named placeholder
+// files that are then deleted, leaving the clusters allocated and the
+// entries free for reuse.
+void FatFSImage::presize_dir(const std::string &dir)
+{
+    auto it = dir_need.find(dir);
+    if (it == dir_need.end() || (dir.empty() && fs->fs_type != FS_FAT32))
+    {
+        return;
+    }
+
+    uint32_t per_cluster = fs->csize * fs->ssize / 32;
+    uint32_t clusters = (it->second + per_cluster - 1) / per_cluster;
+    if (clusters <= 1)
+    {
+        return;
+    }
+
+    // Enough to spill into the last cluster, given what's already there
+    uint32_t used = dir.empty() ? 0 : 2;
+    uint32_t target = (clusters - 1) * per_cluster + 1;
+    std::vector<std::string> placeholders;
+
+    while (used < target)
+    {
+        // Up to 19 long name entries (247 characters) plus the short one.
+        // Distinct leading digits keep the short names from colliding.
+        uint32_t slots = target - used < 20 ? target - used : 20;
+        char name[16];
+        snprintf(name, sizeof(name), "/%06u", (unsigned) placeholders.size());
+
+        std::string path = dir + name;
+        if (slots > 1)
+        {
+            path.append(13 * (slots - 1) - 6, 'x');
+        }
+
+        FIL f;
+        if (f_open(&f, path.c_str(), FA_WRITE | FA_CREATE_NEW) != FR_OK)
+        {
+            break;
+        }
+        f_close(&f);
+
+        placeholders.push_back(path);
+        used += dir_slots(path.c_str() + dir.size() + 1);
+    }
+
+    for (size_t i = 0; i < placeholders.size(); i++)
+    {
+        f_unlink(placeholders[i].c_str());
+    }
+
+    ESP_LOGD(TAG, "Presized '%s' to %d clusters", dir.c_str(), (int) clusters);
+}
+
+esp_err_t FatFSImage::plan_layout()
+{
+    // An existing image keeps its layout
+    if (args.plan->count == 0 || reuse)
+    {
+        return ESP_OK;
+    }
+
+    ESP_LOGD(TAG, "Planning filesystem layout");
+
+    if (scan_files() != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+
+    MemoryFlash scratch(drives[0].flash->chip_size(), false);
+    if (!scratch.valid())
+    {
+        ESP_LOGE(TAG, "Unable to allocate %d bytes for planning", (int) drives[0].flash->chip_size());
+        return ESP_FAIL;
+    }
+
+    static const UINT sector_sizes[] = { 512, SPI_FLASH_SEC_SIZE };
+    static const BYTE formats[] = { FM_FAT, FM_FAT32 };
+    std::vector<layout_plan> plans;
+
+    drives[1].flash = &scratch;
+
+    for (size_t s = 0; s < sizeof(sector_sizes) / sizeof(sector_sizes[0]); s++)
+    {
+        if (raw_fat && sector_sizes[s] != SPI_FLASH_SEC_SIZE)
+        {
+            continue;
+        }
+
+        for (UINT au = sector_sizes[s]; au <= 64 * 1024; au <<= 1)
+        {
+            for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++)
+            {
+                layout_plan plan = {};
+                plan.sector_size = sector_sizes[s];
+                plan.cluster_size = au;
+                plan.format = formats[f];
+
+                if (plan_candidate(&plan) == ESP_OK)
+                {
+                    plans.push_back(plan);
+                }
+            }
+        }
+    }
+
+    drives[1].flash = NULL;
+
+    // Take the candidate leaving the most free space.  Anything within 1%
+    // of that counts as a tie and is decided by the fewest FAT sectors read
+    // per file, which is what costs time on the device.
+    int best = -1;
+    uint64_t most = 0;
+    for (size_t i = 0; i < plans.size(); i++)
+    {
+        if (plans[i].fits && plans[i].free_bytes >= most)
+        {
+            most = plans[i].free_bytes;
+        }
+    }
+
+    for (size_t i = 0; i < plans.size(); i++)
+    {
+        if (plans[i].fits && plans[i].free_bytes >= most - most / 100)
+        {
+            if (best < 0 || plans[i].fat_per_open < plans[best].fat_per_open)
+            {
+                best = i;
+            }
+        }
+    }
+
+    printf("Layout candidates\n\n");
+    printf("    sector  cluster  FAT  clusters    needed   FAT KB  slack KB   free KB  FAT/open\n");
+    for (size_t i = 0; i < plans.size(); i++)
+    {
+        layout_plan *p = &plans[i];
+        printf("  %c %6d  %7d  %3d  %8d  %8d  %7d  %8d  %8s  %8.2f\n",
+               (int) i == best ? '*' : ' ',
+               p->sector_size,
+               p->cluster_size,
+               p->fs_type == FS_FAT32 ? 32 : p->fs_type == FS_FAT16 ? 16 : 12,
+               p->clusters,
+               p->needed,
+               (int) (p->fat_bytes / 1024),
+               (int) (p->slack_bytes / 1024),
+               p->fits ? std::to_string(p->free_bytes / 1024).c_str() : "-",
+               p->fat_per_open);
+    }
+    printf("\n");
+
+    if (best < 0)
+    {
+        ESP_LOGE(TAG, "No filesystem layout fits the sources in %d KB", image_bytes / 1024);
+        return ESP_FAIL;
+    }
+
+    fat_sector_bytes = plans[best].sector_size;
+    cluster_bytes = plans[best].cluster_size;
+    fat_format = plans[best].format;
+
+    if (fat_sector_bytes != SPI_FLASH_SEC_SIZE)
+    {
+        printf("  note: set CONFIG_WL_SECTOR_SIZE=%d (performance mode) on the device\n\n", fat_sector_bytes);
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t FatFSImage::plan_candidate(layout_plan *plan)
+{
+    drives[1].sector_size = plan->sector_size;
+
+    FRESULT res = f_mkfs(plan_drv, plan->format | FM_SFD, plan->cluster_size, NULL, 0);
+    if (res != FR_OK)
+    {
+        ESP_LOGD(TAG, "Layout %d/%d/%d not possible (%d)", plan->sector_size, plan->cluster_size, plan->format, res);
+        return ESP_FAIL;
+    }
+
+    FATFS pfs;
+    res = f_mount(&pfs, plan_drv, 1);
+    if (res != FR_OK)
+    {
+        return ESP_FAIL;
+    }
+
+    UINT ss = pfs.ssize;
+    UINT cs = pfs.csize * ss;
+
+    plan->fs_type = pfs.fs_type;
+    plan->cluster_size = cs;
+    plan->clusters = pfs.n_fatent - 2;
+    plan->fat_bytes = (uint64_t) pfs.fsize * pfs.n_fats * ss;
+
+    WORD rootdir = pfs.n_rootdir;
+
+    f_unmount(plan_drv);
+
+    // FAT entry size in half bytes
+    int nibbles = plan->fs_type == FS_FAT12 ? 3 : plan->fs_type == FS_FAT16 ? 4 : 8;
+
+    std::unordered_map<std::string, uint64_t> slots;
+    uint64_t needed = 0;
+    uint64_t files = 0;
+    double fat_sectors = 0;
+
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        copy_entry *e = &entries[i];
+
+        // Top level directories are the root itself
+        if (e->isdir && e->dst[0] == '\0')
+        {
+            continue;
+        }
+
+        std::string name = entry_name(e);
+        size_t sep = name.rfind('/');
+        slots[name.substr(0, sep)] += dir_slots(name.c_str() + sep + 1);
+
+        if (e->isdir)
+        {
+            // The dot entries
+            slots[name] += 2;
+            continue;
+        }
+
+        uint64_t n = ((uint64_t) e->size + cs - 1) / cs;
+        needed += n;
+        plan->slack_bytes += n * cs - e->size;
+
+        if (n > 0)
+        {
+            fat_sectors += 1 + (n * nibbles / 2 - 1) / ss;
+            files++;
+        }
+    }
+
+    bool rootfits = true;
+    for (auto it = slots.begin(); it != slots.end(); ++it)
+    {
+        uint64_t bytes = it->second * 32;
+
+        // FAT12/16 have a fixed root directory outside the data area
+        if (it->first.empty() && plan->fs_type != FS_FAT32)
+        {
+            rootfits = it->second <= rootdir;
+            continue;
+        }
+
+        uint64_t n = (bytes + cs - 1) / cs;
+        needed += n ? n : 1;
+        plan->dir_clusters += n ? n : 1;
+    }
+
+    plan->needed = needed;
+    plan->fits = rootfits && needed <= plan->clusters;
+    plan->free_bytes = plan->fits ? (plan->clusters - needed) * (uint64_t) cs : 0;
+    plan->fat_per_open = files ? fat_sectors / files : 0;
+
+    return ESP_OK;
+}
+
+// ============================================================================
+// Image sizing
+//
+// "--dry-run" and "--auto-size" work out the space the scanned sources take
+// without building anything.  For a given image size the wear levelling
+// layer is only configured, which is enough to learn the volume it leaves,
+// and the volume is formatted on the scratch drive to find the FAT and
+// cluster geometry FatFs will use.  The clusters the files and directories
+// need are then counted the same way the layout planner does.
+//
+// The smallest size is found by doubling until the sources fit and then
+// bisecting, in whole flash sectors.  FatFs picks a smaller cluster size
+// for a smaller volume, which can make sources that fit a large image fail
+// to fit a slightly larger one than the answer, so the bisection keeps the
+// cluster size found for the doubled size and the image is built with it.
+// ============================================================================
+
+esp_err_t FatFSImage::size_image()
+{
+    if (args.dry_run->count == 0 && args.auto_size->count == 0)
+    {
+        return ESP_OK;
+    }
+
+    ESP_LOGD(TAG, "Sizing image");
+
+    uint32_t headroom = args.headroom->count > 0 ? args.headroom->ival[0] : SIZE_HEADROOM_PERCENT;
+    const uint32_t most = UINT32_MAX - UINT32_MAX % SPI_FLASH_SEC_SIZE;
+
+    // FatFs won't format fewer than 128 sectors
+    uint32_t lo = (128 * fat_sector_bytes + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE;
+    uint32_t hi = lo;
+
+    layout_plan plan;
+    size_t volume;
+    bool fits;
+
+    while (true)
+    {
+        if (size_fits(hi, cluster_bytes, headroom, &plan, &volume, &fits) != ESP_OK)
+        {
+            return ESP_FAIL;
+        }
+
+        if (fits)
+        {
+            break;
+        }
+
+        if (hi == most)
+        {
+            ESP_LOGE(TAG, "The sources don't fit in any image size");
+            return ESP_FAIL;
+        }
+
+        lo = hi + SPI_FLASH_SEC_SIZE;
+        hi = hi > most / 2 ? most : hi * 2;
+    }
+
+    uint32_t csize = plan.cluster_size;
+
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / SPI_FLASH_SEC_SIZE / 2 * SPI_FLASH_SEC_SIZE;
+        if (size_fits(mid, csize, headroom, &plan, &volume, &fits) != ESP_OK)
+        {
+            return ESP_FAIL;
+        }
+
+        if (fits)
+        {
+            hi = mid;
+        }
+        else
+        {
+            lo = mid + SPI_FLASH_SEC_SIZE;
+        }
+    }
+
+    if (size_fits(hi, csize, headroom, &plan, &volume, &fits) != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+
+    if (args.dry_run->count > 0)
+    {
+        printf("Image sizing\n\n");
+        printf("  source directories: %u\n", source_dirs);
+        printf("  source files: %u\n", source_files);
+        printf("  source bytes: %llu\n", (unsigned long long) source_bytes);
+        printf("\n");
+
+        if (args.kb->count > 0)
+        {
+            layout_plan given;
+            size_t given_volume;
+            bool given_fits;
+            if (size_fits(image_bytes, cluster_bytes, 0, &given, &given_volume, &given_fits) != ESP_OK)
+            {
+                return ESP_FAIL;
+            }
+            print_sizing("requested size", image_bytes, given_volume, &given);
+        }
+
+        std::string title = "smallest size with " + std::to_string(headroom) + "% headroom";
+        print_sizing(title.c_str(), hi, volume, &plan);
+    }
+
+    if (args.auto_size->count > 0)
+    {
+        if (args.kb->count > 0 && hi > image_bytes)
+        {
+            ESP_LOGE(TAG, "The sources need %d KB but only %d KB is allowed", hi / 1024, image_bytes / 1024);
+            return ESP_FAIL;
+        }
+
+        image_bytes = hi;
+        sector_count = image_bytes / sector_bytes;
+
+        // What FatFs would pick by itself for this size may not fit
+        cluster_bytes = csize;
+
+        printf("Image size set to %d KB, the partition must be the same size\n\n", image_bytes / 1024);
+    }
+
+    return ESP_OK;
+}
+
+// Works out the layout of an image of "bytes" with clusters of "csize" (0
+// for FatFs to choose) and whether the sources fit it with "headroom"
+// percent to spare.  Only fails when the size can't be tried at all.
+esp_err_t FatFSImage::size_fits(uint32_t bytes, uint32_t csize, uint32_t headroom, layout_plan *plan, size_t *volume, bool *fits)
+{
+    memset(plan, 0, sizeof(*plan));
+    plan->sector_size = fat_sector_bytes;
+    plan->cluster_size = csize;
+    plan->format = fat_format;
+
+    *fits = false;
+    *volume = bytes;
+    if (!raw_fat)
+    {
+        // Configuring doesn't touch the flash, only works out the layout
+        WL_Flash wl;
+        wl_config_t cfg = wl_config(bytes, wl_updaterate, wl_write_size, WL_DEFAULT_TEMP_BUFF_SIZE);
+        if (wl.config(&cfg, this) != ESP_OK || wl.chip_size() == 0 || wl.chip_size() > bytes)
+        {
+            *volume = 0;
+            return ESP_OK;
+        }
+        *volume = wl.chip_size();
+    }
+
+    MemoryFlash scratch(*volume, false);
+    if (!scratch.valid())
+    {
+        ESP_LOGE(TAG, "Unable to allocate %d bytes to size the image", (int) *volume);
+        return ESP_ERR_NO_MEM;
+    }
+
+    drives[1].flash = &scratch;
+    esp_err_t err = plan_candidate(plan);
+    drives[1].flash = NULL;
+
+    *fits = err == ESP_OK && plan->fits && plan->clusters >= plan->needed + (uint64_t) plan->needed * headroom / 100;
+
+    return ESP_OK;
+}
+
+void FatFSImage::print_sizing(const char *title, uint32_t bytes, size_t volume, const layout_plan *plan)
+{
+    uint32_t cs = plan->cluster_size;
+
+    printf("  %s: %d KB\n", title, bytes / 1024);
+    if (volume == 0 || plan->clusters == 0)
+    {
+        printf("    no filesystem fits\n\n");
+        return;
+    }
+
+    printf("    wear levelling: %d KB\n", (int) ((bytes - volume) / 1024));
+    printf("    filesystem sector size: %d\n", plan->sector_size);
+    printf("    cluster size: %d\n", cs);
+    printf("    FAT type: FAT%d\n", plan->fs_type == FS_FAT32 ? 32 : plan->fs_type == FS_FAT16 ? 16 : 12);
+    printf("    FAT sectors: %d\n", (int) (plan->fat_bytes / plan->sector_size));
+    printf("    total clusters: %u\n", plan->clusters);
+    printf("    file clusters: %u\n", plan->needed - plan->dir_clusters);
+    printf("    directory clusters: %u\n", plan->dir_clusters);
+    printf("    slack: %d KB\n", (int) (plan->slack_bytes / 1024));
+    if (plan->fits)
+    {
+        printf("    free: %d KB\n", (int) (plan->free_bytes / 1024));
+    }
+    else if (plan->needed > plan->clusters)
+    {
+        printf("    doesn't fit, %u more clusters needed\n", plan->needed - plan->clusters);
+    }
+    else
+    {
+        printf("    doesn't fit, the root directory is full\n");
+    }
+    printf("\n");
+}
+
+// ============================================================================
+// Direct image writer
+//
+// The volume is laid out like f_mkfs() would for a single FAT without a
+// partition table, with the FAT type following from the cluster count the
+// same way FatFs decides it at mount time.  Nothing is ever read, so the
+// image must start out erased.
+// ============================================================================
+
+#define DIRECT_MAX_FAT12 0xff5
+#define DIRECT_MAX_FAT16 0xfff5
+#define DIRECT_MAX_FAT32 0x0ffffff5
+#define DIRECT_ROOT_ENTRIES 512
+
+FatFSDirect::FatFSDirect(Flash_Access *flash, UINT sector_size)
+{
+    this->flash = flash;
+    ss = sector_size;
+    fattime = get_fattime();
+
+    // The root directory
+    node root = {};
+    root.parent = -1;
+    root.isdir = true;
+    nodes.push_back(root);
+    paths[""] = 0;
+}
+
+esp_err_t FatFSDirect::add(const char *src, const char *path, bool isdir, uint64_t size)
+{
+    // Top level directories are the root itself
+    if (path[0] == '\0')
+    {
+        return ESP_OK;
+    }
+
+    std::string name = path;
+    size_t sep = name.rfind('/');
+    auto it = paths.find(name.substr(0, sep));
+    if (it == paths.end() || !nodes[it->second].isdir)
+    {
+        ESP_LOGE(TAG, "No directory for '%s'", path);
+        return ESP_FAIL;
+    }
+
+    if (paths.count(name))
+    {
+        // Merging several source directories into the root
+        if (isdir && nodes[paths[name]].isdir)
+        {
+            return ESP_OK;
+        }
+
+        ESP_LOGE(TAG, "Duplicate target '%s'", path);
+        return ESP_FAIL;
+    }
+
+    if (!isdir && size > 0xffffffff)
+    {
+        ESP_LOGE(TAG, "'%s' is too large for FAT", src);
+        return ESP_FAIL;
+    }
+
+    node n = {};
+    n.src = src;
+    n.name = name.substr(sep + 1);
+    n.parent = it->second;
+    n.isdir = isdir;
+    n.size = size;
+
+    int ndx = nodes.size();
+    nodes.push_back(n);
+    nodes[it->second].children.push_back(ndx);
+    paths[name] = ndx;
+
+    return ESP_OK;
+}
+
+esp_err_t FatFSDirect::layout(UINT cluster_size, BYTE format)
+{
+    // Short names have to be unique within each directory
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+        std::unordered_map<std::string, int> used;
+        for (size_t c = 0; c < nodes[i].children.size(); c++)
+        {
+            if (make_sfn(&nodes[nodes[i].children[c]], &used) != ESP_OK)
+            {
+                return ESP_FAIL;
+            }
+        }
+    }
+
+    nsect = flash->chip_size() / ss;
+
+    // Try the cluster size asked for, or the smallest one that works
+    for (csize = cluster_size ? cluster_size / ss : 1; csize > 0 && csize <= 128; csize <<= 1)
+    {
+        static const BYTE types[] = { FS_FAT12, FS_FAT16, FS_FAT32 };
+
+        for (size_t t = 0; t < sizeof(types) / sizeof(types[0]); t++)
+        {
+            type = types[t];
+            if ((format == FM_FAT32 && type != FS_FAT32) || (format == FM_FAT && type == FS_FAT32))
+            {
+                continue;
+            }
+
+            rsvd = type == FS_FAT32 ? 32 : 1;
+            rootsz = type == FS_FAT32 ? 0 : DIRECT_ROOT_ENTRIES * 32 / ss;
+
+            // Size the FAT for the most clusters possible, then see how many
+            // are really left
+            uint64_t most = (nsect - rsvd - rootsz) / csize + 2;
+            uint64_t bytes = type == FS_FAT12 ? (most * 3 + 1) / 2 : most * (type == FS_FAT16 ? 2 : 4);
+            fatsz = (bytes + ss - 1) / ss;
+
+            if (rsvd + fatsz + rootsz >= nsect)
+            {
+                continue;
+            }
+
+            nclst = (nsect - rsvd - fatsz - rootsz) / csize;
+
+            if ((type == FS_FAT12 && nclst <= DIRECT_MAX_FAT12) ||
+                (type == FS_FAT16 && nclst > DIRECT_MAX_FAT12 && nclst <= DIRECT_MAX_FAT16) ||
+                (type == FS_FAT32 && nclst > DIRECT_MAX_FAT16 && nclst <= DIRECT_MAX_FAT32))
+            {
+                break;
+            }
+
+            type = 0;
+        }
+
+        if (type != 0 || cluster_size != 0)
+        {
+            break;
+        }
+    }
+
+    if (type == 0)
+    {
+        ESP_LOGE(TAG, "No FAT layout possible with %d byte clusters", cluster_size);
+        return ESP_FAIL;
+    }
+
+    fatbase = rsvd;
+    dirbase = fatbase + fatsz;
+    database = dirbase + rootsz;
+
+    // Allocate everything back to back in the order it was added
+    UINT cs = csize * ss;
+    next = 2;
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+        node *n = &nodes[i];
+        uint64_t bytes = n->isdir ? (uint64_t) dir_slots(n) * 32 : n->size;
+
+        if (i == 0 && type != FS_FAT32)
+        {
+            if (bytes > rootsz * ss)
+            {
+                ESP_LOGE(TAG, "Too many entries in the root directory");
+                return ESP_FAIL;
+            }
+            continue;
+        }
+
+        n->count = (bytes + cs - 1) / cs;
+        if (n->isdir && n->count == 0)
+        {
+            n->count = 1;
+        }
+
+        if (n->count > 0)
+        {
+            if (next + n->count > nclst + 2)
+            {
+                ESP_LOGE(TAG, "Not enough space for '%s'", i ? n->src.c_str() : "/");
+                return ESP_FAIL;
+            }
+
+            n->clust = next;
+            next += n->count;
+        }
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t FatFSDirect::make_sfn(node *n, std::unordered_map<std::string, int> *used)
+{
+    const char *name = n->name.c_str();
+    int len = n->name.size();
+    const char *dot = strrchr(name, '.');
+    int body = (dot && dot != name) ? dot - name : len;
+    bool lossy = false;
+    int cases[2] = { 0, 0 };        // bit 0 lower, bit 1 upper
+
+    if (len > FF_MAX_LFN || strpbrk(name, "\"*:<>?|\\\x7f"))
+    {
+        ESP_LOGE(TAG, "'%s' is not a valid FAT name", n->src.c_str());
+        return ESP_FAIL;
+    }
+
+    // Long names are compared without regard to case as well
+    std::string folded = "/";
+    for (int i = 0; i < len; i++)
+    {
+        folded += tolower((unsigned char) name[i]);
+    }
+
+    if (used->count(folded))
+    {
+        ESP_LOGE(TAG, "'%s' clashes with another name in its directory", n->src.c_str());
+        return ESP_FAIL;
+    }
+    (*used)[folded] = 1;
+
+    memset(n->sfn, ' ', sizeof(n->sfn));
+    n->ntres = 0;
+
+    int b = 0;
+    int e = 8;
+    for (int i = 0; i < len; i++)
+    {
+        unsigned char c = name[i];
+        int part = i > body;
+
+        if (i == body)
+        {
+            continue;
+        }
+
+        if ((part == 0 && b >= 8) || (part == 1 && e >= 11))
+        {
+            lossy = true;
+            continue;
+        }
+
+        if (c >= 'a' && c <= 'z')
+        {
+            cases[part] |= 1;
+            c -= 'a' - 'A';
+        }
+        else if (c >= 'A' && c <= 'Z')
+        {
+            cases[part] |= 2;
+        }
+        else if (c >= 0x80 || c == ' ' || c == '.' || strchr("+,;=[]", c))
+        {
+            lossy = true;
+            c = '_';
+        }
+
+        n->sfn[part ? e++ : b++] = c;
+    }
+
+    if (b == 0)
+    {
+        lossy = true;
+        n->sfn[b++] = '_';
+    }
+
+    bool lfn = lossy || cases[0] == 3 || cases[1] == 3;
+
+    if (lfn)
+    {
+        // FatFs converts the name from the OEM code page
+        for (int i = 0; i < len; i++)
+        {
+            unsigned char c = name[i];
+            n->lfn.push_back(c < 0x80 ? c : ff_oem2uni(c, FF_CODE_PAGE));
+        }
+    }
+    else
+    {
+        n->ntres = (cases[0] == 1 ? 0x08 : 0) | (cases[1] == 1 ? 0x10 : 0);
+    }
+
+    // Lossy names get a numbered tail like "LONGNA~1"
+    for (int seq = 1; lossy; seq++)
+    {
+        char tail[8];
+        int tlen = snprintf(tail, sizeof(tail), "~%d", seq);
+        int keep = b + tlen > 8 ? 8 - tlen : b;
+
+        memcpy(&n->sfn[keep], tail, tlen);
+        for (int i = keep + tlen; i < 8; i++)
+        {
+            n->sfn[i] = ' ';
+        }
+
+        if (!used->count(std::string((char *) n->sfn, 11)))
+        {
+            break;
+        }
+
+        if (seq == 999999)
+        {
+            ESP_LOGE(TAG, "No short name left for '%s'", n->src.c_str());
+            return ESP_FAIL;
+        }
+    }
+
+    std::string key((char *) n->sfn, 11);
+    if (used->count(key))
+    {
+        ESP_LOGE(TAG, "'%s' clashes with another name in its directory", n->src.c_str());
+        return ESP_FAIL;
+    }
+    (*used)[key] = 1;
+
+    return ESP_OK;
+}
+
+int FatFSDirect::dir_slots(node *n)
+{
+    int slots = n->parent >= 0 ? 2 : 0;
+
+    for (size_t c = 0; c < n->children.size(); c++)
+    {
+        slots += 1 + (nodes[n->children[c]].lfn.size() + 12) / 13;
+    }
+
+    return slots;
+}
+
+void FatFSDirect::dir_entry(BYTE *p, const BYTE *sfn, BYTE attr, BYTE ntres, DWORD clust, DWORD size)
+{
+    memset(p, 0, 32);
+    memcpy(p, sfn, 11);
+    p[11] = attr;
+    p[12] = ntres;
+
+    // Creation and modification times
+    p[14] = fattime;
+    p[15] = fattime >> 8;
+    p[16] = fattime >> 16;
+    p[17] = fattime >> 24;
+    p[18] = fattime >> 16;
+    p[19] = fattime >> 24;
+    p[20] = clust >> 16;
+    p[21] = clust >> 24;
+    p[22] = fattime;
+    p[23] = fattime >> 8;
+    p[24] = fattime >> 16;
+    p[25] = fattime >> 24;
+    p[26] = clust;
+    p[27] = clust >> 8;
+    p[28] = size;
+    p[29] = size >> 8;
+    p[30] = size >> 16;
+    p[31] = size >> 24;
+}
+
+void FatFSDirect::set_fat(std::vector<BYTE> &fat, DWORD clst, DWORD val)
+{
+    switch (type)
+    {
+        case FS_FAT12:
+        {
+            DWORD ofs = clst + clst / 2;
+            if (clst & 1)
+            {
+                fat[ofs] = (fat[ofs] & 0x0f) | (val << 4);
+                fat[ofs + 1] = val >> 4;
+            }
+            else
+            {
+                fat[ofs] = val;
+                fat[ofs + 1] = (fat[ofs + 1] & 0xf0) | ((val >> 8) & 0x0f);
+            }
+            break;
+        }
+
+        case FS_FAT16:
+            fat[clst * 2] = val;
+            fat[clst * 2 + 1] = val >> 8;
+            break;
+
+        default:
+            for (int i = 0; i < 4; i++)
+            {
+                fat[clst * 4 + i] = val >> (i * 8);
+            }
+            break;
+    }
+}
+
+esp_err_t FatFSDirect::write_sectors(DWORD sect, const void *data, size_t len)
+{
+    StatTimer timer(STAT_WL_WRITE, (size_t) sect * ss, len);
+
+    esp_err_t err = flash->write((size_t) sect * ss, data, len);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Write of sector %d failed with %d", sect, err);
+    }
+
+    return err;
+}
+
+esp_err_t FatFSDirect::write()
+{
+    esp_err_t err;
+    DWORD eoc = type == FS_FAT12 ? 0xfff : type == FS_FAT16 ? 0xffff : 0x0fffffff;
+    std::vector<BYTE> sec(ss, 0);
+    BYTE *p = sec.data();
+
+    //
+    // Boot sector
+    //
+    p[0] = 0xeb;
+    p[1] = type == FS_FAT32 ? 0x58 : 0x3c;
+    p[2] = 0x90;
+    memcpy(&p[3], "MSDOS5.0", 8);
+    p[11] = ss;
+    p[12] = ss >> 8;
+    p[13] = csize;
+    p[14] = rsvd;
+    p[15] = rsvd >> 8;
+    p[16] = 1;                                  // number of FATs
+    p[17] = type == FS_FAT32 ? 0 : DIRECT_ROOT_ENTRIES & 0xff;
+    p[18] = type == FS_FAT32 ? 0 : DIRECT_ROOT_ENTRIES >> 8;
+    if (nsect < 0x10000)
+    {
+        p[19] = nsect;
+        p[20] = nsect >> 8;
+    }
+    else
+    {
+        p[32] = nsect;
+        p[33] = nsect >> 8;
+        p[34] = nsect >> 16;
+        p[35] = nsect >> 24;
+    }
+    p[21] = 0xf8;                               // media
+    p[24] = 63;                                 // sectors per track
+    p[26] = 255;                                // heads
+
+    BYTE *ext = &p[36];
+    if (type == FS_FAT32)
+    {
+        p[36] = fatsz;
+        p[37] = fatsz >> 8;
+        p[38] = fatsz >> 16;
+        p[39] = fatsz >> 24;
+        p[44] = nodes[0].clust;                 // root directory cluster
+        p[45] = nodes[0].clust >> 8;
+        p[46] = nodes[0].clust >> 16;
+        p[47] = nodes[0].clust >> 24;
+        p[48] = 1;                              // FSInfo sector
+        p[50] = 6;                              // backup boot sector
+        ext = &p[64];
+    }
+    else
+    {
+        p[22] = fatsz;
+        p[23] = fatsz >> 8;
+    }
+
+    ext[0] = 0x80;                              // drive number
+    ext[2] = 0x29;                              // extended boot signature
+    ext[3] = fattime;                           // volume serial number
+    ext[4] = fattime >> 8;
+    ext[5] = fattime >> 16;
+    ext[6] = fattime >> 24;
+    memcpy(&ext[7], "NO NAME    ", 11);
+    memcpy(&ext[18], type == FS_FAT32 ? "FAT32   " : type == FS_FAT16 ? "FAT16   " : "FAT12   ", 8);
+    p[510] = 0x55;
+    p[511] = 0xaa;
+
+    if ((err = write_sectors(0, p, ss)) != ESP_OK)
+    {
+        return err;
+    }
+
+    if (type == FS_FAT32)
+    {
+        std::vector<BYTE> fsi(ss, 0);
+        DWORD nfree = free_clusters();
+
+        memcpy(&fsi[0], "RRaA", 4);
+        memcpy(&fsi[484], "rrAa", 4);
+        for (int i = 0; i < 4; i++)
+        {
+            fsi[488 + i] = nfree >> (i * 8);
+            fsi[492 + i] = next >> (i * 8);
+        }
+        fsi[510] = 0x55;
+        fsi[511] = 0xaa;
+
+        if ((err = write_sectors(1, fsi.data(), ss)) != ESP_OK ||
+            (err = write_sectors(6, p, ss)) != ESP_OK ||
+            (err = write_sectors(7, fsi.data(), ss)) != ESP_OK)
+        {
+            return err;
+        }
+    }
+
+    //
+    // FAT
+    //
+    std::vector<BYTE> fat((size_t) fatsz * ss, 0);
+    set_fat(fat, 0, eoc & ~7);
+    set_fat(fat, 1, eoc);
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+        for (DWORD c = 0; c < nodes[i].count; c++)
+        {
+            DWORD clst = nodes[i].clust + c;
+            set_fat(fat, clst, c + 1 < nodes[i].count ? clst + 1 : eoc);
+        }
+    }
+
+    if ((err = write_sectors(fatbase, fat.data(), fat.size())) != ESP_OK)
+    {
+        return err;
+    }
+    fat.clear();
+
+    //
+    // Fixed root directory for FAT12/16
+    //
+    if (rootsz > 0)
+    {
+        std::vector<BYTE> root((size_t) rootsz * ss, 0);
+        if ((err = write_dir(&nodes[0], root.data(), root.size())) != ESP_OK)
+        {
+            return err;
+        }
+    }
+
+    //
+    // Data area, in cluster order
+    //
+    UINT cs = csize * ss;
+    size_t buflen = MMAP_SPAN_SIZE < cs ? cs : MMAP_SPAN_SIZE / cs * cs;
+    std::vector<BYTE> buf(buflen);
+
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+        node *n = &nodes[i];
+        if (n->count == 0)
+        {
+            if (!n->isdir)
+            {
+                numfiles++;
+            }
+            continue;
+        }
+
+        if (n->isdir)
+        {
+            std::vector<BYTE> dir((size_t) n->count * cs, 0);
+            err = write_dir(n, dir.data(), dir.size());
+        }
+        else
+        {
+            err = write_file(n, buf.data(), buf.size());
+        }
+
+        if (err != ESP_OK)
+        {
+            return err;
+        }
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t FatFSDirect::write_dir(node *n, BYTE *buf, size_t len)
+{
+    BYTE *p = buf;
+
+    if (n->parent >= 0)
+    {
+        static const BYTE dot[11] = { '.', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ' };
+        static const BYTE dotdot[11] = { '.', '.', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ' };
+
+        // ".." of a top level directory points at cluster 0, even on FAT32
+        dir_entry(p, dot, AM_DIR, 0, n->clust, 0);
+        dir_entry(p + 32, dotdot, AM_DIR, 0, n->parent > 0 ? nodes[n->parent].clust : 0, 0);
+        p += 64;
+        numdirs++;
+    }
+
+    for (size_t c = 0; c < n->children.size(); c++)
+    {
+        node *child = &nodes[n->children[c]];
+
+        if (!child->lfn.empty())
+        {
+            BYTE sum = 0;
+            for (int i = 0; i < 11; i++)
+            {
+                sum = ((sum & 1) << 7) + (sum >> 1) + child->sfn[i];
+            }
+
+            // Long name pieces are stored last first, 13 characters each,
+            // with a terminator and 0xffff padding after the name
+            static const int offsets[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+            int count = (child->lfn.size() + 12) / 13;
+            for (int ord = count; ord > 0; ord--)
+            {
+                memset(p, 0, 32);
+                p[0] = ord | (ord == count ? 0x40 : 0);
+                p[11] = 0x0f;
+                p[13] = sum;
+
+                for (int i = 0; i < 13; i++)
+                {
+                    size_t ndx = (ord - 1) * 13 + i;
+                    WCHAR wc = ndx < child->lfn.size() ? child->lfn[ndx] : ndx == child->lfn.size() ? 0 : 0xffff;
+                    p[offsets[i]] = wc;
+                    p[offsets[i] + 1] = wc >> 8;
+                }
+                p += 32;
+            }
+        }
+
+        dir_entry(p,
+                  child->sfn,
+                  child->isdir ? AM_DIR : AM_ARC,
+                  child->ntres,
+                  child->clust,
+                  child->isdir ? 0 : child->size);
+        p += 32;
+    }
+
+    // The FAT12/16 root directory lives before the data area
+    DWORD sect = (n->parent < 0 && type != FS_FAT32) ? dirbase : database + (n->clust - 2) * csize;
+
+    return write_sectors(sect, buf, len);
+}
+
+esp_err_t FatFSDirect::write_file(node *n, BYTE *buf, size_t len)
+{
+    ESP_LOGD(TAG, "Writing '%s' at cluster %d", n->src.c_str(), n->clust);
+
+    int fd = open(n->src.c_str(), O_RDONLY);
+    if (fd == -1)
+    {
+        ESP_LOGE(TAG, "Unable to open source '%s'", n->src.c_str());
+        return ESP_FAIL;
+    }
+
+    DWORD sect = database + (n->clust - 2) * csize;
+    uint64_t left = n->size;
+
+    while (left > 0)
+    {
+        size_t want = left < len ? left : len;
+        size_t got = 0;
+
+        while (got < want)
+        {
+            ssize_t cnt = ::read(fd, &buf[got], want - got);
+            if (cnt == -1 && errno == EINTR)
+            {
+                continue;
+            }
+
+            if (cnt <= 0)
+            {
+                break;
+            }
+
+            got += cnt;
+        }
+
+        if (got < want)
+        {
+            ESP_LOGE(TAG, "'%s' changed size while building", n->src.c_str());
+            close(fd);
+            return ESP_FAIL;
+        }
+
+        // Whole sectors only, the rest of the cluster stays erased
+        size_t bytes = (want + ss - 1) / ss * ss;
+        memset(&buf[want], 0, bytes - want);
+
+        if (write_sectors(sect, buf, bytes) != ESP_OK)
+        {
+            close(fd);
+            return ESP_FAIL;
+        }
+
+        sect += bytes / ss;
+        left -= want;
+    }
+
+    close(fd);
+    numfiles++;
+    numbytes += n->size;
+
+    return ESP_OK;
+}
+
+// ============================================================================
+// Batch mode
+//
+// "--batch" builds every image listed in a file, one per line:
+//
+//   <image> <KB> <paths>... [options]
+//
+// "#" starts a comment and words can be quoted with double quotes.  Options
+// given on the command line apply to every image, ahead of the line's own.
+// Each image is built by a forked worker, so every build has its own
+// volume, wear levelling and image state, with "--batch-jobs" of them at
+// a time.  A worker's output goes to "<image>.log".
+// ============================================================================
+
+esp_err_t FatFSImage::run_batch(int argc, char *argv[])
+{
+    // Everything but the batch options is passed on to the workers
+    std::vector<std::string> common;
+    common.push_back(argv[0]);
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--batch") == 0 || strcmp(argv[i], "--batch-jobs") == 0)
+        {
+            i++;
+        }
+        else if (strncmp(argv[i], "--batch=", 8) != 0 && strncmp(argv[i], "--batch-jobs=", 13) != 0)
+        {
+            common.push_back(argv[i]);
+        }
+    }
+
+    std::vector<batch_image> images;
+    if (read_batch(common, images) != ESP_OK || share_sources(images) != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+
+    int workers = args.batch_jobs->count > 0 ? args.batch_jobs->ival[0] : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers < 1)
+    {
+        workers = 1;
+    }
+
+    printf("Building %d images with %d workers\n\n", (int) images.size(), workers);
+
+    uint64_t start = stat_now();
+    size_t next = 0;
+    int running = 0;
+    int failed = 0;
+
+    while (next < images.size() || running > 0)
+    {
+        while (running < workers && next < images.size())
+        {
+            batch_image *bi = &images[next++];
+
+            bi->start = stat_now();
+            bi->pid = start_batch_image(bi, common);
+            if (bi->pid == -1)
+            {
+                ESP_LOGE(TAG, "Unable to start a worker for '%s' (%d)", bi->image.c_str(), errno);
+                failed++;
+                continue;
+            }
+
+            running++;
+        }
+
+        if (running == 0)
+        {
+            continue;
+        }
+
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            ESP_LOGE(TAG, "Waiting for workers failed with %d", errno);
+            return ESP_FAIL;
+        }
+
+        for (size_t i = 0; i < next; i++)
+        {
+            batch_image *bi = &images[i];
+            if (bi->pid != pid)
+            {
+                continue;
+            }
+
+            bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+            printf("  %s: %s in %.1f seconds\n",
+                   bi->image.c_str(),
+                   ok ? "built" : "FAILED, see the log",
+                   (stat_now() - bi->start) / 1e9);
+
+            bi->pid = 0;
+            failed += ok ? 0 : 1;
+            running--;
+            break;
+        }
+    }
+
+    printf("\nBuilt %d of %d images in %.1f seconds\n",
+           (int) images.size() - failed,
+           (int) images.size(),
+           (stat_now() - start) / 1e9);
+
+    for (auto &it : shared_sources)
+    {
+        munmap((void *) it.second.data, it.second.len);
+    }
+    shared_sources.clear();
+
+    return failed == 0 ? ESP_OK : ESP_FAIL;
+}
+
+// Splits a line of a batch or workload file into words.  Double quotes
+// group words containing spaces and '#' starts a comment.
+static void split_words(const char *line, std::vector<std::string> &words)
+{
+    bool quoted = false;
+    bool inword = false;
+    std::string word;
+    for (const char *p = line; ; p++)
+    {
+        char c = *p;
+        if (c == '"')
+        {
+            quoted = !quoted;
+            inword = true;
+            continue;
+        }
+
+        if (c == '\0' || (!quoted && (isspace((unsigned char) c) || c == '#')))
+        {
+            if (inword)
+            {
+                words.push_back(word);
+                word.clear();
+                inword = false;
+            }
+
+            if (c == '\0' || c == '#')
+            {
+                break;
+            }
+            continue;
+        }
+
+        word += c;
+        inword = true;
+    }
+}
+
+// Lists the files, besides the image, that the options write or that only
+// make sense for one image, with the option naming each
+void FatFSImage::output_files(std::vector<std::pair<const char *, std::string>> &outputs)
+{
+    // Timings for stdout end up in each worker's log
+    if (args.timings->count > 0 && strcmp(args.timings->filename[0], "-") != 0)
+    {
+        outputs.push_back(std::make_pair("--timings", args.timings->filename[0]));
+    }
+
+    if (args.trace->count > 0)
+    {
+        outputs.push_back(std::make_pair("--trace", args.trace->filename[0]));
+    }
+
+    if (args.verify->count > 0 && args.verify->filename[0][0] != '\0')
+    {
+        outputs.push_back(std::make_pair("--verify", args.verify->filename[0]));
+    }
+
+    if (args.compress->count > 0)
+    {
+        outputs.push_back(std::make_pair("--compress", args.compress->filename[0]));
+    }
+
+    if (args.sparse->count > 0)
+    {
+        outputs.push_back(std::make_pair("--sparse", args.sparse->filename[0]));
+    }
+}
+
+// Reads the batch file and checks each image's arguments
+esp_err_t FatFSImage::read_batch(const std::vector<std::string> &common, std::vector<batch_image> &images)
+{
+    const char *path = args.batch->filename[0];
+
+    // Every worker would write the same file, or compare against the same
+    // baseline, so these belong on the image's own line
+    std::vector<std::pair<const char *, std::string>> outputs;
+    output_files(outputs);
+    if (args.delta->count > 0)
+    {
+        outputs.push_back(std::make_pair("--delta", args.delta->filename[0]));
+    }
+
+    if (!outputs.empty())
+    {
+        for (auto &it : outputs)
+        {
+            printf("%s can't be given for every image in a batch, give it on each image's line\n", it.first);
+        }
+        return ESP_FAIL;
+    }
+
+    // Line that writes each file, so two images can't write the same one
+    std::map<std::string, int> written;
+
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        ESP_LOGE(TAG, "Unable to open batch file '%s'", path);
+        return ESP_FAIL;
+    }
+
+    esp_err_t err = ESP_OK;
+    char line[4096];
+    int lineno = 0;
+
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        lineno++;
+
+        // Don't let the rest of an over-long line become an image of its own
+        size_t len = strlen(line);
+        if (len > 0 && line[len - 1] != '\n' && !feof(f))
+        {
+            printf("%s:%d: line too long\n", path, lineno);
+            err = ESP_FAIL;
+
+            int c;
+            while ((c = fgetc(f)) != EOF && c != '\n')
+            {
+            }
+            continue;
+        }
+
+        batch_image bi;
+        bi.line = lineno;
+        bi.pid = 0;
+        bi.start = 0;
+
+        split_words(line, bi.words);
+
+        if (bi.words.empty())
+        {
+            continue;
+        }
+
+        // Parse the worker's arguments here too, to catch mistakes before
+        // anything is built and to find the image and its sources
+        std::vector<std::string> words(common);
+        words.insert(words.end(), bi.words.begin(), bi.words.end());
+
+        std::vector<char *> argv;
+        for (size_t i = 0; i < words.size(); i++)
+        {
+            argv.push_back((char *) words[i].c_str());
+        }
+        argv.push_back(NULL);
+
+        FatFSImage *check = new FatFSImage();
+        if (arg_parse(argv.size() - 1, argv.data(), check->argtable) > 0)
+        {
+            printf("%s:%d: ", path, lineno);
+            arg_print_errors(stdout, check->args.end, argv[0]);
+            err = ESP_FAIL;
+        }
+        else if (check->args.batch->count > 0)
+        {
+            printf("%s:%d: --batch can't be nested\n", path, lineno);
+            err = ESP_FAIL;
+        }
+        else if (check->args.image->count == 0 || check->args.paths->count == 0 ||
+                 (check->args.kb->count == 0 && check->args.auto_size->count == 0))
+        {
+            printf("%s:%d: <image>, <KB> and <paths> are required\n", path, lineno);
+            err = ESP_FAIL;
+        }
+        else
+        {
+            bi.image = check->args.image->filename[0];
+            for (int i = 0; i < check->args.paths->count; i++)
+            {
+                bi.paths.push_back(check->args.paths->filename[i]);
+            }
+
+            outputs.clear();
+            outputs.push_back(std::make_pair("<image>", bi.image));
+            check->output_files(outputs);
+
+            bool clash = false;
+            for (auto &it : outputs)
+            {
+                auto w = written.find(it.second);
+                if (w != written.end())
+                {
+                    printf("%s:%d: %s '%s' is already written by line %d\n",
+                           path, lineno, it.first, it.second.c_str(), w->second);
+                    clash = true;
+                    continue;
+                }
+                written[it.second] = lineno;
+            }
+
+            if (clash)
+            {
+                err = ESP_FAIL;
+            }
+            else
+            {
+                images.push_back(bi);
+            }
+        }
+        delete check;
+    }
+
+    fclose(f);
+
+    if (err == ESP_OK && images.empty())
+    {
+        printf("No images listed in %s\n", path);
+        err = ESP_FAIL;
+    }
+
+    return err;
+}
+
+typedef struct
+{
+    std::string path;
+    size_t len;
+    int64_t mtime;
+    int last;                       // last image using it
+    int images;                     // number of images using it
+} source_use;
+
+static void count_sources(const std::string &path, int image, std::map<std::pair<dev_t, ino_t>, source_use> &uses)
+{
+    struct stat s;
+    if (stat(path.c_str(), &s) == -1)
+    {
+        return;
+    }
+
+    if (S_ISREG(s.st_mode))
+    {
+        source_use &u = uses[std::make_pair(s.st_dev, s.st_ino)];
+        if (u.images == 0)
+        {
+            u.path = path;
+            u.len = s.st_size;
+            u.mtime = (int64_t) s.st_mtim.tv_sec * 1000000000 + s.st_mtim.tv_nsec;
+            u.last = -1;
+        }
+
+        if (u.last != image)
+        {
+            u.last = image;
+            u.images++;
+        }
+
+        return;
+    }
+
+    if (!S_ISDIR(s.st_mode))
+    {
+        return;
+    }
+
+    DIR *dirp = opendir(path.c_str());
+    if (dirp == NULL)
+    {
+        return;
+    }
+
+    struct dirent *dp;
+    while ((dp = readdir(dirp)) != NULL)
+    {
+        if (strcmp(dp->d_name, ".") != 0 && strcmp(dp->d_name, "..") != 0)
+        {
+            count_sources(path + "/" + dp->d_name, image, uses);
+        }
+    }
+
+    closedir(dirp);
+}
+
+// Maps the source files used by more than one image into the shared cache.
+// The mappings are inherited by the workers, so each file is read from the
+// source once and its pages are shared by all of them.
+esp_err_t FatFSImage::share_sources(std::vector<batch_image> &images)
+{
+    std::map<std::pair<dev_t, ino_t>, source_use> uses;
+
+    for (size_t i = 0; i < images.size(); i++)
+    {
+        for (size_t p = 0; p < images[i].paths.size(); p++)
+        {
+            count_sources(images[i].paths[p], i, uses);
+        }
+    }
+
+    uint64_t bytes = 0;
+    for (auto &it : uses)
+    {
+        source_use &u = it.second;
+        if (u.images < 2 || u.len == 0)
+        {
+            continue;
+        }
+
+        int fd = open(u.path.c_str(), O_RDONLY);
+        if (fd == -1)
+        {
+            continue;
+        }
+
+        int flags = MAP_PRIVATE;
+#if defined(MAP_POPULATE)
+        flags |= MAP_POPULATE;
+#endif
+        void *p = mmap(NULL, u.len, PROT_READ, flags, fd, 0);
+        close(fd);
+
+        if (p == MAP_FAILED)
+        {
+            continue;
+        }
+
+        shared_source &ss = shared_sources[it.first];
+        ss.data = (const char *) p;
+        ss.len = u.len;
+        ss.mtime = u.mtime;
+        bytes += u.len;
+    }
+
+    if (!shared_sources.empty())
+    {
+        printf("Sharing %d source files (%llu bytes) between images\n",
+               (int) shared_sources.size(),
+               (unsigned long long) bytes);
+    }
+
+    return ESP_OK;
+}
+
+// Forks a worker to build one image, returning its pid or -1
+pid_t FatFSImage::start_batch_image(batch_image *bi, const std::vector<std::string> &common)
+{
+    // Don't let the worker inherit (and print again) anything buffered
+    fflush(NULL);
+
+    pid_t pid = fork();
+    if (pid != 0)
+    {
+        return pid;
+    }
+
+    std::string log = bi->image + ".log";
+    int fd = open(log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1 || dup2(fd, STDOUT_FILENO) == -1 || dup2(fd, STDERR_FILENO) == -1)
+    {
+        _exit(1);
+    }
+    close(fd);
+
+    std::vector<std::string> words(common);
+    words.insert(words.end(), bi->words.begin(), bi->words.end());
+
+    std::vector<char *> argv;
+    for (size_t i = 0; i < words.size(); i++)
+    {
+        argv.push_back((char *) words[i].c_str());
+    }
+    argv.push_back(NULL);
+
+    FatFSImage *ffsi = new FatFSImage();
+    esp_err_t err = ffsi->main(argv.size() - 1, argv.data());
+    delete ffsi;
+
+    fflush(NULL);
+    _exit(err == ESP_OK ? 0 : 1);
+}
+
+// ============================================================================
+// Library builder
+//
+// The FatFSBuilder API from fatfsimage.h.  It drives the same phases as the
+// command line, with the image held in memory and the files coming from
+// the caller rather than from host paths.
+// ============================================================================
+
+static bool build_active = false;
+
+// Makes "path" absolute and drops any trailing "/", so the root is ""
+static std::string image_path(const char *path)
+{
+    std::string p = path[0] == '/' ? path : std::string("/") + path;
+
+    while (!p.empty() && p.back() == '/')
+    {
+        p.pop_back();
+    }
+
+    return p;
+}
+
+esp_err_t FatFSImage::build_begin(const fatfs_params *params)
+{
+    if (build_active)
+    {
+        ESP_LOGE(TAG, "Another image is already being built");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (params->size == 0 || params->size % SPI_FLASH_SEC_SIZE != 0)
+    {
+        ESP_LOGE(TAG, "Image size must be a multiple of %d", SPI_FLASH_SEC_SIZE);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    if (params->sector_size != 0 && params->sector_size != 512 && params->sector_size != SPI_FLASH_SEC_SIZE)
+    {
+        ESP_LOGE(TAG, "Sector size must be 512 or %d", SPI_FLASH_SEC_SIZE);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    image_bytes = params->size;
+    sector_count = image_bytes / sector_bytes;
+    fat_sector_bytes = params->sector_size ? params->sector_size : SPI_FLASH_SEC_SIZE;
+    cluster_bytes = params->cluster_size;
+    contiguous = params->contiguous;
+    raw_fat = params->raw;
+
+    if (raw_fat && fat_sector_bytes != SPI_FLASH_SEC_SIZE)
+    {
+        ESP_LOGE(TAG, "Raw images need %d byte sectors", SPI_FLASH_SEC_SIZE);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // Files are copied in turn and nothing but the caller sees the image
+    jobs = 0;
+    raw_image = false;
+
+    if (create_image() != ESP_OK ||
+        init_wear_levelling() != ESP_OK ||
+        create_filesystem() != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+
+    build_active = true;
+
+    return ESP_OK;
+}
+
+// Creates each directory along "path", leaving out the last name unless
+// "last" is set
+esp_err_t FatFSImage::make_dirs(const std::string &path, bool last)
+{
+    for (size_t pos = 1; pos <= path.size(); pos++)
+    {
+        if (pos < path.size() && path[pos] != '/')
+        {
+            continue;
+        }
+
+        if (pos == path.size() && !last)
+        {
+            break;
+        }
+
+        std::string dir = path.substr(0, pos);
+        if (target_dir(dir.c_str(), dir.c_str()) != ESP_OK)
+        {
+            return ESP_FAIL;
+        }
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t FatFSImage::build_dir(const char *path)
+{
+    if (!build_active)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    return make_dirs(image_path(path), true);
+}
+
+esp_err_t FatFSImage::build_file(const char *path, const void *data, size_t len, fatfs_source source, void *ctx)
+{
+    if (!build_active)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    std::string dst = image_path(path);
+    if (dst.empty() || make_dirs(dst, false) != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+
+    FIL dstf;
+    FRESULT res = open_target(&dstf, dst.c_str(), len);
+    if (res != FR_OK)
+    {
+        ESP_LOGE(TAG, "Unable to open target '%s' (%d)", dst.c_str(), res);
+        return ESP_FAIL;
+    }
+
+    esp_err_t err = ESP_OK;
+
+    if (data != NULL)
+    {
+        write_span(&dstf, (const char *) data, len);
+    }
+    else
+    {
+        std::vector<char> buf(MMAP_SPAN_SIZE);
+        size_t offset = 0;
+
+        while (f_error(&dstf) == FR_OK)
+        {
+            ssize_t cnt = source(ctx, offset, buf.data(), buf.size());
+            if (cnt < 0)
+            {
+                ESP_LOGE(TAG, "Source failed for '%s'", dst.c_str());
+                err = ESP_FAIL;
+                break;
+            }
+
+            if (cnt == 0)
+            {
+                break;
+            }
+
+            write_span(&dstf, buf.data(), cnt);
+            offset += cnt;
+        }
+    }
+
+    return close_target(&dstf, dst.c_str(), err != ESP_OK, NULL);
+}
+
+esp_err_t FatFSImage::build_path(const char *src, const char *dst)
+{
+    if (!build_active)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    std::string dir = image_path(dst);
+    if (make_dirs(dir, true) != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+
+    return copy(src, dir.c_str()) == 0 ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t FatFSImage::build_finish(fatfs_sink sink, void *ctx)
+{
+    if (!build_active)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    build_active = false;
+
+    f_unmount(drv);
+    delete fs;
+    fs = NULL;
+
+    if (flush_image() != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+
+    std::vector<uint8_t> buf(COMPRESS_CHUNK_SIZE);
+
+    for (size_t addr = 0; addr < image_bytes; )
+    {
+        size_t len = image_bytes - addr < buf.size() ? image_bytes - addr : buf.size();
+        if (read(addr, buf.data(), len) != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Unable to read image at 0x%08x", (uint32_t) addr);
+            return ESP_FAIL;
+        }
+
+        if (!sink(ctx, addr, buf.data(), len))
+        {
+            return ESP_FAIL;
+        }
+
+        addr += len;
+    }
+
+    return ESP_OK;
+}
+
+FatFSBuilder::FatFSBuilder()
+{
+    image = new FatFSImage();
+}
+
+FatFSBuilder::~FatFSBuilder()
+{
+    // Drop an image that was never finished
+    if (image->fs != NULL && build_active)
+    {
+        build_active = false;
+        f_unmount(drv);
+        delete image->fs;
+        image->fs = NULL;
+    }
+
+    delete image;
+}
+
+esp_err_t FatFSBuilder::begin(const fatfs_params *params)
+{
+    return image->build_begin(params);
+}
+
+esp_err_t FatFSBuilder::add_dir(const char *path)
+{
+    return image->build_dir(path);
+}
+
+esp_err_t FatFSBuilder::add_file(const char *path, const void *data, size_t len)
+{
+    if (data == NULL && len != 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    return image->build_file(path, data != NULL ? data : "", len, NULL, NULL);
+}
+
+esp_err_t FatFSBuilder::add_file(const char *path, size_t len, fatfs_source source, void *ctx)
+{
+    return image->build_file(path, NULL, len, source, ctx);
+}
+
+esp_err_t FatFSBuilder::add_path(const char *src, const char *dst)
+{
+    return image->build_path(src, dst);
+}
+
+static bool copy_sink(void *ctx, size_t offset, const void *data, size_t len)
+{
+    memcpy((uint8_t *) ctx + offset, data, len);
+
+    return true;
+}
+
+esp_err_t FatFSBuilder::finish(void *dest, size_t len)
+{
+    if (len < image_size())
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    return image->build_finish(copy_sink, dest);
+}
+
+esp_err_t FatFSBuilder::finish(fatfs_sink sink, void *ctx)
+{
+    return image->build_finish(sink, ctx);
+}
+
+size_t FatFSBuilder::image_size()
+{
+    return image->image_bytes;
+}
+
+int fatfsimage_main(int argc, char *argv[])
+{
+    FatFSImage ffsi;
+
+    return ffsi.main(argc, argv) == ESP_OK ? 0 : -1;
+}
+
+// ============================================================================
+// List and extract
+//
+// "--list" and "--extract" mount an existing image, such as a partition
+// dumped from a device, through the same wear levelling and disk_read()
+// stack used to build images and walk it.  Extraction reads file data on
+// this thread and leaves the host writes to "--jobs" writer threads, so
+// the two overlap.
+// ============================================================================
+
+esp_err_t FatFSImage::inspect_image()
+{
+    if (open_existing() != ESP_OK || init_wear_levelling() != ESP_OK || mount_existing() != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+
+    esp_err_t err = ESP_OK;
+    const char *dir = args.extract->count > 0 ? args.extract->filename[0] : NULL;
+
+    if (dir != NULL)
+    {
+        if (mkdir(dir, 0777) != 0 && errno != EEXIST)
+        {
+            ESP_LOGE(TAG, "Unable to create '%s' (%d)", dir, errno);
+            err = ESP_FAIL;
+        }
+        else
+        {
+            int writers = jobs > 0 ? jobs : 1;
+            std::vector<pthread_t> threads;
+            std::vector<extract_chunk> chunks(PREFETCH_CHUNKS);
+            char *bufs = (char *) malloc((size_t) PREFETCH_CHUNKS * MMAP_SPAN_SIZE);
+            if (bufs == NULL)
+            {
+                ESP_LOGE(TAG, "Unable to allocate memory");
+                err = ESP_FAIL;
+            }
+
+            for (int i = 0; i < PREFETCH_CHUNKS && bufs != NULL; i++)
+            {
+                chunks[i].buf = bufs + (size_t) i * MMAP_SPAN_SIZE;
+                chunks[i].next = extract_free;
+                extract_free = &chunks[i];
+            }
+
+            for (int i = 0; i < writers && err == ESP_OK; i++)
+            {
+                pthread_t t;
+                if (pthread_create(&t, NULL, extract_thread, this) != 0)
+                {
+                    ESP_LOGE(TAG, "Unable to start writer thread");
+                    err = ESP_FAIL;
+                    break;
+                }
+                threads.push_back(t);
+            }
+
+            if (err == ESP_OK)
+            {
+                err = walk_image("", dir);
+            }
+
+            pthread_mutex_lock(&lock);
+            extract_done = true;
+            pthread_cond_broadcast(&chunk_queued);
+            pthread_mutex_unlock(&lock);
+
+            for (size_t i = 0; i < threads.size(); i++)
+            {
+                pthread_join(threads[i], NULL);
+            }
+
+            free(bufs);
+
+            for (size_t i = 0; i < extract_files.size(); i++)
+            {
+                extract_file *xf = extract_files[i];
+                if (xf->error != 0)
+                {
+                    ESP_LOGE(TAG, "Unable to write '%s' (%d)", xf->path.c_str(), xf->error);
+                    err = ESP_FAIL;
+                }
+                delete xf;
+            }
+
+            // Directories last, since creating their contents touched them
+            for (size_t i = extract_dirs.size(); i-- > 0; )
+            {
+                struct timespec times[2] = { extract_dirs[i].second, extract_dirs[i].second };
+                utimensat(AT_FDCWD, extract_dirs[i].first.c_str(), times, 0);
+            }
+
+            printf("Extracted %d directories and %d files (%llu bytes) to %s\n",
+                   (int) extract_dirs.size(),
+                   (int) extract_files.size(),
+                   (unsigned long long) extract_bytes,
+                   dir);
+
+            extract_files.clear();
+        }
+    }
+    else
+    {
+        err = walk_image("", "");
+
+        printf("\n%d directories, %d files, %llu bytes\n", numdirs, numfiles, (unsigned long long) copied_bytes);
+    }
+
+    f_unmount(drv);
+    delete fs;
+    fs = NULL;
+
+    return err;
+}
+
+// Loads the image file into memory, taking its size from the file
+esp_err_t FatFSImage::open_existing()
+{
+    const char *path = args.image->filename[0];
+
+    image = fopen(path, "rb");
+    if (image == NULL)
+    {
+        ESP_LOGE(TAG, "Open failed with %d for '%s'", errno, path);
+        return ESP_FAIL;
+    }
+
+    struct stat s;
+    if (fstat(fileno(image), &s) != 0 || s.st_size == 0 || s.st_size > UINT32_MAX)
+    {
+        ESP_LOGE(TAG, "'%s' isn't a usable image", path);
+        return ESP_FAIL;
+    }
+
+    if (image_bytes != 0 && image_bytes != s.st_size)
+    {
+        ESP_LOGE(TAG, "'%s' is %lld bytes, not %d", path, (long long) s.st_size, image_bytes);
+        return ESP_FAIL;
+    }
+
+    image_bytes = s.st_size;
+    sector_count = image_bytes / sector_bytes;
+    raw_image = false;
+    reuse = true;
+
+    buffer = (uint8_t *) malloc(image_bytes);
+    if (buffer == NULL)
+    {
+        ESP_LOGE(TAG, "Unable to allocate %d bytes for image", image_bytes);
+        return ESP_FAIL;
+    }
+
+    if (fread(buffer, 1, image_bytes, image) != image_bytes)
+    {
+        ESP_LOGE(TAG, "Read failed with %d for '%s'", errno, path);
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+// Mounts the image, trying the other sector size if the filesystem isn't
+// found with the requested (or default) one
+esp_err_t FatFSImage::mount_existing()
+{
+    UINT sizes[2] = { fat_sector_bytes, fat_sector_bytes == 512 ? SPI_FLASH_SEC_SIZE : 512u };
+    FRESULT res = FR_NO_FILESYSTEM;
+
+    fs = new FATFS;
+
+    for (int i = 0; i < 2 && res == FR_NO_FILESYSTEM; i++)
+    {
+        // Only try the other size when it wasn't given
+        if (i > 0 && args.ssize->count > 0)
+        {
+            break;
+        }
+
+        drives[0].sector_size = sizes[i];
+        res = f_mount(fs, drv, 1);
+    }
+
+    if (res != FR_OK)
+    {
+        ESP_LOGE(TAG, "Mounting filesystem failed with %d", res);
+        delete fs;
+        fs = NULL;
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+static struct timespec fat_time(WORD fdate, WORD ftime)
+{
+    struct tm tm = {};
+    tm.tm_year = (fdate >> 9) + 80;
+    tm.tm_mon = ((fdate >> 5) & 0xf) - 1;
+    tm.tm_mday = fdate & 0x1f;
+    tm.tm_hour = ftime >> 11;
+    tm.tm_min = (ftime >> 5) & 0x3f;
+    tm.tm_sec = (ftime & 0x1f) * 2;
+    tm.tm_isdst = -1;
+
+    struct timespec ts = { mktime(&tm), 0 };
+
+    return ts;
+}
+
+// Tells whether the directory just opened as "dir" hasn't been walked yet
+// and marks it walked.  A damaged image can have a directory entry pointing
+// back at one of its parents (or any directory seen before), which would
+// otherwise be walked forever.  Walks start at the root, whose start
+// cluster reads as 0.
+bool FatFSImage::first_visit(const FF_DIR *dir, const std::string &path)
+{
+    if (path.empty())
+    {
+        walked_dirs.clear();
+    }
+
+    DWORD start = dir->obj.sclust;
+    if (start == 0 && fs->fs_type == FS_FAT32)
+    {
+        start = fs->dirbase;
+    }
+
+    if (!walked_dirs.insert(start).second)
+    {
+        ESP_LOGE(TAG, "Directory '%s' repeats cluster %lu, skipping it", path.c_str(), (unsigned long) start);
+        return false;
+    }
+
+    return true;
+}
+
+// Lists or extracts the directory "path" of the image, "host" being where
+// it goes when extracting
+esp_err_t FatFSImage::walk_image(const std::string &path, const std::string &host)
+{
+    bool extracting = args.extract->count > 0;
+    esp_err_t err = ESP_OK;
+    FF_DIR dir;
+
+    FRESULT res = f_opendir(&dir, path.empty() ? "/" : path.c_str());
+    if (res != FR_OK)
+    {
+        ESP_LOGE(TAG, "Unable to open directory '%s' (%d)", path.c_str(), res);
+        return ESP_FAIL;
+    }
+
+    if (!first_visit(&dir, path))
+    {
+        f_closedir(&dir);
+        return ESP_FAIL;
+    }
+
+    while (1)
+    {
+        FILINFO fno;
+        res = f_readdir(&dir, &fno);
+        if (res != FR_OK)
+        {
+            ESP_LOGE(TAG, "Unable to read directory '%s' (%d)", path.c_str(), res);
+            err = ESP_FAIL;
+            break;
+        }
+
+        if (fno.fname[0] == '\0')
+        {
+            break;
+        }
+
+        // FatFs only skips the dot entries by their short names, so a
+        // damaged or crafted long name could still climb out of the
+        // extract directory
+        if (strcmp(fno.fname, ".") == 0 || strcmp(fno.fname, "..") == 0 ||
+            strchr(fno.fname, '/') != NULL || strchr(fno.fname, '\\') != NULL)
+        {
+            ESP_LOGE(TAG, "Skipping '%s' in '%s', it isn't a valid name", fno.fname, path.c_str());
+            err = ESP_FAIL;
+            continue;
+        }
+
+        std::string name = path + "/" + fno.fname;
+        std::string target = host + "/" + fno.fname;
+        bool isdir = (fno.fattrib & AM_DIR) != 0;
+
+        if (extracting)
+        {
+            if (isdir)
+            {
+                if (mkdir(target.c_str(), 0777) != 0 && errno != EEXIST)
+                {
+                    ESP_LOGE(TAG, "Unable to create '%s' (%d)", target.c_str(), errno);
+                    err = ESP_FAIL;
+                    continue;
+                }
+
+                extract_dirs.push_back(std::make_pair(target, fat_time(fno.fdate, fno.ftime)));
+            }
+            else
+            {
+                extract_file *xf = new extract_file();
+                xf->path = target;
+                xf->mtime = fat_time(fno.fdate, fno.ftime);
+                xf->fd = open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+                if (xf->fd == -1)
+                {
+                    ESP_LOGE(TAG, "Unable to create '%s' (%d)", target.c_str(), errno);
+                    delete xf;
+                    err = ESP_FAIL;
+                    continue;
+                }
+
+                extract_files.push_back(xf);
+                if (extract_data(name, xf) != ESP_OK)
+                {
+                    err = ESP_FAIL;
+                }
+                extract_bytes += fno.fsize;
+            }
+        }
+        else
+        {
+            // The start cluster isn't in FILINFO, so open the entry for it
+            DWORD sclust = 0;
+            if (isdir)
+            {
+                FF_DIR sub;
+                if (f_opendir(&sub, name.c_str()) == FR_OK)
+                {
+                    sclust = sub.obj.sclust;
+                    f_closedir(&sub);
+                }
+            }
+            else
+            {
+                FIL f;
+                if (f_open(&f, name.c_str(), FA_READ) == FR_OK)
+                {
+                    sclust = f.obj.sclust;
+                    f_close(&f);
+                }
+            }
+
+            std::string chain = cluster_chain(sclust);
+            printf("%c %10lu  %04d-%02d-%02d %02d:%02d:%02d  %s  %s\n",
+                   isdir ? 'd' : 'f',
+                   (unsigned long) fno.fsize,
+                   (fno.fdate >> 9) + 1980,
+                   (fno.fdate >> 5) & 0xf,
+                   fno.fdate & 0x1f,
+                   fno.ftime >> 11,
+                   (fno.ftime >> 5) & 0x3f,
+                   (fno.ftime & 0x1f) * 2,
+                   name.c_str(),
+                   chain.empty() ? "-" : chain.c_str());
+
+            if (isdir)
+            {
+                numdirs++;
+            }
+            else
+            {
+                numfiles++;
+                copied_bytes += fno.fsize;
+            }
+        }
+
+        if (isdir && walk_image(name, target) != ESP_OK)
+        {
+            err = ESP_FAIL;
+        }
+    }
+
+    f_closedir(&dir);
+
+    return err;
+}
+
+// Reads a file from the image and queues its data for the writer threads
+esp_err_t FatFSImage::extract_data(const std::string &path, extract_file *xf)
+{
+    esp_err_t err = ESP_OK;
+    FIL f;
+
+    FRESULT res = f_open(&f, path.c_str(), FA_READ);
+    bool opened = res == FR_OK;
+    if (!opened)
+    {
+        ESP_LOGE(TAG, "Unable to open '%s' (%d)", path.c_str(), res);
+        err = ESP_FAIL;
+    }
+
+    for (off_t offset = 0; err == ESP_OK; )
+    {
+        pthread_mutex_lock(&lock);
+        while (extract_free == NULL)
+        {
+            pthread_cond_wait(&chunk_freed, &lock);
+        }
+
+        extract_chunk *chunk = extract_free;
+        extract_free = chunk->next;
+        pthread_mutex_unlock(&lock);
+
+        UINT br = 0;
+        res = f_read(&f, chunk->buf, MMAP_SPAN_SIZE, &br);
+        if (res != FR_OK || br == 0)
+        {
+            if (res != FR_OK)
+            {
+                ESP_LOGE(TAG, "Read returned %d for '%s'", res, path.c_str());
+                err = ESP_FAIL;
+            }
+
+            pthread_mutex_lock(&lock);
+            chunk->next = extract_free;
+            extract_free = chunk;
+            pthread_mutex_unlock(&lock);
+            break;
+        }
+
+        chunk->file = xf;
+        chunk->offset = offset;
+        chunk->len = br;
+        chunk->next = NULL;
+        offset += br;
+
+        pthread_mutex_lock(&lock);
+        xf->pending++;
+        if (extract_tail)
+        {
+            extract_tail->next = chunk;
+        }
+        else
+        {
+            extract_head = chunk;
+        }
+        extract_tail = chunk;
+        pthread_cond_signal(&chunk_queued);
+        pthread_mutex_unlock(&lock);
+
+        if (br < MMAP_SPAN_SIZE)
+        {
+            break;
+        }
+    }
+
+    if (opened)
+    {
+        f_close(&f);
+    }
+
+    pthread_mutex_lock(&lock);
+    xf->done = true;
+    if (xf->pending == 0)
+    {
+        close_extracted(xf);
+    }
+    pthread_mutex_unlock(&lock);
+
+    return err;
+}
+
+void *FatFSImage::extract_thread(void *arg)
+{
+    ((FatFSImage *) arg)->extract_writer();
+
+    return NULL;
+}
+
+void FatFSImage::extract_writer()
+{
+    pthread_mutex_lock(&lock);
+
+    while (1)
+    {
+        while (extract_head == NULL && !extract_done)
+        {
+            pthread_cond_wait(&chunk_queued, &lock);
+        }
+
+        if (extract_head == NULL)
+        {
+            break;
+        }
+
+        extract_chunk *chunk = extract_head;
+        extract_head = chunk->next;
+        if (extract_head == NULL)
+        {
+            extract_tail = NULL;
+        }
+        pthread_mutex_unlock(&lock);
+
+        extract_file *xf = chunk->file;
+        int error = 0;
+
+        for (size_t done = 0; done < chunk->len; )
+        {
+            ssize_t cnt = pwrite(xf->fd, chunk->buf + done, chunk->len - done, chunk->offset + done);
+            if (cnt == -1 && errno == EINTR)
+            {
+                continue;
+            }
+
+            if (cnt <= 0)
+            {
+                error = cnt == 0 ? EIO : errno;
+                break;
+            }
+
+            done += cnt;
+        }
+
+        pthread_mutex_lock(&lock);
+        if (error != 0 && xf->error == 0)
+        {
+            xf->error = error;
+        }
+
+        chunk->next = extract_free;
+        extract_free = chunk;
+        pthread_cond_broadcast(&chunk_freed);
+
+        if (--xf->pending == 0 && xf->done)
+        {
+            close_extracted(xf);
+        }
+    }
+
+    pthread_mutex_unlock(&lock);
+}
+
+// Called with the lock held once all of a file's data has been written
+void FatFSImage::close_extracted(extract_file *xf)
+{
+    struct timespec times[2] = { xf->mtime, xf->mtime };
+
+    if (futimens(xf->fd, times) != 0 && xf->error == 0)
+    {
+        xf->error = errno;
+    }
+
+    if (close(xf->fd) != 0 && xf->error == 0)
+    {
+        xf->error = errno;
+    }
+
+    xf->fd = -1;
+}
+
+// ============================================================================
+// Wear levelling simulation
+//
+// "--simulate" replays a scripted device workload against an existing
+// image to show how the wear levelling parameters hold up under it.  The
+// image's volume is loaded into a fresh wear levelling layer for every
+// combination of parameters tried, over a SimFlash that counts the erases
+// of each physical sector, and the workload is then run through FatFs on
+// the scratch drive.  The workload is one command per line:
+//
+//   write <path> <bytes>        create or rewrite a file
+//   append <path> <bytes>       add to the end of a file
+//   delete <path>
+//   rename <path> <new path>    replacing any existing file
+//   mkdir <path>
+//   repeat <n> ... end          run the enclosed commands n times
+//   period <seconds>            device time one pass of the workload takes
+//   endurance <cycles>          erases a sector survives
+//
+// Write amplification is the bytes erased on the flash for each byte the
+// workload wrote, and the lifetime is how many passes it takes for the
+// most worn sector to reach its endurance.
+// ============================================================================
+
+esp_err_t FatFSImage::simulate_wear()
+{
+    if (read_workload(args.simulate->filename[0]) != ESP_OK ||
+        open_existing() != ESP_OK ||
+        init_wear_levelling() != ESP_OK ||
+        mount_existing() != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+
+    // Only the volume carries over, the wear levelling state is rebuilt
+    // for each set of parameters
+    f_unmount(drv);
+    delete fs;
+    fs = NULL;
+
+    size_t len = flash.chip_size();
+    uint8_t *volume = (uint8_t *) malloc(len);
+    if (volume == NULL)
+    {
+        ESP_LOGE(TAG, "Unable to allocate %d bytes for the volume", (int) len);
+        return ESP_FAIL;
+    }
+
+    if (flash.read(0, volume, len) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Unable to read the volume");
+        free(volume);
+        return ESP_FAIL;
+    }
+
+    static const uint32_t update_rates[] = { 4, 8, 16, 32, 64, 128 };
+    static const uint32_t write_sizes[] = { 16, 32 };
+    static const uint32_t temp_buffs[] = { 32, 128, 512 };
+    std::vector<sim_result> results;
+    esp_err_t err = ESP_OK;
+
+    drives[1].sector_size = drives[0].sector_size;
+
+    for (size_t u = 0; u < sizeof(update_rates) / sizeof(update_rates[0]) && err == ESP_OK; u++)
+    {
+        for (size_t w = 0; w < sizeof(write_sizes) / sizeof(write_sizes[0]) && err == ESP_OK; w++)
+        {
+            for (size_t t = 0; t < sizeof(temp_buffs) / sizeof(temp_buffs[0]) && err == ESP_OK; t++)
+            {
+                sim_result r = {};
+                r.updaterate = update_rates[u];
+                r.wr_size = write_sizes[w];
+                r.temp_buff = temp_buffs[t];
+
+                err = simulate_config(&r, volume, len);
+                results.push_back(r);
+            }
+        }
+    }
+
+    free(volume);
+
+    if (err != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+
+    // The levelled wear decides the lifetime, then the total wear and then
+    // the flash calls, which is what the copy buffer size changes
+    int best = -1;
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        sim_result *r = &results[i];
+        if (!r->fits)
+        {
+            continue;
+        }
+
+        if (best < 0 ||
+            r->wear < results[best].wear ||
+            (r->wear == results[best].wear &&
+             (r->erases < results[best].erases ||
+              (r->erases == results[best].erases && r->calls < results[best].calls))))
+        {
+            best = i;
+        }
+    }
+
+    printf("Wear levelling simulation of %s (%llu bytes written per pass)\n\n",
+           args.simulate->filename[0],
+           (unsigned long long) sim_written);
+    printf("    update  write  buffer    erases  wear/sector  peak/sector  amplification  flash calls     lifetime\n");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        sim_result *r = &results[i];
+        bool current = r->updaterate == wl_updaterate && r->wr_size == wl_write_size &&
+                       r->temp_buff == WL_DEFAULT_TEMP_BUFF_SIZE;
+
+        char lifetime[32] = "-";
+        if (r->fits && r->wear == 0)
+        {
+            snprintf(lifetime, sizeof(lifetime), "unlimited");
+        }
+        else if (r->fits && sim_period > 0)
+        {
+            double years = sim_endurance / r->wear * sim_period / (365.25 * 24 * 60 * 60);
+            snprintf(lifetime, sizeof(lifetime), "%.1f years", years);
+        }
+        else if (r->fits)
+        {
+            snprintf(lifetime, sizeof(lifetime), "%.0f passes", sim_endurance / r->wear);
+        }
 
-    for (int i = 0; i < args.paths->count; ++i)
+        if (!r->fits)
+        {
+            printf("  %c %6u  %5u  %6u  %8s  %11s  %11s  %13s  %11s  %11s\n",
+                   current ? '=' : ' ',
+                   r->updaterate,
+                   r->wr_size,
+                   r->temp_buff,
+                   "-", "-", "-", "-", "-", lifetime);
+            continue;
+        }
+
+        printf("  %c %6u  %5u  %6u  %8llu  %11.2f  %11u  %13.2f  %11llu  %11s\n",
+               (int) i == best ? '*' : current ? '=' : ' ',
+               r->updaterate,
+               r->wr_size,
+               r->temp_buff,
+               (unsigned long long) r->erases,
+               r->wear,
+               r->max_erases,
+               r->amplification,
+               (unsigned long long) r->calls,
+               lifetime);
+    }
+    printf("\n");
+
+    if (best < 0)
+    {
+        ESP_LOGE(TAG, "The volume doesn't fit with any of the parameters");
+        return ESP_FAIL;
+    }
+
+    // The update rate is fixed when the image is built, but the write size
+    // and copy buffer are compiled into the device's wear levelling driver,
+    // and the image can only follow a write size the firmware was changed to
+    printf("  suggested image option:  --wl-update-rate=%u\n", results[best].updaterate);
+    printf("  suggested device driver: wr_size=%u temp_buff_size=%u (wl_config_t in wear_levelling.cpp)\n",
+           results[best].wr_size,
+           results[best].temp_buff);
+    if (results[best].wr_size != WL_DEFAULT_WRITE_SIZE)
     {
-        copy(args.paths->filename[i], "");
+        printf("  then build the image with --wl-write-size=%u --wl-device-matches\n", results[best].wr_size);
     }
+    printf("\n");
 
     return ESP_OK;
 }
 
-int FatFSImage::copy(const char *src, const char *dst)
+// Reads the workload into sim_ops
+esp_err_t FatFSImage::read_workload(const char *path)
 {
-    ESP_LOGD(TAG, "Processing '%s'", src);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        ESP_LOGE(TAG, "Unable to open workload '%s'", path);
+        return ESP_FAIL;
+    }
 
-    int err = 0;
+    esp_err_t err = ESP_OK;
+    std::vector<size_t> repeats;
+    char line[4096];
+    int lineno = 0;
 
-    copy_state *cs = (copy_state *) malloc(sizeof(copy_state));
-    if (cs == NULL)
+    while (fgets(line, sizeof(line), f) != NULL && err == ESP_OK)
     {
-        ESP_LOGE(TAG, "Unable to allocate memory");
-        return -1;
+        lineno++;
+
+        std::vector<std::string> words;
+        split_words(line, words);
+        if (words.empty())
+        {
+            continue;
+        }
+
+        const std::string &cmd = words[0];
+        sim_op op = {};
+        op.line = lineno;
+
+        char *end = NULL;
+        if (cmd == "write" || cmd == "append")
+        {
+            if (words.size() == 3)
+            {
+                op.op = cmd == "write" ? SIM_WRITE : SIM_APPEND;
+                op.path = words[1];
+                op.count = strtoull(words[2].c_str(), &end, 0);
+            }
+        }
+        else if (cmd == "delete" || cmd == "mkdir")
+        {
+            if (words.size() == 2)
+            {
+                op.op = cmd == "delete" ? SIM_DELETE : SIM_MKDIR;
+                op.path = words[1];
+                end = (char *) "";
+            }
+        }
+        else if (cmd == "rename")
+        {
+            if (words.size() == 3)
+            {
+                op.op = SIM_RENAME;
+                op.path = words[1];
+                op.to = words[2];
+                end = (char *) "";
+            }
+        }
+        else if (cmd == "repeat")
+        {
+            if (words.size() == 2)
+            {
+                op.op = SIM_REPEAT;
+                op.count = strtoull(words[1].c_str(), &end, 0);
+                repeats.push_back(sim_ops.size());
+            }
+        }
+        else if (cmd == "end")
+        {
+            if (words.size() == 1 && !repeats.empty())
+            {
+                sim_ops[repeats.back()].end = sim_ops.size();
+                repeats.pop_back();
+                continue;
+            }
+        }
+        else if (cmd == "period" || cmd == "endurance")
+        {
+            if (words.size() == 2)
+            {
+                double value = strtod(words[1].c_str(), &end);
+                if (*end == '\0' && value > 0 && cmd == "period")
+                {
+                    sim_period = value;
+                    continue;
+                }
+                if (*end == '\0' && value >= 1 && value <= UINT32_MAX && cmd == "endurance")
+                {
+                    sim_endurance = value;
+                    continue;
+                }
+            }
+            end = NULL;
+        }
+
+        if (end == NULL || *end != '\0')
+        {
+            printf("%s:%d: unrecognised command\n", path, lineno);
+            err = ESP_FAIL;
+            break;
+        }
+
+        sim_ops.push_back(op);
     }
 
-    int len;
-    for (len = 0; src[len] && len < sizeof(cs->src); len++)
+    fclose(f);
+
+    if (err == ESP_OK && !repeats.empty())
     {
-        cs->src[len] = src[len];
+        printf("%s:%d: repeat without an end\n", path, sim_ops[repeats.back()].line);
+        err = ESP_FAIL;
     }
 
-    if (len == sizeof(cs->src))
+    if (err == ESP_OK && sim_ops.empty())
     {
-        ESP_LOGE(TAG, "Source name '%s' is too long", src);
-        free(cs);
-        return -1;
+        printf("No commands in %s\n", path);
+        err = ESP_FAIL;
     }
-    cs->src[len] = '\0';
-    cs->srclen = len;
 
-    for (len = 0; dst[len] && len < sizeof(cs->dst); len++)
+    return err;
+}
+
+// Runs the workload with one set of parameters.  Parameters that leave too
+// little room for the volume are just marked as not fitting.
+esp_err_t FatFSImage::simulate_config(sim_result *r, const uint8_t *volume, size_t len)
+{
+    SimFlash sim(image_bytes);
+    if (!sim.valid())
     {
-        cs->dst[len] = dst[len];
+        ESP_LOGE(TAG, "Unable to allocate %d bytes for simulation", image_bytes);
+        return ESP_FAIL;
     }
 
-    if (len == sizeof(cs->dst))
+    wl_config_t cfg = wl_config(image_bytes, r->updaterate, r->wr_size, r->temp_buff);
+
+    WL_Flash wl;
+    if (wl.config(&cfg, &sim) != ESP_OK || wl.init() != ESP_OK || wl.chip_size() < len)
     {
-        ESP_LOGE(TAG, "Target name '%s' is too long", dst);
-        free(cs);
-        return -1;
+        ESP_LOGD(TAG, "Parameters %u/%u/%u leave no room for the volume", r->updaterate, r->wr_size, r->temp_buff);
+        return ESP_OK;
     }
-    cs->dst[len] = '\0';
-    cs->dstlen = len;
 
-    cs->srcbase = src;
-    cs->dstbase = dst;
+    // Sectors never written read back erased and can stay that way
+    for (size_t ofs = 0; ofs < len; ofs += SPI_FLASH_SEC_SIZE)
+    {
+        const uint8_t *p = volume + ofs;
+        if (p[0] == 0xff && memcmp(p, p + 1, SPI_FLASH_SEC_SIZE - 1) == 0)
+        {
+            continue;
+        }
 
-    err = copy_sub(cs);
+        if (wl.erase_range(ofs, SPI_FLASH_SEC_SIZE) != ESP_OK || wl.write(ofs, p, SPI_FLASH_SEC_SIZE) != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Unable to load the volume");
+            return ESP_FAIL;
+        }
+    }
 
-    free(cs);
+    sim.reset();
+    sim_written = 0;
+
+    drives[1].flash = &wl;
+
+    FATFS sfs;
+    FRESULT res = f_mount(&sfs, plan_drv, 1);
+    esp_err_t err = res == FR_OK ? run_workload(0, sim_ops.size()) : ESP_FAIL;
+    if (res != FR_OK)
+    {
+        ESP_LOGE(TAG, "Mounting filesystem failed with %d", res);
+    }
+    f_unmount(plan_drv);
+    wl.flush();
+
+    drives[1].flash = NULL;
+
+    if (err != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+
+    // The data area (the volume plus the spare sector) is what the move
+    // pointer rotates through, and the state and config sectors after it
+    // stay put
+    size_t rotated = wl.chip_size() / SPI_FLASH_SEC_SIZE + 1;
+    uint64_t data_erases = 0;
+    uint32_t state_erases = 0;
+
+    r->fits = true;
+    for (size_t i = 0; i < sim.erases.size(); i++)
+    {
+        r->erases += sim.erases[i];
+        if (sim.erases[i] > r->max_erases)
+        {
+            r->max_erases = sim.erases[i];
+        }
+
+        if (i < rotated)
+        {
+            data_erases += sim.erases[i];
+        }
+        else if (sim.erases[i] > state_erases)
+        {
+            state_erases = sim.erases[i];
+        }
+    }
+
+    // One pass is far too short for the rotation to spread the hot sectors,
+    // so its peak says more about where the pointer happened to be than
+    // about the lifetime.  Over the life of the device the data area wears
+    // evenly, and the state sectors are rewritten once each time the
+    // pointer has moved through it (a move every "updaterate" erases), on
+    // top of whatever this pass rewrote them for.
+    double levelled = (double) data_erases / rotated;
+    double state = state_erases + (double) data_erases / r->updaterate / rotated;
+    r->wear = levelled > state ? levelled : state;
+    r->calls = sim.calls;
+    r->amplification = sim_written > 0 ? (double) r->erases * SPI_FLASH_SEC_SIZE / sim_written : 0;
+
+    return ESP_OK;
+}
+
+esp_err_t FatFSImage::run_workload(size_t begin, size_t end)
+{
+    for (size_t i = begin; i < end; i++)
+    {
+        sim_op *op = &sim_ops[i];
+        std::string path = plan_drv + op->path;
+        FRESULT res = FR_OK;
+
+        switch (op->op)
+        {
+            case SIM_WRITE:
+                res = sim_write(path, op->count, FA_WRITE | FA_CREATE_ALWAYS);
+                break;
+
+            case SIM_APPEND:
+                res = sim_write(path, op->count, FA_WRITE | FA_OPEN_APPEND);
+                break;
+
+            case SIM_DELETE:
+                res = f_unlink(path.c_str());
+                if (res == FR_NO_FILE)
+                {
+                    res = FR_OK;
+                }
+                break;
+
+            case SIM_RENAME:
+            {
+                std::string to = plan_drv + op->to;
+                res = f_unlink(to.c_str());
+                if (res == FR_OK || res == FR_NO_FILE)
+                {
+                    res = f_rename(path.c_str(), to.c_str());
+                }
+                break;
+            }
+
+            case SIM_MKDIR:
+                res = f_mkdir(path.c_str());
+                if (res == FR_EXIST)
+                {
+                    res = FR_OK;
+                }
+                break;
+
+            case SIM_REPEAT:
+                for (uint64_t n = 0; n < op->count; n++)
+                {
+                    if (run_workload(i + 1, op->end) != ESP_OK)
+                    {
+                        return ESP_FAIL;
+                    }
+                }
+                i = op->end - 1;
+                break;
+        }
+
+        if (res != FR_OK)
+        {
+            ESP_LOGE(TAG, "%s:%d: failed with %d", args.simulate->filename[0], op->line, res);
+            return ESP_FAIL;
+        }
+    }
+
+    return ESP_OK;
+}
+
+FRESULT FatFSImage::sim_write(const std::string &path, uint64_t bytes, BYTE mode)
+{
+    FIL f;
+    FRESULT res = f_open(&f, path.c_str(), mode);
+    if (res != FR_OK)
+    {
+        return res;
+    }
+
+    // Vary the data a little, as real rewrites would
+    BYTE buf[SPI_FLASH_SEC_SIZE];
+    memset(buf, (int) (sim_written & 0xff), sizeof(buf));
+
+    while (bytes > 0 && res == FR_OK)
+    {
+        UINT cnt = bytes < sizeof(buf) ? bytes : sizeof(buf);
+        UINT bw = 0;
+        res = f_write(&f, buf, cnt, &bw);
+        if (res == FR_OK && bw != cnt)
+        {
+            res = FR_DENIED;
+        }
+        bytes -= bw;
+        sim_written += bw;
+    }
+
+    FRESULT cres = f_close(&f);
+
+    return res != FR_OK ? res : cres;
+}
+
+// ============================================================================
+// Mount report
+//
+// "--mount-report" measures what an image costs a device at boot: the
+// sectors disk_read() is asked for while mounting the image, and then while
+// opening each file (or each one in the given list, in the order file's
+// format).  Every open starts from a fresh mount, as it would right after
+// boot, so the counts don't depend on the order the files are opened in.
+// The counts are turned into time with "--read-cost" microseconds per
+// sector read, which is where the SPI flash reads and the wear levelling
+// translation go on the device.  "--mount-report-json" writes the same
+// figures as JSON, for tracking them from one build to the next.
+// ============================================================================
+
+// Quotes "str" as a JSON string
+static std::string json_string(const std::string &str)
+{
+    std::string out = "\"";
+    for (size_t i = 0; i < str.size(); i++)
+    {
+        unsigned char c = str[i];
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += c;
+        }
+        else if (c < 0x20)
+        {
+            char esc[8];
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            out += esc;
+        }
+        else
+        {
+            out += c;
+        }
+    }
+    out += '"';
+
+    return out;
+}
+
+esp_err_t FatFSImage::mount_report()
+{
+    if (open_existing() != ESP_OK || init_wear_levelling() != ESP_OK || mount_existing() != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+
+    esp_err_t err = ESP_OK;
+    std::vector<std::string> names;
+    const char *hot = args.mount_report->filename[0];
+
+    if (hot[0] != '\0')
+    {
+        err = read_path_list(hot, names);
+    }
+    else
+    {
+        err = list_files("", names);
+    }
+
+    if (err != ESP_OK)
+    {
+        f_unmount(drv);
+        delete fs;
+        fs = NULL;
+        return ESP_FAIL;
+    }
+
+    size_t ss = drives[0].sector_size;
+    double cost = args.read_cost->count > 0 ? args.read_cost->ival[0] : (double) READ_COST_US_PER_KB * ss / 1024;
+
+    // The first mount may have tried both sector sizes, so do it again
+    f_unmount(drv);
+    drives[0].sectors_read = 0;
+    FRESULT res = f_mount(fs, drv, 1);
+    uint64_t mount_reads = drives[0].sectors_read;
+
+    if (res != FR_OK)
+    {
+        ESP_LOGE(TAG, "Mounting filesystem failed with %d", res);
+        delete fs;
+        fs = NULL;
+        return ESP_FAIL;
+    }
+
+    printf("Mount and open costs of %s (%d byte sectors, %.1f us per sector read)\n\n",
+           args.image->filename[0],
+           (int) ss,
+           cost);
+    printf("  mount: %llu sectors, %.2f ms\n\n", (unsigned long long) mount_reads, mount_reads * cost / 1000);
+    printf("   sectors        ms  path\n");
+
+    uint64_t total = 0;
+    uint64_t most = 0;
+    size_t opened = 0;
+    std::string worst;
+    std::vector<int64_t> opens(names.size(), -1);   // sectors, -1 if it failed
+
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        f_unmount(drv);
+        res = f_mount(fs, drv, 1);
+        if (res != FR_OK)
+        {
+            ESP_LOGE(TAG, "Mounting filesystem failed with %d", res);
+            err = ESP_FAIL;
+            break;
+        }
+
+        drives[0].sectors_read = 0;
+
+        FIL f;
+        FRESULT ores = f_open(&f, names[i].c_str(), FA_READ);
+        uint64_t reads = drives[0].sectors_read;
+        if (ores != FR_OK)
+        {
+            printf("  %8s  %8s  %s (failed with %d)\n", "-", "-", names[i].c_str(), ores);
+            err = ESP_FAIL;
+            continue;
+        }
+        f_close(&f);
+
+        printf("  %8llu  %8.2f  %s\n", (unsigned long long) reads, reads * cost / 1000, names[i].c_str());
+
+        opens[i] = reads;
+        total += reads;
+        opened++;
+        if (reads > most || worst.empty())
+        {
+            most = reads;
+            worst = names[i];
+        }
+    }
+
+    printf("\n");
+    printf("  files opened: %d\n", (int) opened);
+    if (opened > 0)
+    {
+        printf("  sectors per open: %.2f mean, %llu max (%s)\n",
+               (double) total / opened,
+               (unsigned long long) most,
+               worst.c_str());
+    }
+    printf("  mount and opens: %llu sectors, %.2f ms\n\n",
+           (unsigned long long) (mount_reads + total),
+           (mount_reads + total) * cost / 1000);
+
+    f_unmount(drv);
+    delete fs;
+    fs = NULL;
+
+    if (args.mount_json->count == 0)
+    {
+        return err;
+    }
+
+    const char *json = args.mount_json->filename[0];
+    FILE *fp = mount_json_fd != -1 ? fdopen(mount_json_fd, "w") : fopen(json, "w");
+    if (fp == NULL)
+    {
+        ESP_LOGE(TAG, "Unable to create '%s'", json);
+        return ESP_FAIL;
+    }
+    mount_json_fd = -1;
+
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"image\": %s,\n", json_string(args.image->filename[0]).c_str());
+    fprintf(fp, "  \"sector_size\": %d,\n", (int) ss);
+    fprintf(fp, "  \"us_per_sector\": %.1f,\n", cost);
+    fprintf(fp, "  \"mount_sectors\": %llu,\n", (unsigned long long) mount_reads);
+    fprintf(fp, "  \"mount_ms\": %.2f,\n", mount_reads * cost / 1000);
+    fprintf(fp, "  \"files_opened\": %d,\n", (int) opened);
+    fprintf(fp, "  \"max_open_sectors\": %llu,\n", (unsigned long long) most);
+    fprintf(fp, "  \"total_sectors\": %llu,\n", (unsigned long long) (mount_reads + total));
+    fprintf(fp, "  \"total_ms\": %.2f,\n", (mount_reads + total) * cost / 1000);
+    fprintf(fp, "  \"opens\": [\n");
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        if (opens[i] < 0)
+        {
+            fprintf(fp, "    { \"path\": %s, \"ok\": false }", json_string(names[i]).c_str());
+        }
+        else
+        {
+            fprintf(fp,
+                    "    { \"path\": %s, \"ok\": true, \"sectors\": %lld, \"ms\": %.2f }",
+                    json_string(names[i]).c_str(),
+                    (long long) opens[i],
+                    opens[i] * cost / 1000);
+        }
+        fprintf(fp, "%s\n", i + 1 < names.size() ? "," : "");
+    }
+    fprintf(fp, "  ]\n");
+    fprintf(fp, "}\n");
+
+    if (fclose(fp) != 0)
+    {
+        ESP_LOGE(TAG, "Write failed with %d for '%s'", errno, json);
+        return ESP_FAIL;
+    }
 
     return err;
 }
 
-int FatFSImage::copy_sub(copy_state *cs)
+// Adds the path of every file below "path" to "names"
+esp_err_t FatFSImage::list_files(const std::string &path, std::vector<std::string> &names)
 {
-    FRESULT res = FR_OK;
-    int err = 0;
+    FF_DIR dir;
+
+    FRESULT res = f_opendir(&dir, path.empty() ? "/" : path.c_str());
+    if (res != FR_OK)
+    {
+        ESP_LOGE(TAG, "Unable to open directory '%s' (%d)", path.c_str(), res);
+        return ESP_FAIL;
+    }
 
-    struct stat s;
-    if (stat(cs->src, &s) == -1)
+    if (!first_visit(&dir, path))
     {
-        ESP_LOGE(TAG, "Unable to get file info for '%s'", cs->src);
-        return -1;
+        f_closedir(&dir);
+        return ESP_FAIL;
     }
 
-    if (S_ISDIR(s.st_mode))
+    std::vector<std::string> subdirs;
+    esp_err_t err = ESP_OK;
+    while (1)
     {
         FILINFO fno;
-        res = f_stat(cs->dst, &fno);
-        if (res == FR_OK && !(fno.fattrib & AM_DIR))
+        res = f_readdir(&dir, &fno);
+        if (res != FR_OK)
         {
-            ESP_LOGE(TAG, "Attempt to copy directory '%s' to non-directorys '%s'", cs->src, cs->dst);
-            return -1;
+            ESP_LOGE(TAG, "Unable to read directory '%s' (%d)", path.c_str(), res);
+            err = ESP_FAIL;
+            break;
         }
 
-        if (res == FR_NO_FILE)
+        if (fno.fname[0] == '\0')
         {
-            ESP_LOGD(TAG, "Creating directory '%s'", cs->dst);
-            err = f_mkdir(cs->dst);
-            if (err == FR_OK)
-            { 
-                numdirs++;
-            }
+            break;
         }
 
-        if (err != FR_OK)
+        std::string name = path + "/" + fno.fname;
+        if (fno.fattrib & AM_DIR)
         {
-            ESP_LOGE(TAG, "Unable to create directory '%s'", cs->dst);
-            return -1;
+            subdirs.push_back(name);
         }
-
-        DIR *dirp = opendir(cs->src);
-        if (dirp != NULL)
+        else
         {
-            while (1)
-            {
-                struct dirent *dp = readdir(dirp);
-                if (dp == NULL)
-                {
-                    break;
-                }
+            names.push_back(name);
+        }
+    }
+    f_closedir(&dir);
 
-                if (strcmp(dp->d_name, ".") == 0 ||
-                    strcmp(dp->d_name, "..") == 0)
-                {
-                    continue;
-                }
+    // Only one directory is kept open at a time
+    for (size_t i = 0; i < subdirs.size() && err == ESP_OK; i++)
+    {
+        err = list_files(subdirs[i], names);
+    }
 
-                int srcorig = cs->srclen;
-                int dstorig = cs->dstlen;
+    return err;
+}
 
-                cs->srclen += 1 + strlen(dp->d_name);
-                cs->dstlen += 1 + strlen(dp->d_name);
+// ============================================================================
+// Flash_Access implementation
+// ============================================================================
 
-                if (cs->srclen >= PATH_MAX)
-                {
-                    ESP_LOGE(TAG, "Source name '%s/%s' is too long", cs->src, dp->d_name);
-                    err = -1;
-                }
-                else if (cs->dstlen >= PATH_MAX)
-                {
-                    ESP_LOGE(TAG, "Target name '%s/%s' is too long", cs->dst, dp->d_name);
-                    err = -1;
-                }
-                else
-                {
-                    cs->src[srcorig] = '/';
-                    strcpy(&cs->src[srcorig + 1], dp->d_name);
+size_t FatFSImage::chip_size()
+{
+    ESP_LOGV(TAG, "%s - %d", __func__, image_bytes);
 
-                    cs->dst[dstorig] = '/';
-                    strcpy(&cs->dst[dstorig + 1], dp->d_name);
+    return image_bytes;
+}
 
-                    err = copy_sub(cs);
+esp_err_t FatFSImage::erase_sector(size_t sector)
+{
+    ESP_LOGV(TAG, "%s - sector=0x%08x", __func__, (uint32_t) sector);
 
-                    cs->src[srcorig] = '\0';
-                    cs->dst[dstorig] = '\0';
-                }
+    return erase_range(sector * sector_size(), sector_size());
+}
 
-                cs->srclen = srcorig;
-                cs->dstlen = dstorig;
-            }
+bool FatFSImage::is_erased(size_t sector)
+{
+    return sector < erased.size() && erased[sector];
+}
 
-            closedir(dirp);
-        }
-    }
-    else if (!S_ISREG(s.st_mode))
+esp_err_t FatFSImage::erase_range(size_t start_address, size_t size)
+{
+    ESP_LOGV(TAG, "%s - add=0x%08x size=%d", __func__, (uint32_t) start_address, size);
+
+    StatTimer timer(STAT_IMAGE_ERASE, start_address, size);
+
+    if (start_address + size > image_bytes)
     {
-        ESP_LOGE(TAG, "'%s' is not a normal file or directory", cs->src);
-        err = -1;
+        return ESP_ERR_INVALID_SIZE;
     }
-    else
+
+    // Whole sectors are only marked as erased, and sectors that already are
+    // need nothing at all
+    for (size_t addr = start_address, end = start_address + size; addr < end; )
     {
-        FILINFO fno;
+        size_t sector = addr / SPI_FLASH_SEC_SIZE;
+        size_t ofs = addr % SPI_FLASH_SEC_SIZE;
+        size_t len = SPI_FLASH_SEC_SIZE - ofs < end - addr ? SPI_FLASH_SEC_SIZE - ofs : end - addr;
 
-        res = f_stat(cs->dst, &fno);
-        if (res == FR_OK && fno.fattrib & AM_DIR)
+        if (!is_erased(sector))
         {
-            int dstorig = cs->dstlen;
-            char *p = &cs->src[cs->srclen];
-            do
+            if (len == SPI_FLASH_SEC_SIZE && !erased.empty())
             {
-                cs->dstlen++;
-            } while (*--p != '/');
-
-            if (cs->dstlen >= PATH_MAX)
-            {
-                ESP_LOGE(TAG, "Target name '%s/%s' is too long", cs->dst, p + 1);
-                err = -1;
+                erased[sector] = true;
             }
             else
             {
-                cs->dst[dstorig] = '/';
-                strcpy(&cs->dst[dstorig + 1], p + 1);
+                esp_err_t err = backend_erase(addr, len);
+                if (err != ESP_OK)
+                {
+                    return err;
+                }
             }
         }
 
-        if (res != FR_NO_FILE)
-        {
-            ESP_LOGE(TAG, "Unable to create destination file '%s'", cs->dst);
-            return -1;
-        }
+        addr += len;
+    }
 
-        ESP_LOGD(TAG, "Copying file '%s' to '%s'", cs->src, cs->dst);
+    return ESP_OK;
+}
 
-        FILE *srcf = fopen(cs->src, "rb");
-        if (srcf == NULL)
-        {
-            ESP_LOGE(TAG, "Unable to open source '%s'", cs->src);
-            return -1;
-        }
-        else
-        {
-            FIL dstf;
+esp_err_t FatFSImage::write(size_t addr, const void *src, size_t size)
+{
+    ESP_LOGV(TAG, "%s - addr=0x%08x size=%d", __func__, (uint32_t) addr, size);
 
-            res = f_open(&dstf, cs->dst, FA_WRITE | FA_CREATE_ALWAYS);
-            if (res != FR_OK)
+    StatTimer timer(STAT_IMAGE_WRITE, addr, size);
+
+    if (addr + size > image_bytes)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    // Erased sectors hold whatever the backend had, so ones only partly
+    // covered by the write get their 0xff filled in first
+    if (size > 0)
+    {
+        size_t first = addr / SPI_FLASH_SEC_SIZE;
+        size_t last = (addr + size - 1) / SPI_FLASH_SEC_SIZE;
+
+        for (size_t sector = first; sector <= last; sector++)
+        {
+            if (!is_erased(sector))
             {
-                ESP_LOGE(TAG, "Unable to open target '%s'", cs->dst);
-                err = -1;
+                continue;
             }
-            else
-            {
-                err = 0;
-                while (!feof(srcf) && !ferror(srcf) && f_error(&dstf) == FR_OK)
-                {
-                    UINT bw;
-                    size_t read = fread(cs->buf, 1, sizeof(cs->buf), srcf);
-                    f_write(&dstf, cs->buf, read, &bw);
-                }
-
-                if (ferror(srcf))
-                {
-                    ESP_LOGE(TAG, "Read returned %d for source '%s'", errno, cs->src);
-                    err = -1;
-                }
-                else if (f_error(&dstf) != FR_OK)
-                {
-                    ESP_LOGE(TAG, "Write returned %d for target '%s'", f_error(&dstf), cs->src);
-                    err = -1;
-                }
-                else
-                {
-                    numfiles++;
-                }
 
-                f_close(&dstf);
+            erased[sector] = false;
 
-                if (err == -1)
+            size_t base = sector * SPI_FLASH_SEC_SIZE;
+            if (base < addr || base + SPI_FLASH_SEC_SIZE > addr + size)
+            {
+                esp_err_t err = backend_erase(base, SPI_FLASH_SEC_SIZE);
+                if (err != ESP_OK)
                 {
-                    f_unlink(cs->dst);
-                    // ignore errors
+                    return err;
                 }
             }
-            fclose(srcf);
         }
     }
 
-    return err;
+    return backend_write(addr, src, size);
 }
 
+esp_err_t FatFSImage::read(size_t addr, void *dest, size_t size)
+{
+    ESP_LOGV(TAG, "%s - addr=0x%08x size=%d", __func__, (uint32_t) addr, size);
 
-// ============================================================================
-// Flash_Access implementation
-// ============================================================================
+    StatTimer timer(STAT_IMAGE_READ, addr, size);
 
-size_t FatFSImage::chip_size()
-{
-    ESP_LOGV(TAG, "%s - %d", __func__, image_bytes);
+    if (addr + size > image_bytes)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
 
-    return image_bytes;
-}
+    // Erased sectors read as 0xff and the rest comes from the backend in
+    // as few calls as possible
+    uint8_t *p = (uint8_t *) dest;
+    size_t end = addr + size;
+    while (addr < end)
+    {
+        size_t run = addr;
+        bool fill = is_erased(addr / SPI_FLASH_SEC_SIZE);
 
-esp_err_t FatFSImage::erase_sector(size_t sector)
-{
-    ESP_LOGV(TAG, "%s - sector=0x%08x", __func__, (uint32_t) sector);
+        while (run < end && is_erased(run / SPI_FLASH_SEC_SIZE) == fill)
+        {
+            run = (run / SPI_FLASH_SEC_SIZE + 1) * SPI_FLASH_SEC_SIZE;
+        }
+        if (run > end)
+        {
+            run = end;
+        }
 
-    return erase_range(sector * sector_size(), sector_size());
+        if (fill)
+        {
+            memset(p, 0xff, run - addr);
+        }
+        else
+        {
+            esp_err_t err = backend_read(addr, p, run - addr);
+            if (err != ESP_OK)
+            {
+                return err;
+            }
+        }
+
+        p += run - addr;
+        addr = run;
+    }
+
+    return ESP_OK;
 }
 
-esp_err_t FatFSImage::erase_range(size_t start_address, size_t size)
+// Sets a range of the image to 0xff in whichever backend holds it
+esp_err_t FatFSImage::backend_erase(size_t start_address, size_t size)
 {
-    ESP_LOGV(TAG, "%s - add=0x%08x size=%d", __func__, (uint32_t) start_address, size);
+    if (cache)
+    {
+        return cache->erase_range(start_address, size);
+    }
+
+    if (buffer)
+    {
+        memset(&buffer[start_address], 0xff, size);
+        return ESP_OK;
+    }
 
     if (fseek(image, start_address, SEEK_SET) == -1)
     {
@@ -620,13 +8845,13 @@ esp_err_t FatFSImage::erase_range(size_t start_address, size_t size)
     }
 
     char buf[SPI_FLASH_SEC_SIZE];
-    int bytes = size;
+    size_t bytes = size;
 
     memset(buf, 0xff, sizeof(buf));
 
-    for (int i = 0, len = 0; i < bytes; i += len)
+    for (size_t i = 0, len = 0; i < bytes; i += len)
     {
-        len = bytes > sizeof(buf) ? sizeof(buf) : bytes;
+        len = bytes - i > sizeof(buf) ? sizeof(buf) : bytes - i;
 
         fwrite(buf, 1, len, image);
         if (ferror(image))
@@ -638,9 +8863,18 @@ esp_err_t FatFSImage::erase_range(size_t start_address, size_t size)
     return ESP_OK;
 }
 
-esp_err_t FatFSImage::write(size_t addr, const void *src, size_t size)
+esp_err_t FatFSImage::backend_write(size_t addr, const void *src, size_t size)
 {
-    ESP_LOGV(TAG, "%s - addr=0x%08x size=%d", __func__, (uint32_t) addr, size);
+    if (cache)
+    {
+        return cache->write(addr, src, size);
+    }
+
+    if (buffer)
+    {
+        memcpy(&buffer[addr], src, size);
+        return ESP_OK;
+    }
 
     if (fseek(image, addr, SEEK_SET) == -1)
     {
@@ -650,15 +8884,24 @@ esp_err_t FatFSImage::write(size_t addr, const void *src, size_t size)
     size_t written = fwrite(src, 1, size, image);
     if (written == size)
     {
-        return RES_OK;
+        return ESP_OK;
     }
 
-    return ESP_OK;
+    return ESP_FAIL;
 }
 
-esp_err_t FatFSImage::read(size_t addr, void *dest, size_t size)
+esp_err_t FatFSImage::backend_read(size_t addr, void *dest, size_t size)
 {
-    ESP_LOGV(TAG, "%s - addr=0x%08x size=%d", __func__, (uint32_t) addr, size);
+    if (cache)
+    {
+        return cache->read(addr, dest, size);
+    }
+
+    if (buffer)
+    {
+        memcpy(dest, &buffer[addr], size);
+        return ESP_OK;
+    }
 
     if (fseek(image, addr, SEEK_SET) == -1)
     {
@@ -668,10 +8911,10 @@ esp_err_t FatFSImage::read(size_t addr, void *dest, size_t size)
     size_t read = fread(dest, 1, size, image);
     if (read == size)
     {
-        return RES_OK;
+        return ESP_OK;
     }
 
-    return ESP_OK;
+    return ESP_FAIL;
 }
 
 size_t FatFSImage::sector_size()
@@ -716,12 +8959,25 @@ DRESULT disk_read(BYTE pdrv, BYTE *buff, DWORD sector, UINT count)
 {
     ESP_LOGV(TAG, "%s - pdrv=%d, sector=%ld, count=%d", __func__, pdrv, sector, count);
 
-    size_t ss = flash.sector_size();
+    if (pdrv >= FF_VOLUMES || drives[pdrv].flash == NULL)
+    {
+        return RES_PARERR;
+    }
+
+    Flash_Access *fa = drives[pdrv].flash;
+    size_t ss = drives[pdrv].sector_size;
     size_t addr = sector * ss;
     size_t len = count * ss;
     esp_err_t err;
 
-    err = flash.read(addr, buff, len);
+    StatTimer timer(STAT_DISK_READ, addr, len, pdrv == 0);
+
+    drives[pdrv].sectors_read += count;
+
+    {
+        StatTimer wl(STAT_WL_READ, addr, len, pdrv == 0);
+        err = fa->read(addr, buff, len);
+    }
     if (err != ESP_OK)
     {
         return RES_ERROR;
@@ -734,21 +8990,88 @@ DRESULT disk_write(BYTE pdrv, const BYTE *buff, DWORD sector, UINT count)
 {
     ESP_LOGV(TAG, "%s - pdrv=%d, sector=%ld, count=%d", __func__, pdrv, sector, count);
 
-    size_t ss = flash.sector_size();
+    if (pdrv >= FF_VOLUMES || drives[pdrv].flash == NULL)
+    {
+        return RES_PARERR;
+    }
+
+    Flash_Access *fa = drives[pdrv].flash;
+    size_t ss = drives[pdrv].sector_size;
+    size_t fss = fa->sector_size();
     size_t addr = sector * ss;
     size_t len = count * ss;
+    bool counted = pdrv == 0;
     esp_err_t err;
 
-    err = flash.erase_range(addr, len);
-    if (err != ESP_OK)
+    StatTimer timer(STAT_DISK_WRITE, addr, len, counted);
+
+    if (ss >= fss)
     {
-        return RES_ERROR;
+        {
+            StatTimer wl(STAT_WL_ERASE, addr, len, counted);
+            err = fa->erase_range(addr, len);
+        }
+        if (err != ESP_OK)
+        {
+            return RES_ERROR;
+        }
+
+        {
+            StatTimer wl(STAT_WL_WRITE, addr, len, counted);
+            err = fa->write(addr, buff, len);
+        }
+        if (err != ESP_OK)
+        {
+            return RES_ERROR;
+        }
+
+        return RES_OK;
     }
 
-    err = flash.write(addr, buff, len);
-    if (err != ESP_OK)
+    // Smaller FatFs sectors share a flash sector, so the untouched part of
+    // the flash sector has to be preserved across the erase.
+    BYTE temp[SPI_FLASH_SEC_SIZE];
+    while (len > 0)
     {
-        return RES_ERROR;
+        size_t base = addr - addr % fss;
+        size_t ofs = addr - base;
+        size_t cnt = fss - ofs < len ? fss - ofs : len;
+
+        if (cnt != fss)
+        {
+            {
+                StatTimer wl(STAT_WL_READ, base, fss, counted);
+                err = fa->read(base, temp, fss);
+            }
+            if (err != ESP_OK)
+            {
+                return RES_ERROR;
+            }
+        }
+
+        memcpy(&temp[ofs], buff, cnt);
+
+        {
+            StatTimer wl(STAT_WL_ERASE, base, fss, counted);
+            err = fa->erase_range(base, fss);
+        }
+        if (err != ESP_OK)
+        {
+            return RES_ERROR;
+        }
+
+        {
+            StatTimer wl(STAT_WL_WRITE, base, fss, counted);
+            err = fa->write(base, temp, fss);
+        }
+        if (err != ESP_OK)
+        {
+            return RES_ERROR;
+        }
+
+        addr += cnt;
+        buff += cnt;
+        len -= cnt;
     }
 
     return RES_OK;
@@ -758,17 +9081,24 @@ DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void *buff)
 {
     ESP_LOGV(TAG, "%s: cmd=%d", __func__, cmd);
 
+    if (pdrv >= FF_VOLUMES || drives[pdrv].flash == NULL)
+    {
+        return RES_PARERR;
+    }
+
+    StatTimer timer(STAT_DISK_IOCTL, cmd, 0, pdrv == 0);
+
     switch (cmd)
     {
         case CTRL_SYNC:
             return RES_OK;
 
         case GET_SECTOR_COUNT:
-            *((DWORD *) buff) = flash.chip_size() / flash.sector_size();
+            *((DWORD *) buff) = drives[pdrv].flash->chip_size() / drives[pdrv].sector_size;
             return RES_OK;
 
         case GET_SECTOR_SIZE:
-            *((WORD *) buff) = flash.sector_size();
+            *((WORD *) buff) = drives[pdrv].sector_size;
             return RES_OK;
 
         case GET_BLOCK_SIZE:
@@ -822,17 +9152,6 @@ void esp_log_write(esp_log_level_t level, const char* tag, const char* format, .
     }
 }
 
-// ============================================================================
-// Ye' old main
-// ============================================================================
-
-int main(int argc, char *argv[])
-{
-    FatFSImage ffsi;
-
-    return ffsi.main(argc, argv) == ESP_OK ? 0 : -1;
-}
-
 // ============================================================================
 // End if "C" code
 // ============================================================================
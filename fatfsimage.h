@@ -0,0 +1,96 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// ============================================================================
+// Image builder library
+//
+// Builds a FATFS image, wear levelling included, entirely in memory from
+// directories and files handed over by the caller, then passes the finished
+// image to a buffer or a sink.  The fatfsimage command is built on the same
+// library (see fatfsimage_main()).
+//
+//   FatFSBuilder b;
+//   fatfs_params params = { 1024 * 1024 };
+//
+//   b.begin(&params);
+//   b.add_dir("/www");
+//   b.add_file("/www/index.html", html, html_len);
+//   b.finish(image, sizeof(image));
+//
+// Paths inside the image are absolute and missing parent directories are
+// created as needed.  The wear levelling layer and FatFs volume are process
+// wide, so only one builder can be between begin() and finish() at a time.
+// ============================================================================
+
+#ifndef FATFSIMAGE_H
+#define FATFSIMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "esp_err.h"
+
+typedef struct
+{
+    uint32_t size;                  // image size in bytes, a multiple of 4096
+    uint32_t sector_size;           // filesystem sector size, 512 or 4096 (0 is 4096)
+    uint32_t cluster_size;          // filesystem cluster size (0 lets FatFs pick)
+    bool contiguous;                // allocate each file as one cluster run
+    bool raw;                       // leave out wear levelling (4096 byte sectors only)
+} fatfs_params;
+
+// Supplies up to "len" bytes of a file's contents from "offset" into "dest".
+// Returns the number of bytes supplied, 0 at the end of the data or -1 on
+// error.
+typedef ssize_t (*fatfs_source)(void *ctx, size_t offset, void *dest, size_t len);
+
+// Receives "len" bytes of the finished image from "offset".  Returns false
+// to abandon the image.
+typedef bool (*fatfs_sink)(void *ctx, size_t offset, const void *data, size_t len);
+
+class FatFSImage;
+
+class FatFSBuilder
+{
+public:
+    FatFSBuilder();
+    ~FatFSBuilder();
+
+    // Creates and formats the image
+    esp_err_t begin(const fatfs_params *params);
+
+    esp_err_t add_dir(const char *path);
+
+    // "data" may only be NULL for an empty file
+    esp_err_t add_file(const char *path, const void *data, size_t len);
+    esp_err_t add_file(const char *path, size_t len, fatfs_source source, void *ctx);
+
+    // Copies a host file or directory tree into the directory "dst"
+    esp_err_t add_path(const char *src, const char *dst);
+
+    // Unmounts the filesystem and hands over the finished image
+    esp_err_t finish(void *dest, size_t len);
+    esp_err_t finish(fatfs_sink sink, void *ctx);
+
+    size_t image_size();
+
+private:
+    FatFSImage *image;
+};
+
+// Runs the fatfsimage command line
+int fatfsimage_main(int argc, char *argv[]);
+
+#endif // FATFSIMAGE_H
@@ -0,0 +1,638 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+#include "argtable3.h"
+#include "esp_err.h"
+#include "fatfstrace.h"
+#include "Flash_Access.h"
+#include "memoryflash.h"
+
+// Locality is measured in flash sectors
+#define TRACE_SECTOR_SIZE 4096
+
+// Seek distance histogram buckets, in bytes
+static const uint64_t seek_buckets[] =
+{
+    0,
+    4 * 1024,
+    64 * 1024,
+    1024 * 1024,
+    16 * 1024 * 1024,
+    UINT64_MAX
+};
+#define SEEK_BUCKETS (sizeof(seek_buckets) / sizeof(seek_buckets[0]))
+
+static const char *layer_names[TRACE_LAYERS] = { "disk", "wl", "image" };
+static const char *op_names[TRACE_OPS] = { "read", "write", "erase", "ioctl" };
+
+// ============================================================================
+// Replay backends
+// ============================================================================
+
+// Discards everything, to measure the replay itself
+class NullFlash : public Flash_Access
+{
+public:
+    NullFlash(size_t size)
+    {
+        bytes = size;
+    }
+
+    virtual size_t chip_size() final
+    {
+        return bytes;
+    }
+
+    virtual esp_err_t erase_sector(size_t sector) final
+    {
+        return ESP_OK;
+    }
+
+    virtual esp_err_t erase_range(size_t start_address, size_t size) final
+    {
+        return ESP_OK;
+    }
+
+    virtual esp_err_t write(size_t dest_addr, const void *src, size_t size) final
+    {
+        return ESP_OK;
+    }
+
+    virtual esp_err_t read(size_t src_addr, void *dest, size_t size) final
+    {
+        return ESP_OK;
+    }
+
+    virtual size_t sector_size() final
+    {
+        return TRACE_SECTOR_SIZE;
+    }
+
+private:
+    size_t bytes;
+};
+
+// A file, accessed like the --stdio image backend but with pread/pwrite
+class FileFlash : public Flash_Access
+{
+public:
+    FileFlash(const char *path, size_t size)
+    {
+        bytes = size;
+        fd = open(path, O_RDWR | O_CREAT, 0644);
+        if (fd != -1 && ftruncate(fd, size) != 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    virtual ~FileFlash()
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+    }
+
+    bool valid()
+    {
+        return fd != -1;
+    }
+
+    virtual size_t chip_size() final
+    {
+        return bytes;
+    }
+
+    virtual esp_err_t erase_sector(size_t sector) final
+    {
+        return erase_range(sector * TRACE_SECTOR_SIZE, TRACE_SECTOR_SIZE);
+    }
+
+    virtual esp_err_t erase_range(size_t start_address, size_t size) final
+    {
+        uint8_t buf[TRACE_SECTOR_SIZE];
+        memset(buf, 0xff, sizeof(buf));
+
+        while (size > 0)
+        {
+            size_t len = size < sizeof(buf) ? size : sizeof(buf);
+            if (pwrite(fd, buf, len, start_address) != (ssize_t) len)
+            {
+                return ESP_FAIL;
+            }
+            start_address += len;
+            size -= len;
+        }
+
+        return ESP_OK;
+    }
+
+    virtual esp_err_t write(size_t dest_addr, const void *src, size_t size) final
+    {
+        return pwrite(fd, src, size, dest_addr) == (ssize_t) size ? ESP_OK : ESP_FAIL;
+    }
+
+    virtual esp_err_t read(size_t src_addr, void *dest, size_t size) final
+    {
+        return pread(fd, dest, size, src_addr) == (ssize_t) size ? ESP_OK : ESP_FAIL;
+    }
+
+    virtual size_t sector_size() final
+    {
+        return TRACE_SECTOR_SIZE;
+    }
+
+private:
+    int fd;
+    size_t bytes;
+};
+
+// ============================================================================
+// Trace analysis and replay
+// ============================================================================
+
+class FatFSTrace
+{
+private:
+    typedef struct
+    {
+        uint64_t calls[TRACE_OPS];
+        uint64_t bytes[TRACE_OPS];
+        uint64_t nsecs[TRACE_OPS];
+        uint64_t seeks[SEEK_BUCKETS];
+        uint64_t seek_total;
+        uint64_t backward;
+        uint64_t sectors;           // sector touches
+        uint64_t unique;            // distinct sectors touched
+        uint64_t runs;              // ops left after merging adjacent ones
+        uint64_t rewrites;          // writes to sectors written before
+        uint64_t hot_sector;
+        uint64_t hot_count;
+    } layer_stats;
+
+public:
+    int main(int argc, char *argv[]);
+
+private:
+    esp_err_t parse(int argc, char *argv[]);
+    esp_err_t load();
+    void analyze(int layer, layer_stats *st);
+    void print(int layer, const layer_stats *st);
+    esp_err_t replay(int layer);
+
+    struct
+    {
+        struct arg_lit *help;
+        struct arg_str *layer;
+        struct arg_str *backend;
+        struct arg_file *image;
+        struct arg_file *trace;
+        struct arg_end *end;
+    } args =
+    {
+        arg_litn("h", "help", 0, 1, "display this help and exit"),
+        arg_strn("l", "layer", "<layer>", 0, 1, "layer to replay: disk, wl or image (image is default)"),
+        arg_strn("b", "backend", "<backend>", 0, 1, "replay into: none, null, memory or file (memory is default)"),
+        arg_filen(NULL, "image", "<file>", 0, 1, "file for the file backend"),
+        arg_filen(NULL, NULL, "<trace>", 1, 1, "trace written by fatfsimage --trace"),
+        arg_end(20)
+    };
+    static const int argcount = sizeof(args) / sizeof(void *);
+    void **argtable = (void **) &args;
+
+    trace_header hdr;
+    std::vector<trace_record> records;
+    int replay_layer = TRACE_IMAGE;
+    const char *backend = "memory";
+};
+
+int FatFSTrace::main(int argc, char *argv[])
+{
+    esp_err_t err = ESP_FAIL;
+
+    if (parse(argc, argv) == ESP_OK)
+    {
+        if (load() == ESP_OK)
+        {
+            printf("Trace of a %llu byte image with %d records\n\n",
+                   (unsigned long long) hdr.image_bytes,
+                   (int) records.size());
+
+            for (int layer = 0; layer < TRACE_LAYERS; layer++)
+            {
+                layer_stats st;
+                analyze(layer, &st);
+                print(layer, &st);
+            }
+
+            err = replay(replay_layer);
+        }
+    }
+
+    arg_freetable(argtable, argcount);
+
+    return err;
+}
+
+esp_err_t FatFSTrace::parse(int argc, char *argv[])
+{
+    int err_cnt = arg_parse(argc, argv, argtable);
+
+    if (args.help->count > 0)
+    {
+        printf("Usage: %s", argv[0]);
+        arg_print_syntax(stdout, argtable, "\n");
+
+        printf("Analyze and replay a fatfsimage I/O trace.\n\n");
+        arg_print_glossary(stdout, argtable, "  %-25s %s\n");
+
+        return ESP_FAIL;
+    }
+
+    if (err_cnt > 0)
+    {
+        arg_print_errors(stdout, args.end, argv[0]);
+
+        printf("\nUsage: %s", argv[0]);
+        arg_print_syntax(stdout, argtable, "\n");
+
+        return ESP_FAIL;
+    }
+
+    if (args.layer->count > 0)
+    {
+        replay_layer = -1;
+        for (int i = 0; i < TRACE_LAYERS; i++)
+        {
+            if (strcmp(args.layer->sval[0], layer_names[i]) == 0)
+            {
+                replay_layer = i;
+            }
+        }
+
+        if (replay_layer < 0)
+        {
+            printf("Unknown layer '%s'\n", args.layer->sval[0]);
+            return ESP_FAIL;
+        }
+    }
+
+    if (args.backend->count > 0)
+    {
+        backend = args.backend->sval[0];
+        if (strcmp(backend, "none") != 0 &&
+            strcmp(backend, "null") != 0 &&
+            strcmp(backend, "memory") != 0 &&
+            strcmp(backend, "file") != 0)
+        {
+            printf("Unknown backend '%s'\n", backend);
+            return ESP_FAIL;
+        }
+
+        if (strcmp(backend, "file") == 0 && args.image->count == 0)
+        {
+            printf("The file backend needs --image\n");
+            return ESP_FAIL;
+        }
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t FatFSTrace::load()
+{
+    const char *path = args.trace->filename[0];
+
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        printf("Unable to open '%s'\n", path);
+        return ESP_FAIL;
+    }
+
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != TRACE_VERSION ||
+        hdr.record_size != sizeof(trace_record))
+    {
+        printf("'%s' isn't a version %d trace\n", path, TRACE_VERSION);
+        fclose(fp);
+        return ESP_FAIL;
+    }
+
+    trace_record rec;
+    while (fread(&rec, sizeof(rec), 1, fp) == 1)
+    {
+        if (rec.layer < TRACE_LAYERS && rec.op < TRACE_OPS)
+        {
+            records.push_back(rec);
+        }
+    }
+
+    fclose(fp);
+
+    // Records are written as calls finish, replay them in issue order
+    std::stable_sort(records.begin(), records.end(),
+                     [](const trace_record &a, const trace_record &b)
+                     {
+                         return a.time < b.time;
+                     });
+
+    return ESP_OK;
+}
+
+void FatFSTrace::analyze(int layer, layer_stats *st)
+{
+    memset(st, 0, sizeof(*st));
+
+    std::unordered_map<uint64_t, uint64_t> touches;
+    std::unordered_map<uint64_t, bool> written;
+    const trace_record *prev = NULL;
+
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        const trace_record *rec = &records[i];
+        if (rec->layer != layer)
+        {
+            continue;
+        }
+
+        st->calls[rec->op]++;
+        st->bytes[rec->op] += rec->len;
+        st->nsecs[rec->op] += rec->nsecs;
+
+        if (rec->op == TRACE_IOCTL)
+        {
+            continue;
+        }
+
+        // Distance from where the previous access ended
+        if (prev != NULL)
+        {
+            uint64_t end = prev->addr + prev->len;
+            uint64_t dist = rec->addr >= end ? rec->addr - end : end - rec->addr;
+
+            if (rec->addr < end)
+            {
+                st->backward++;
+            }
+
+            size_t b = 0;
+            while (dist > seek_buckets[b])
+            {
+                b++;
+            }
+            st->seeks[b]++;
+            st->seek_total += dist;
+
+            // Would have been one call had they been merged
+            if (rec->op != prev->op || dist != 0 || rec->addr < end)
+            {
+                st->runs++;
+            }
+        }
+        else
+        {
+            st->runs++;
+        }
+        prev = rec;
+
+        if (rec->len == 0)
+        {
+            continue;
+        }
+
+        uint64_t first = rec->addr / TRACE_SECTOR_SIZE;
+        uint64_t last = (rec->addr + rec->len - 1) / TRACE_SECTOR_SIZE;
+        for (uint64_t s = first; s <= last; s++)
+        {
+            uint64_t count = ++touches[s];
+            st->sectors++;
+
+            if (count > st->hot_count)
+            {
+                st->hot_count = count;
+                st->hot_sector = s;
+            }
+
+            if (rec->op == TRACE_WRITE)
+            {
+                if (written.count(s))
+                {
+                    st->rewrites++;
+                }
+                written[s] = true;
+            }
+        }
+    }
+
+    st->unique = touches.size();
+}
+
+void FatFSTrace::print(int layer, const layer_stats *st)
+{
+    uint64_t total = 0;
+    for (int op = 0; op < TRACE_OPS; op++)
+    {
+        total += st->calls[op];
+    }
+
+    if (total == 0)
+    {
+        return;
+    }
+
+    printf("Layer %s\n\n", layer_names[layer]);
+    printf("  %-8s %10s %14s %12s %10s\n", "op", "calls", "bytes", "total ms", "avg us");
+    for (int op = 0; op < TRACE_OPS; op++)
+    {
+        if (st->calls[op] == 0)
+        {
+            continue;
+        }
+
+        printf("  %-8s %10llu %14llu %12.3f %10.3f\n",
+               op_names[op],
+               (unsigned long long) st->calls[op],
+               (unsigned long long) st->bytes[op],
+               st->nsecs[op] / 1e6,
+               st->nsecs[op] / 1e3 / st->calls[op]);
+    }
+
+    uint64_t accesses = total - st->calls[TRACE_IOCTL];
+    uint64_t seeks = accesses > 0 ? accesses - 1 : 0;
+
+    printf("\n  seek distance from the end of the previous access\n");
+    for (size_t b = 0; b < SEEK_BUCKETS; b++)
+    {
+        if (b == 0)
+        {
+            printf("    sequential     ");
+        }
+        else if (b == SEEK_BUCKETS - 1)
+        {
+            printf("    more           ");
+        }
+        else
+        {
+            printf("    up to %5llu KB ", (unsigned long long) (seek_buckets[b] / 1024));
+        }
+
+        printf("%10llu  %5.1f%%\n",
+               (unsigned long long) st->seeks[b],
+               seeks ? 100.0 * st->seeks[b] / seeks : 0.0);
+    }
+    printf("    average distance: %.0f bytes\n", seeks ? (double) st->seek_total / seeks : 0.0);
+    printf("    backward seeks: %llu\n", (unsigned long long) st->backward);
+
+    printf("\n  locality (%d byte sectors)\n", TRACE_SECTOR_SIZE);
+    printf("    sector accesses: %llu\n", (unsigned long long) st->sectors);
+    printf("    distinct sectors: %llu\n", (unsigned long long) st->unique);
+    printf("    re-references: %.1f%%\n",
+           st->sectors ? 100.0 * (st->sectors - st->unique) / st->sectors : 0.0);
+    printf("    sector rewrites: %llu\n", (unsigned long long) st->rewrites);
+    printf("    hottest sector: %llu (%llu accesses)\n",
+           (unsigned long long) st->hot_sector,
+           (unsigned long long) st->hot_count);
+
+    printf("\n  coalescing\n");
+    printf("    accesses: %llu\n", (unsigned long long) accesses);
+    printf("    after merging adjacent accesses: %llu\n", (unsigned long long) st->runs);
+    printf("    reduction: %.1f%%\n", accesses ? 100.0 * (accesses - st->runs) / accesses : 0.0);
+    printf("\n");
+}
+
+esp_err_t FatFSTrace::replay(int layer)
+{
+    if (strcmp(backend, "none") == 0)
+    {
+        return ESP_OK;
+    }
+
+    size_t size = hdr.image_bytes;
+
+    Flash_Access *fa;
+    if (strcmp(backend, "null") == 0)
+    {
+        fa = new NullFlash(size);
+    }
+    else if (strcmp(backend, "memory") == 0)
+    {
+        MemoryFlash *mf = new MemoryFlash(size);
+        if (!mf->valid())
+        {
+            printf("Unable to allocate %d bytes\n", (int) size);
+            delete mf;
+            return ESP_FAIL;
+        }
+        fa = mf;
+    }
+    else
+    {
+        FileFlash *ff = new FileFlash(args.image->filename[0], size);
+        if (!ff->valid())
+        {
+            printf("Unable to open '%s'\n", args.image->filename[0]);
+            delete ff;
+            return ESP_FAIL;
+        }
+        fa = ff;
+    }
+
+    std::vector<uint8_t> buf;
+    uint64_t calls = 0;
+    uint64_t bytes = 0;
+    uint64_t recorded = 0;
+    esp_err_t err = ESP_OK;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (size_t i = 0; i < records.size() && err == ESP_OK; i++)
+    {
+        const trace_record *rec = &records[i];
+        if (rec->layer != layer || rec->op == TRACE_IOCTL)
+        {
+            continue;
+        }
+
+        if (buf.size() < rec->len)
+        {
+            buf.resize(rec->len, 0x5a);
+        }
+
+        switch (rec->op)
+        {
+            case TRACE_READ:
+                err = fa->read(rec->addr, buf.data(), rec->len);
+                break;
+
+            case TRACE_WRITE:
+                err = fa->write(rec->addr, buf.data(), rec->len);
+                break;
+
+            case TRACE_ERASE:
+                err = fa->erase_range(rec->addr, rec->len);
+                break;
+        }
+
+        if (err != ESP_OK)
+        {
+            printf("Replay failed with %d at record %d\n", err, (int) i);
+        }
+
+        calls++;
+        bytes += rec->len;
+        recorded += rec->nsecs;
+    }
+
+    fa->flush();
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("Replay of layer %s into %s\n\n", layer_names[layer], backend);
+    printf("  calls: %llu\n", (unsigned long long) calls);
+    printf("  bytes: %llu\n", (unsigned long long) bytes);
+    printf("  time: %.3f ms (%.3f ms when recorded)\n", secs * 1e3, recorded / 1e6);
+    printf("  throughput: %.1f MB/s\n", secs > 0 ? bytes / secs / (1024 * 1024) : 0.0);
+    printf("\n");
+
+    delete fa;
+
+    return err;
+}
+
+int main(int argc, char *argv[])
+{
+    FatFSTrace ft;
+
+    return ft.main(argc, argv) == ESP_OK ? 0 : -1;
+}
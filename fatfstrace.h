@@ -0,0 +1,71 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// ============================================================================
+// Binary I/O trace format
+//
+// Written by "fatfsimage --trace" and read by fatfstrace.  The file starts
+// with a trace_header followed by trace_record entries in the order the
+// calls finished.  Nested calls (a disk write and the wear levelling and
+// image writes it causes) each get their own record, so sort by "time" to
+// get the order they were issued in.  All fields are in host byte order.
+// ============================================================================
+
+#ifndef FATFSTRACE_H
+#define FATFSTRACE_H
+
+#include <stdint.h>
+
+#define TRACE_MAGIC "FFITRACE"
+#define TRACE_VERSION 1
+
+enum
+{
+    TRACE_DISK,                     // FatFs disk_*() calls
+    TRACE_WL,                       // calls into wear levelling
+    TRACE_IMAGE,                    // calls on the image's Flash_Access
+    TRACE_LAYERS
+};
+
+enum
+{
+    TRACE_READ,
+    TRACE_WRITE,
+    TRACE_ERASE,
+    TRACE_IOCTL,                    // addr holds the command
+    TRACE_OPS
+};
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t image_bytes;
+    uint32_t flash_sector_size;
+    uint32_t reserved;
+} trace_header;
+
+typedef struct
+{
+    uint64_t time;                  // ns since tracing started, at the call
+    uint64_t addr;                  // byte address within the layer
+    uint32_t len;
+    uint32_t nsecs;                 // time the call took
+    uint8_t layer;
+    uint8_t op;
+    uint8_t reserved[6];
+} trace_record;
+
+#endif // FATFSTRACE_H
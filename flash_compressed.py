@@ -0,0 +1,106 @@
+#!/usr/bin/env python
+#
+# Flashes a zlib compressed image made by "fatfsimage --compress" using
+# esptool's compressed upload commands, without decompressing and
+# recompressing it first the way "esptool.py write_flash" would.
+#
+# Usage: flash_compressed.py --esptool-dir DIR [--port PORT] [--baud BAUD]
+#                            <offset> <image.z>
+#
+
+from __future__ import print_function
+
+import argparse
+import hashlib
+import sys
+import time
+import zlib
+
+
+def connect(args):
+    """Connects to the chip and starts the stub at the requested baud rate."""
+    if args.esptool_dir:
+        sys.path.insert(0, args.esptool_dir)
+    import esptool
+
+    port = args.port or esptool.ESPLoader.DEFAULT_PORT
+    esp = esptool.ESPLoader.detect_chip(port, esptool.ESPLoader.ESP_ROM_BAUD, args.before)
+    print("Connected to %s" % esp.get_chip_description())
+
+    esp = esp.run_stub()
+    if args.baud > esptool.ESPLoader.ESP_ROM_BAUD:
+        esp.change_baud(args.baud)
+
+    return esp
+
+
+def write_deflated(esp, offset, raw, data):
+    """Uploads zlib stream "data" of "raw" at "offset" and verifies it."""
+    import esptool
+
+    digest = hashlib.md5(raw).hexdigest()
+
+    start = time.time()
+    blocks = esp.flash_defl_begin(len(raw), len(data), offset)
+
+    seq = 0
+    pos = 0
+    while pos < len(data):
+        print("\rWriting at 0x%08x... (%d %%)" % (offset + seq * esp.FLASH_WRITE_SIZE, 100 * (seq + 1) // blocks), end="")
+        sys.stdout.flush()
+        esp.flash_defl_block(data[pos:pos + esp.FLASH_WRITE_SIZE], seq)
+        pos += esp.FLASH_WRITE_SIZE
+        seq += 1
+
+    # The stub acks each block before writing it, so wait for the last one
+    esp.read_reg(esptool.ESPLoader.CHIP_DETECT_MAGIC_REG_ADDR)
+    elapsed = max(time.time() - start, 0.001)
+
+    print("\rWrote %d bytes (%d compressed) at 0x%08x in %.1f seconds (%.1f kbit/s)..." %
+          (len(raw), len(data), offset, elapsed, len(raw) / elapsed * 8 / 1000))
+
+    res = esp.flash_md5sum(offset, len(raw))
+    if res != digest:
+        print("Verify failed: flash has %s, image has %s" % (res, digest))
+        sys.exit(1)
+    print("Hash of data verified.")
+
+
+def add_arguments(parser):
+    parser.add_argument("--esptool-dir", help="directory holding esptool.py")
+    parser.add_argument("--port", "-p", default=None, help="serial port")
+    parser.add_argument("--baud", "-b", type=int, default=115200, help="upload baud rate")
+    parser.add_argument("--before", default="default_reset", help="reset mode before connecting")
+    parser.add_argument("--after", default="hard_reset", choices=["hard_reset", "no_reset"], help="what to do when done")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Flash a zlib compressed fatfsimage image.")
+    add_arguments(parser)
+    parser.add_argument("offset", type=lambda x: int(x, 0), help="flash offset")
+    parser.add_argument("image", help="compressed image")
+    parser.add_argument("--save-raw", metavar="FILE", help="write the uncompressed image to FILE once it's flashed")
+    args = parser.parse_args()
+
+    with open(args.image, "rb") as f:
+        data = f.read()
+
+    # The uncompressed size and digest are needed for the upload and to
+    # verify it afterwards
+    raw = zlib.decompress(data)
+
+    esp = connect(args)
+    write_deflated(esp, args.offset, raw, data)
+
+    # Only reached when the flash verified, so FILE is what the device has
+    if args.save_raw:
+        with open(args.save_raw, "wb") as f:
+            f.write(raw)
+
+    if args.after == "hard_reset":
+        print("Hard resetting...")
+        esp.hard_reset()
+
+
+if __name__ == "__main__":
+    main()
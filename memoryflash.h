@@ -0,0 +1,109 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// ============================================================================
+// Plain memory backed flash
+//
+// Used by fatfsimage for its scratch volumes and by fatfstrace to replay a
+// trace into memory.
+// ============================================================================
+
+#ifndef MEMORYFLASH_H
+#define MEMORYFLASH_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_err.h"
+#include "Flash_Access.h"
+
+#define MEMORYFLASH_SECTOR_SIZE 4096
+
+class MemoryFlash : public Flash_Access
+{
+public:
+    // Scratch volumes that are formatted before use needn't start out
+    // erased, which also leaves the memory untouched until it's used
+    MemoryFlash(size_t size, bool erased = true)
+    {
+        bytes = size;
+        mem = (uint8_t *) malloc(size);
+        if (mem && erased)
+        {
+            memset(mem, 0xff, size);
+        }
+    }
+
+    virtual ~MemoryFlash()
+    {
+        free(mem);
+    }
+
+    bool valid()
+    {
+        return mem != NULL;
+    }
+
+    virtual size_t chip_size() final
+    {
+        return bytes;
+    }
+
+    virtual esp_err_t erase_sector(size_t sector) final
+    {
+        return erase_range(sector * MEMORYFLASH_SECTOR_SIZE, MEMORYFLASH_SECTOR_SIZE);
+    }
+
+    virtual esp_err_t erase_range(size_t start_address, size_t size) final
+    {
+        if (start_address + size > bytes)
+        {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        memset(&mem[start_address], 0xff, size);
+        return ESP_OK;
+    }
+
+    virtual esp_err_t write(size_t dest_addr, const void *src, size_t size) final
+    {
+        if (dest_addr + size > bytes)
+        {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        memcpy(&mem[dest_addr], src, size);
+        return ESP_OK;
+    }
+
+    virtual esp_err_t read(size_t src_addr, void *dest, size_t size) final
+    {
+        if (src_addr + size > bytes)
+        {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        memcpy(dest, &mem[src_addr], size);
+        return ESP_OK;
+    }
+
+    virtual size_t sector_size() final
+    {
+        return MEMORYFLASH_SECTOR_SIZE;
+    }
+
+private:
+    uint8_t *mem;
+    size_t bytes;
+};
+
+#endif // MEMORYFLASH_H
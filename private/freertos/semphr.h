@@ -6,5 +6,9 @@
 #undef FF_FS_REENTRANT
 #define FF_FS_REENTRANT 0
 
+// f_expand() is needed to preallocate contiguous files
+#undef FF_USE_EXPAND
+#define FF_USE_EXPAND 1
+
 #endif
 
@@ -0,0 +1,149 @@
+#!/usr/bin/env python
+#
+# Works with the sparse images written by "fatfsimage --sparse", which store
+# only the flash sectors holding data and record runs of erased (0xFF)
+# sectors as fill chunks.
+#
+# Usage: sparse.py info <image.sparse>
+#        sparse.py raw <image.sparse> <image.bin>
+#        sparse.py flash --esptool-dir DIR [--port PORT] [--baud BAUD]
+#                        <offset> <image.sparse>
+#
+# "flash" erases the fill ranges on the device instead of sending them and
+# uploads each data range compressed, verifying it afterwards.
+#
+
+from __future__ import print_function
+
+import argparse
+import struct
+import sys
+import zlib
+
+import flash_compressed
+
+SPARSE_MAGIC = b"FFISPARS"
+SPARSE_VERSION = 1
+SPARSE_DATA = 1
+SPARSE_FILL = 2
+
+HEADER = struct.Struct("<8sIIQII")
+CHUNK = struct.Struct("<IIII")
+
+
+def load(path):
+    """Returns the sector size, image size and a list of
+    (offset, type, fill, data) ranges, with adjacent chunks of the same
+    type merged."""
+    with open(path, "rb") as f:
+        data = f.read()
+
+    magic, version, sector_size, image_bytes, chunks, _ = HEADER.unpack_from(data, 0)
+    if magic != SPARSE_MAGIC or version != SPARSE_VERSION:
+        raise ValueError("%s is not a version %d sparse image" % (path, SPARSE_VERSION))
+
+    ranges = []
+    pos = HEADER.size
+    offset = 0
+    for _ in range(chunks):
+        ctype, sectors, fill, _ = CHUNK.unpack_from(data, pos)
+        pos += CHUNK.size
+        size = sectors * sector_size
+
+        if ctype == SPARSE_DATA:
+            chunk = data[pos:pos + size]
+            pos += size
+        elif ctype == SPARSE_FILL:
+            chunk = None
+        else:
+            raise ValueError("%s has an unknown chunk type %d" % (path, ctype))
+
+        if ranges and ranges[-1][1] == ctype and ranges[-1][2] == fill:
+            prev = ranges[-1]
+            ranges[-1] = (prev[0], ctype, fill, prev[3] + chunk if chunk is not None else None)
+        else:
+            ranges.append((offset, ctype, fill, chunk))
+        offset += size
+
+    if offset != image_bytes:
+        raise ValueError("%s covers %d of %d bytes" % (path, offset, image_bytes))
+
+    return sector_size, image_bytes, ranges
+
+
+def info(args):
+    sector_size, image_bytes, ranges = load(args.image)
+    stored = 0
+    for i, r in enumerate(ranges):
+        end = ranges[i + 1][0] if i + 1 < len(ranges) else image_bytes
+        if r[1] == SPARSE_DATA:
+            stored += end - r[0]
+            print("0x%08x-0x%08x data" % (r[0], end))
+        else:
+            print("0x%08x-0x%08x fill 0x%02x" % (r[0], end, r[2]))
+    print("%d bytes, %d stored (%.1f%%), %d byte sectors" %
+          (image_bytes, stored, 100.0 * stored / image_bytes, sector_size))
+
+
+def raw(args):
+    _, image_bytes, ranges = load(args.image)
+    with open(args.output, "wb") as f:
+        for i, r in enumerate(ranges):
+            end = ranges[i + 1][0] if i + 1 < len(ranges) else image_bytes
+            if r[1] == SPARSE_DATA:
+                f.write(r[3])
+            else:
+                f.write(bytearray([r[2]]) * (end - r[0]))
+
+
+def flash(args):
+    _, image_bytes, ranges = load(args.image)
+    esp = flash_compressed.connect(args)
+
+    for i, r in enumerate(ranges):
+        end = ranges[i + 1][0] if i + 1 < len(ranges) else image_bytes
+        offset = args.offset + r[0]
+        if r[1] == SPARSE_DATA:
+            flash_compressed.write_deflated(esp, offset, r[3], zlib.compress(r[3], 9))
+        elif r[2] == 0xff:
+            print("Erasing 0x%08x-0x%08x..." % (offset, args.offset + end))
+            esp.erase_region(offset, end - r[0])
+        else:
+            data = bytearray([r[2]]) * (end - r[0])
+            flash_compressed.write_deflated(esp, offset, data, zlib.compress(bytes(data), 9))
+
+    if args.after == "hard_reset":
+        print("Hard resetting...")
+        esp.hard_reset()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Inspect, expand or flash a sparse fatfsimage image.")
+    sub = parser.add_subparsers(dest="command")
+    sub.required = True
+
+    p = sub.add_parser("info", help="list the ranges in a sparse image")
+    p.add_argument("image", help="sparse image")
+    p.set_defaults(func=info)
+
+    p = sub.add_parser("raw", help="expand a sparse image to a raw one")
+    p.add_argument("image", help="sparse image")
+    p.add_argument("output", help="raw image to write")
+    p.set_defaults(func=raw)
+
+    p = sub.add_parser("flash", help="flash a sparse image")
+    flash_compressed.add_arguments(p)
+    p.add_argument("offset", type=lambda x: int(x, 0), help="flash offset")
+    p.add_argument("image", help="sparse image")
+    p.set_defaults(func=flash)
+
+    args = parser.parse_args()
+    try:
+        args.func(args)
+    except ValueError as e:
+        print(e)
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()